@@ -0,0 +1,1108 @@
+﻿#pragma once
+
+//---------------------------------------------------------------------------//
+//
+// AsyncIO.hpp
+//  ファイルの非同期一括読み込み (io_uring / IOCP)
+//   Copyright (C) 2017 tapetums
+//
+//  Linux では io_uring, Windows では I/O 完了ポートを使う
+//  io_uring が使えない環境 (古いカーネルや seccomp で禁止されている場合) と
+//  その他の POSIX では, 数本のスレッドが pread で読む
+//
+//  同時に発行中にできる要求は depth 個まで. それ以上は空きが出るまで Submit が待つ
+//  (完了通知の中から出した要求は待たずに溜めておき, 枠が空いたところで発行する)
+//  完了通知 (IoCompletion) には読めたバイト数か, 負のエラーコード
+//  (-errno / -GetLastError()) が渡される. 終端を越えた分は短く読める
+//  ThreadPool を渡すと完了通知はそのプールのタスクとして実行され,
+//  渡さなければ完了を受け取ったスレッドでそのまま呼ばれる (長い処理はしないこと)
+//
+//---------------------------------------------------------------------------//
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+  #include <windows.h>
+#else
+  #include <unistd.h>
+  #if defined(__linux__)
+    #include <linux/io_uring.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+    #include <sys/uio.h>
+  #endif
+#endif
+
+#if defined(max)
+  #undef max
+#endif
+#if defined(min)
+  #undef min
+#endif
+
+#include "IoBuffer.hpp"
+#include "Task.hpp"
+
+//---------------------------------------------------------------------------//
+// Forward Declarations
+//---------------------------------------------------------------------------//
+
+namespace tapetums
+{
+    class IoEngine;
+    class IoBatch;
+
+    using IoCompletion = unique_task<void (int64_t)>;
+
+    namespace detail
+    {
+        struct IoOp;
+    }
+}
+
+//---------------------------------------------------------------------------//
+// IoOp
+//  発行中の読み込み要求ひとつ分. 完了を配送した時点で破棄する
+//---------------------------------------------------------------------------//
+
+struct tapetums::detail::IoOp
+{
+  #if defined(_WIN32)
+    OVERLAPPED ov;      // 先頭に置くこと (完了ポートから戻るのはこのアドレス)
+    HANDLE     handle;
+  #else
+    int        handle;
+  #endif
+    int64_t      offset;
+    void*        buf;
+    uint32_t     size;
+    IoCompletion completion;
+
+  #if defined(_WIN32)
+    IoOp(HANDLE h, int64_t off, void* b, size_t cb, IoCompletion&& c) noexcept
+  #else
+    IoOp(int h, int64_t off, void* b, size_t cb, IoCompletion&& c) noexcept
+  #endif
+        : handle(h), offset(off), buf(b), completion(std::move(c))
+    {
+        // 1 回で読めるのは 32 ビット分まで (それ以上は短く読める)
+        size = (uint32_t)std::min<size_t>(cb, std::numeric_limits<uint32_t>::max());
+
+      #if defined(_WIN32)
+        ::memset(&ov, 0, sizeof(ov));
+        ov.Offset     = (DWORD)(uint64_t(off) & 0xFFFFFFFF);
+        ov.OffsetHigh = (DWORD)(uint64_t(off) >> 32);
+      #endif
+    }
+};
+
+//---------------------------------------------------------------------------//
+// IoEngine
+//  読み込み要求をまとめて発行し, 完了を受け取るスレッドを持つ
+//---------------------------------------------------------------------------//
+
+class tapetums::IoEngine final
+{
+public:
+  #if defined(_WIN32)
+    using handle_type = HANDLE;
+  #else
+    using handle_type = int;
+  #endif
+
+    enum class BACKEND : uint32_t
+    {
+        URING,   // io_uring (Linux)
+        IOCP,    // I/O 完了ポート (Windows)
+        THREADS, // pread するスレッド
+    };
+
+    static constexpr uint32_t DEFAULT_DEPTH { 64 };
+    static constexpr uint32_t THREAD_COUNT  { 4 }; // THREADS で使うスレッドの数
+
+private:
+    BACKEND     m_backend;
+    uint32_t    m_depth;
+    ThreadPool* m_pool;
+
+    std::mutex                m_mutex;
+    std::condition_variable   m_done;
+    uint32_t                  m_inflight   { 0 }; // 枠を使っている要求
+    uint32_t                  m_delivering { 0 }; // 枠を返して完了通知を配送中の要求
+    std::deque<detail::IoOp*> m_backlog;          // 完了スレッドから出され, 枠が空くのを待つ要求
+
+    std::vector<std::thread> m_threads;
+
+  #if defined(_WIN32)
+    HANDLE m_port { nullptr };
+  #else
+    std::condition_variable   m_work;
+    std::deque<detail::IoOp*> m_queue;
+    bool                      m_stop { false };
+  #endif
+
+  #if defined(__linux__)
+    int            m_ring        { -1 };
+    void*          m_sq_ptr      { nullptr };
+    size_t         m_sq_len      { 0 };
+    void*          m_cq_ptr      { nullptr };
+    size_t         m_cq_len      { 0 };
+    io_uring_sqe*  m_sqes        { nullptr };
+    size_t         m_sqes_len    { 0 };
+    unsigned*      m_sq_head     { nullptr };
+    unsigned*      m_sq_tail     { nullptr };
+    unsigned       m_sq_mask     { 0 };
+    unsigned*      m_cq_head     { nullptr };
+    unsigned*      m_cq_tail     { nullptr };
+    unsigned       m_cq_mask     { 0 };
+    io_uring_cqe*  m_cqes        { nullptr };
+    unsigned       m_unsubmitted { 0 };
+
+    std::vector<IoBuffer> m_buffers;
+  #endif
+
+public:
+    explicit IoEngine(uint32_t depth = DEFAULT_DEPTH, ThreadPool* pool = nullptr);
+    ~IoEngine();
+
+    IoEngine(const IoEngine&)             = delete;
+    IoEngine& operator =(const IoEngine&) = delete;
+
+    IoEngine(IoEngine&&)             = delete;
+    IoEngine& operator =(IoEngine&&) = delete;
+
+public:
+    static IoEngine& Default();
+
+public:
+    BACKEND  backend() const noexcept { return m_backend; }
+    uint32_t depth()   const noexcept { return m_depth; }
+    uint32_t pending();
+
+public:
+    bool Attach           (handle_type handle);
+    bool RegisterBuffers  (const IoBuffer* buffers, size_t count);
+    void UnregisterBuffers();
+    void Read             (handle_type handle, int64_t offset, void* buf, size_t size, IoCompletion&& completion);
+    void Submit           (IoBatch& batch);
+    void Post             (IoCompletion&& completion, int64_t result);
+    void Drain            ();
+
+private:
+    void Enqueue(detail::IoOp* const* ops, size_t count);
+    void Deliver(detail::IoOp* op, int64_t result);
+    void Retire (uint32_t count);
+    void Resume (std::vector<detail::IoOp*>& resumed, std::vector<std::pair<detail::IoOp*, int64_t>>& failed);
+    void Reap   ();
+
+    bool on_engine_thread() const noexcept;
+
+  #if defined(_WIN32)
+    void Issue(detail::IoOp* op);
+  #endif
+
+  #if ! defined(_WIN32)
+    void Work();
+  #endif
+
+  #if defined(__linux__)
+    bool SetupRing   (uint32_t depth);
+    bool ProbeRing   ();
+    void CloseRing   ();
+    void Push        (detail::IoOp* op, uint64_t user_data);
+    void Flush       (std::vector<std::pair<detail::IoOp*, int64_t>>& failed);
+    void Unregister  ();
+  #endif
+};
+
+//---------------------------------------------------------------------------//
+
+constexpr uint32_t tapetums::IoEngine::DEFAULT_DEPTH;
+constexpr uint32_t tapetums::IoEngine::THREAD_COUNT;
+
+//---------------------------------------------------------------------------//
+// IoBatch
+//  要求を溜めておき, Submit でまとめて発行する
+//  Submit しないまま破棄すると, 溜まっている分はその時点で発行される
+//---------------------------------------------------------------------------//
+
+class tapetums::IoBatch final
+{
+    friend class IoEngine;
+
+private:
+    IoEngine&                  m_engine;
+    std::vector<detail::IoOp*> m_ops;
+
+public:
+    explicit IoBatch(IoEngine& engine = IoEngine::Default()) : m_engine(engine) { }
+    ~IoBatch() { Submit(); }
+
+    IoBatch(const IoBatch&)             = delete;
+    IoBatch& operator =(const IoBatch&) = delete;
+
+public:
+    IoEngine& engine() const noexcept { return m_engine; }
+    size_t    size()   const noexcept { return m_ops.size(); }
+    bool      empty()  const noexcept { return m_ops.empty(); }
+
+public:
+    IoBatch& Read(IoEngine::handle_type handle, int64_t offset, void* buf, size_t size, IoCompletion&& completion);
+    void     Submit();
+};
+
+//---------------------------------------------------------------------------//
+// IoEngine コンストラクタ
+//---------------------------------------------------------------------------//
+
+inline tapetums::IoEngine::IoEngine
+(
+    uint32_t depth, ThreadPool* pool
+)
+    : m_depth(std::max<uint32_t>(depth, 1)), m_pool(pool)
+{
+  #if defined(_WIN32)
+    m_backend = BACKEND::IOCP;
+    m_port = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+    m_threads.emplace_back([this]() { Reap(); });
+  #else
+  #if defined(__linux__)
+    if ( SetupRing(m_depth) )
+    {
+        m_backend = BACKEND::URING;
+        m_threads.emplace_back([this]() { Reap(); });
+        return;
+    }
+  #endif
+    m_backend = BACKEND::THREADS;
+    for ( uint32_t i = 0; i < std::min(m_depth, THREAD_COUNT); ++i )
+    {
+        m_threads.emplace_back([this]() { Work(); });
+    }
+  #endif
+}
+
+//---------------------------------------------------------------------------//
+// IoEngine デストラクタ
+//  発行済みの要求が全て完了してから止める
+//---------------------------------------------------------------------------//
+
+inline tapetums::IoEngine::~IoEngine()
+{
+    Drain();
+
+  #if defined(_WIN32)
+    ::PostQueuedCompletionStatus(m_port, 0, 0, nullptr);
+  #else
+    if ( m_backend == BACKEND::THREADS )
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_work.notify_all();
+    }
+  #if defined(__linux__)
+    else
+    {
+        // user_data が 0 の NOP を完了スレッドへの停止の合図にする
+        // (渡せなければ完了スレッドの io_uring_enter も失敗して抜ける)
+        std::vector<std::pair<detail::IoOp*, int64_t>> failed;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Push(nullptr, 0);
+        Flush(failed);
+    }
+  #endif
+  #endif
+
+    for ( auto& thread: m_threads )
+    {
+        thread.join();
+    }
+
+  #if defined(_WIN32)
+    if ( m_port ) { ::CloseHandle(m_port); }
+  #elif defined(__linux__)
+    CloseRing();
+  #endif
+}
+
+//---------------------------------------------------------------------------//
+// IoEngine メソッド
+//---------------------------------------------------------------------------//
+
+// 既定のエンジン (完了通知は完了スレッドで呼ばれる)
+inline tapetums::IoEngine& tapetums::IoEngine::Default()
+{
+    static IoEngine engine;
+    return engine;
+}
+
+//---------------------------------------------------------------------------//
+
+// 発行済みで完了を配送していない要求の数
+inline uint32_t tapetums::IoEngine::pending()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_inflight + m_delivering + (uint32_t)m_backlog.size();
+}
+
+//---------------------------------------------------------------------------//
+
+// ハンドルを完了ポートに結び付ける
+//  Windows では FILE_FLAG_OVERLAPPED で開いたハンドルを一度だけ渡すこと
+//  (ひとつのハンドルは複数のエンジンに結び付けられない). それ以外では何もしない
+inline bool tapetums::IoEngine::Attach
+(
+    handle_type handle
+)
+{
+  #if defined(_WIN32)
+    return ::CreateIoCompletionPort(handle, m_port, 1, 0) != nullptr;
+  #else
+    (void)handle;
+    return true;
+  #endif
+}
+
+//---------------------------------------------------------------------------//
+
+// 読み込み先の領域をカーネルに登録する (io_uring のみ)
+//  登録した領域に収まる読み込みは IORING_OP_READ_FIXED になり,
+//  要求のたびにページを固定し直さずに済む
+//  発行中の要求がない時に呼ぶこと. RLIMIT_MEMLOCK を超えると失敗する
+inline bool tapetums::IoEngine::RegisterBuffers
+(
+    const IoBuffer* buffers, size_t count
+)
+{
+  #if defined(__linux__)
+    if ( m_backend != BACKEND::URING ) { return false; }
+
+    Drain();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    Unregister();
+
+    std::vector<iovec> iov(count);
+    for ( size_t i = 0; i < count; ++i )
+    {
+        iov[i].iov_base = buffers[i].data;
+        iov[i].iov_len  = buffers[i].size;
+    }
+
+    const auto ret = ::syscall
+    (
+        __NR_io_uring_register, m_ring, IORING_REGISTER_BUFFERS,
+        iov.data(), (unsigned)count
+    );
+    if ( ret < 0 )
+    {
+        return false;
+    }
+
+    m_buffers.assign(buffers, buffers + count);
+    return true;
+  #else
+    (void)buffers; (void)count;
+    return false;
+  #endif
+}
+
+//---------------------------------------------------------------------------//
+
+// 登録した領域を解除する
+inline void tapetums::IoEngine::UnregisterBuffers()
+{
+  #if defined(__linux__)
+    if ( m_backend != BACKEND::URING ) { return; }
+
+    Drain();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Unregister();
+  #endif
+}
+
+//---------------------------------------------------------------------------//
+
+// offset から size バイトを buf へ読み込む要求をひとつ発行する
+//  buf は完了通知が呼ばれるまで有効であること
+inline void tapetums::IoEngine::Read
+(
+    handle_type handle, int64_t offset, void* buf, size_t size, IoCompletion&& completion
+)
+{
+    auto op = new detail::IoOp(handle, offset, buf, size, std::move(completion));
+    Enqueue(&op, 1);
+}
+
+//---------------------------------------------------------------------------//
+
+// バッチに溜まっている要求をまとめて発行する
+inline void tapetums::IoEngine::Submit
+(
+    IoBatch& batch
+)
+{
+    if ( batch.m_ops.empty() ) { return; }
+
+    Enqueue(batch.m_ops.data(), batch.m_ops.size());
+    batch.m_ops.clear();
+}
+
+//---------------------------------------------------------------------------//
+
+// 完了通知を配送先 (ThreadPool もしくはこのスレッド) で呼ぶ
+inline void tapetums::IoEngine::Post
+(
+    IoCompletion&& completion, int64_t result
+)
+{
+    if ( ! completion ) { return; }
+
+    if ( m_pool )
+    {
+        m_pool->AddTask([completion = std::move(completion), result](TaskWorker&) mutable
+        {
+            completion(result);
+        });
+    }
+    else
+    {
+        completion(result);
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// 発行済みの要求が全て完了するまで待つ
+//  ThreadPool に配送する場合は, 投入し終わるまで
+inline void tapetums::IoEngine::Drain()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this]() { return m_inflight == 0 && m_delivering == 0 && m_backlog.empty(); });
+}
+
+//---------------------------------------------------------------------------//
+
+// 要求を発行する. 枠が埋まっていれば空くまで待つ
+//  完了スレッド (完了通知の中) からは待たない. 枠を返すのはそのスレッドなので,
+//  待つと誰も枠を返せなくなる. 溜めておいて Retire で発行する
+inline void tapetums::IoEngine::Enqueue
+(
+    detail::IoOp* const* ops, size_t count
+)
+{
+    const auto deferrable = on_engine_thread();
+
+  #if defined(_WIN32)
+    for ( size_t i = 0; i < count; ++i )
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if ( deferrable && (m_inflight >= m_depth || ! m_backlog.empty()) )
+            {
+                m_backlog.push_back(ops[i]);
+                continue;
+            }
+            m_done.wait(lock, [this]() { return m_inflight < m_depth; });
+            ++m_inflight;
+        }
+
+        Issue(ops[i]);
+    }
+  #else
+  #if defined(__linux__)
+    std::vector<std::pair<detail::IoOp*, int64_t>> failed;
+  #endif
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    for ( size_t i = 0; i < count; ++i )
+    {
+        if ( deferrable && (m_inflight >= m_depth || ! m_backlog.empty()) )
+        {
+            m_backlog.push_back(ops[i]);
+            continue;
+        }
+        if ( m_inflight >= m_depth )
+        {
+          #if defined(__linux__)
+            if ( m_backend == BACKEND::URING ) { Flush(failed); }
+          #endif
+            m_work.notify_all();
+            m_done.wait(lock, [this]() { return m_inflight < m_depth; });
+        }
+        ++m_inflight;
+
+      #if defined(__linux__)
+        if ( m_backend == BACKEND::URING )
+        {
+            Push(ops[i], (uint64_t)(uintptr_t)ops[i]);
+            continue;
+        }
+      #endif
+        m_queue.push_back(ops[i]);
+    }
+
+  #if defined(__linux__)
+    if ( m_backend == BACKEND::URING )
+    {
+        Flush(failed);
+
+        // 渡せずに枠が戻ったら, 溜めてある要求に回す
+        std::vector<detail::IoOp*> resumed;
+        Resume(resumed, failed);
+        lock.unlock();
+        m_done.notify_all();
+
+        // カーネルに渡せなかった要求は, ロックを離してから失敗として配送する
+        for ( const auto& f : failed )
+        {
+            Deliver(f.first, f.second);
+        }
+        return;
+    }
+  #endif
+
+    lock.unlock();
+    m_work.notify_all();
+  #endif
+}
+
+//---------------------------------------------------------------------------//
+
+// 要求を破棄して完了通知を配送する (Retire で枠を返してから呼ぶ)
+inline void tapetums::IoEngine::Deliver
+(
+    detail::IoOp* op, int64_t result
+)
+{
+    IoCompletion completion { std::move(op->completion) };
+    delete op;
+
+    Post(std::move(completion), result);
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        --m_delivering;
+    }
+    m_done.notify_all();
+}
+
+//---------------------------------------------------------------------------//
+
+// 完了した分の枠を返す
+//  完了通知の中から次の要求を出せるよう, 配送より先に返しておく
+//  完了スレッドが溜めた要求があれば, 待っている他のスレッドより先に空いた枠で発行する
+inline void tapetums::IoEngine::Retire
+(
+    uint32_t count
+)
+{
+    if ( count == 0 ) { return; }
+
+    std::vector<detail::IoOp*>                     resumed;
+    std::vector<std::pair<detail::IoOp*, int64_t>> failed;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_inflight   -= count;
+        m_delivering += count;
+
+        Resume(resumed, failed);
+    }
+    m_done.notify_all();
+
+  #if defined(_WIN32)
+    for ( const auto op : resumed )
+    {
+        Issue(op);
+    }
+  #else
+    m_work.notify_all();
+  #endif
+
+    for ( const auto& f : failed )
+    {
+        Deliver(f.first, f.second);
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// 溜めてある要求を空いた枠で発行する (m_mutex を取ってから呼ぶ)
+//  Windows ではロックを離してから resumed を Issue すること
+//  カーネルに渡せなかった要求は failed に積む (配送はロックを離してから)
+inline void tapetums::IoEngine::Resume
+(
+    std::vector<detail::IoOp*>& resumed, std::vector<std::pair<detail::IoOp*, int64_t>>& failed
+)
+{
+    while ( ! m_backlog.empty() && m_inflight < m_depth )
+    {
+        while ( ! m_backlog.empty() && m_inflight < m_depth )
+        {
+            const auto op = m_backlog.front();
+            m_backlog.pop_front();
+            ++m_inflight;
+
+          #if defined(_WIN32)
+            resumed.push_back(op);
+          #else
+          #if defined(__linux__)
+            if ( m_backend == BACKEND::URING )
+            {
+                Push(op, (uint64_t)(uintptr_t)op);
+                continue;
+            }
+          #endif
+            m_queue.push_back(op);
+          #endif
+        }
+
+        // 渡せずに枠が戻った分は, 続けて次の要求に回す
+      #if defined(__linux__)
+        if ( m_backend == BACKEND::URING ) { Flush(failed); }
+      #endif
+    }
+
+  #if ! defined(_WIN32)
+    (void)resumed;
+  #endif
+  #if ! defined(__linux__)
+    (void)failed;
+  #endif
+}
+
+//---------------------------------------------------------------------------//
+
+// このエンジンの完了スレッド (読み込みスレッド) の中か
+inline bool tapetums::IoEngine::on_engine_thread() const noexcept
+{
+    const auto id = std::this_thread::get_id();
+    for ( const auto& thread : m_threads )
+    {
+        if ( thread.get_id() == id ) { return true; }
+    }
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+
+#if defined(_WIN32)
+
+// 枠を取った要求を発行する
+inline void tapetums::IoEngine::Issue
+(
+    detail::IoOp* op
+)
+{
+    if ( ! ::ReadFile(op->handle, op->buf, op->size, nullptr, &op->ov) )
+    {
+        const auto error = ::GetLastError();
+        if ( error != ERROR_IO_PENDING )
+        {
+            // 完了ポートには何も届かないので, ここで配送する
+            Retire(1);
+            Deliver(op, (error == ERROR_HANDLE_EOF) ? 0 : -(int64_t)error);
+        }
+    }
+}
+
+#endif
+
+//---------------------------------------------------------------------------//
+
+// 完了スレッド (URING / IOCP)
+inline void tapetums::IoEngine::Reap()
+{
+  #if defined(_WIN32)
+    for ( ;; )
+    {
+        DWORD       cb  { 0 };
+        ULONG_PTR   key { 0 };
+        OVERLAPPED* ov  { nullptr };
+
+        const auto ok = ::GetQueuedCompletionStatus(m_port, &cb, &key, &ov, INFINITE);
+        if ( ov == nullptr )
+        {
+            if ( ! ok || key == 0 ) { break; } // 停止の合図 (もしくはポートが閉じられた)
+            continue;
+        }
+
+        int64_t result = cb;
+        if ( ! ok )
+        {
+            const auto error = ::GetLastError();
+            result = (error == ERROR_HANDLE_EOF) ? 0 : -(int64_t)error;
+        }
+
+        Retire(1);
+        Deliver(reinterpret_cast<detail::IoOp*>(ov), result);
+    }
+  #elif defined(__linux__)
+    std::vector<std::pair<detail::IoOp*, int64_t>> done;
+
+    bool stop { false };
+    while ( ! stop )
+    {
+        const auto ret = ::syscall
+        (
+            __NR_io_uring_enter, m_ring, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0
+        );
+        if ( ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY )
+        {
+            break;
+        }
+
+        // CQ の head を書くのはこのスレッドだけ
+        done.clear();
+        auto head = *m_cq_head;
+        const auto tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+        while ( head != tail )
+        {
+            const auto& cqe = m_cqes[head & m_cq_mask];
+            const auto op     = reinterpret_cast<detail::IoOp*>((uintptr_t)cqe.user_data);
+            const auto result = (int64_t)cqe.res;
+
+            ++head;
+            __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+
+            if ( op == nullptr )
+            {
+                stop = true;
+                continue;
+            }
+
+            done.emplace_back(op, result);
+        }
+
+        Retire((uint32_t)done.size());
+        for ( const auto& d : done )
+        {
+            Deliver(d.first, d.second);
+        }
+    }
+  #endif
+}
+
+//---------------------------------------------------------------------------//
+
+#if ! defined(_WIN32)
+
+// 読み込みスレッド (THREADS)
+inline void tapetums::IoEngine::Work()
+{
+    for ( ;; )
+    {
+        detail::IoOp* op { nullptr };
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_work.wait(lock, [this]() { return m_stop || ! m_queue.empty(); });
+            if ( m_queue.empty() ) { return; }
+
+            op = m_queue.front();
+            m_queue.pop_front();
+        }
+
+        ssize_t ret;
+        do
+        {
+            ret = ::pread(op->handle, op->buf, op->size, (off_t)op->offset);
+        }
+        while ( ret < 0 && errno == EINTR );
+
+        const auto result = (ret < 0) ? -(int64_t)errno : (int64_t)ret;
+        Retire(1);
+        Deliver(op, result);
+    }
+}
+
+#endif
+
+//---------------------------------------------------------------------------//
+
+#if defined(__linux__)
+
+// io_uring を用意する
+inline bool tapetums::IoEngine::SetupRing
+(
+    uint32_t depth
+)
+{
+    io_uring_params params;
+    ::memset(&params, 0, sizeof(params));
+
+    m_ring = (int)::syscall(__NR_io_uring_setup, depth, &params);
+    if ( m_ring < 0 )
+    {
+        m_ring = -1;
+        return false;
+    }
+
+    m_sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cq_len = params.cq_off.cqes  + params.cq_entries * sizeof(io_uring_cqe);
+    if ( params.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        m_sq_len = m_cq_len = std::max(m_sq_len, m_cq_len);
+    }
+
+    m_sq_ptr = ::mmap
+    (
+        nullptr, m_sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        m_ring, IORING_OFF_SQ_RING
+    );
+    if ( m_sq_ptr == MAP_FAILED )
+    {
+        m_sq_ptr = nullptr;
+        CloseRing();
+        return false;
+    }
+
+    if ( params.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        m_cq_ptr = m_sq_ptr;
+    }
+    else
+    {
+        m_cq_ptr = ::mmap
+        (
+            nullptr, m_cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            m_ring, IORING_OFF_CQ_RING
+        );
+        if ( m_cq_ptr == MAP_FAILED )
+        {
+            m_cq_ptr = nullptr;
+            CloseRing();
+            return false;
+        }
+    }
+
+    m_sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+    m_sqes = (io_uring_sqe*)::mmap
+    (
+        nullptr, m_sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        m_ring, IORING_OFF_SQES
+    );
+    if ( m_sqes == MAP_FAILED )
+    {
+        m_sqes = nullptr;
+        CloseRing();
+        return false;
+    }
+
+    const auto sq = (uint8_t*)m_sq_ptr;
+    const auto cq = (uint8_t*)m_cq_ptr;
+
+    m_sq_head = (unsigned*)(sq + params.sq_off.head);
+    m_sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    m_sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    m_cq_head = (unsigned*)(cq + params.cq_off.head);
+    m_cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    m_cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    m_cqes    = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // SQ の添字は SQE の並びと 1 対 1 にしておく
+    const auto array = (unsigned*)(sq + params.sq_off.array);
+    for ( unsigned i = 0; i < params.sq_entries; ++i )
+    {
+        array[i] = i;
+    }
+
+    // IORING_OP_READ は 5.6 から. 無ければスレッドで読む
+    if ( ! ProbeRing() )
+    {
+        CloseRing();
+        return false;
+    }
+
+    // 発行中の数を SQ の長さで抑えれば, CQ (SQ の 2 倍) はあふれない
+    m_depth = params.sq_entries;
+
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+
+// 使う操作をカーネルが扱えるか調べる
+//  IORING_REGISTER_PROBE が無いカーネル (5.6 より前) は IORING_OP_READ も無い
+inline bool tapetums::IoEngine::ProbeRing()
+{
+    constexpr unsigned OP_COUNT { 256 };
+
+    std::vector<uint8_t> buf(sizeof(io_uring_probe) + OP_COUNT * sizeof(io_uring_probe_op));
+    const auto probe = (io_uring_probe*)buf.data();
+
+    const auto ret = ::syscall
+    (
+        __NR_io_uring_register, m_ring, IORING_REGISTER_PROBE, probe, OP_COUNT
+    );
+    if ( ret < 0 )
+    {
+        return false;
+    }
+
+    const auto supported = [probe](unsigned op)
+    {
+        return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    };
+    return supported(IORING_OP_READ) && supported(IORING_OP_READ_FIXED);
+}
+
+//---------------------------------------------------------------------------//
+
+// io_uring を片付ける
+inline void tapetums::IoEngine::CloseRing()
+{
+    if ( m_sqes ) { ::munmap(m_sqes, m_sqes_len); m_sqes = nullptr; }
+    if ( m_cq_ptr && m_cq_ptr != m_sq_ptr ) { ::munmap(m_cq_ptr, m_cq_len); }
+    m_cq_ptr = nullptr;
+    if ( m_sq_ptr ) { ::munmap(m_sq_ptr, m_sq_len); m_sq_ptr = nullptr; }
+    if ( m_ring >= 0 ) { ::close(m_ring); m_ring = -1; }
+}
+
+//---------------------------------------------------------------------------//
+
+// SQE をひとつ書き込む (m_mutex を取ってから呼ぶ)
+//  op が nullptr なら NOP
+inline void tapetums::IoEngine::Push
+(
+    detail::IoOp* op, uint64_t user_data
+)
+{
+    const auto tail = *m_sq_tail;
+    auto& sqe = m_sqes[tail & m_sq_mask];
+    ::memset(&sqe, 0, sizeof(sqe));
+
+    sqe.user_data = user_data;
+
+    if ( op == nullptr )
+    {
+        sqe.opcode = IORING_OP_NOP;
+    }
+    else
+    {
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd     = op->handle;
+        sqe.off    = (uint64_t)op->offset;
+        sqe.addr   = (uint64_t)(uintptr_t)op->buf;
+        sqe.len    = op->size;
+
+        // 登録済みの領域に収まっていれば固定バッファで読む
+        const auto p = (uintptr_t)op->buf;
+        for ( size_t i = 0; i < m_buffers.size(); ++i )
+        {
+            const auto base = (uintptr_t)m_buffers[i].data;
+            if ( base <= p && p + op->size <= base + m_buffers[i].size )
+            {
+                sqe.opcode    = IORING_OP_READ_FIXED;
+                sqe.buf_index = (uint16_t)i;
+                break;
+            }
+        }
+    }
+
+    __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++m_unsubmitted;
+}
+
+//---------------------------------------------------------------------------//
+
+// 書き込んだ SQE をカーネルに渡す (m_mutex を取ってから呼ぶ)
+//  渡せなかった要求は SQ から取り下げて枠を返し, -errno を付けて failed に積む
+//  (配送はロックを離してから呼び出し側で行う)
+inline void tapetums::IoEngine::Flush
+(
+    std::vector<std::pair<detail::IoOp*, int64_t>>& failed
+)
+{
+    while ( m_unsubmitted > 0 )
+    {
+        const auto ret = ::syscall
+        (
+            __NR_io_uring_enter, m_ring, m_unsubmitted, 0, 0, nullptr, 0
+        );
+        if ( ret >= 0 )
+        {
+            m_unsubmitted -= (unsigned)ret;
+            continue;
+        }
+
+        const auto error = errno;
+        if ( error == EINTR ) { continue; }
+        if ( error == EAGAIN || error == EBUSY ) { std::this_thread::yield(); continue; }
+
+        // カーネルは SQ を読んでいないので, 末尾を書き戻して取り下げる
+        auto tail = *m_sq_tail;
+        uint32_t count { 0 };
+        for ( ; m_unsubmitted > 0; --m_unsubmitted )
+        {
+            --tail;
+            const auto op = reinterpret_cast<detail::IoOp*>((uintptr_t)m_sqes[tail & m_sq_mask].user_data);
+            if ( op )
+            {
+                failed.emplace_back(op, -(int64_t)error);
+                ++count;
+            }
+        }
+        __atomic_store_n(m_sq_tail, tail, __ATOMIC_RELEASE);
+
+        m_inflight   -= count;
+        m_delivering += count;
+        m_done.notify_all();
+        break;
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// 登録した領域を解除する (m_mutex を取ってから呼ぶ)
+inline void tapetums::IoEngine::Unregister()
+{
+    if ( m_buffers.empty() ) { return; }
+
+    ::syscall(__NR_io_uring_register, m_ring, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+    m_buffers.clear();
+}
+
+#endif
+
+//---------------------------------------------------------------------------//
+// IoBatch メソッド
+//---------------------------------------------------------------------------//
+
+// 読み込み要求を溜める
+inline tapetums::IoBatch& tapetums::IoBatch::Read
+(
+    IoEngine::handle_type handle, int64_t offset, void* buf, size_t size, IoCompletion&& completion
+)
+{
+    m_ops.push_back(new detail::IoOp(handle, offset, buf, size, std::move(completion)));
+    return *this;
+}
+
+//---------------------------------------------------------------------------//
+
+// 溜めた要求をまとめて発行する
+inline void tapetums::IoBatch::Submit()
+{
+    m_engine.Submit(*this);
+}
+
+//---------------------------------------------------------------------------//
+
+// AsyncIO.hpp
\ No newline at end of file
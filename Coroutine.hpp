@@ -0,0 +1,552 @@
+﻿#pragma once
+
+//---------------------------------------------------------------------------//
+//
+// Coroutine.hpp
+//  ThreadPool 上で動く C++20 コルーチン
+//   Copyright (C) 2017 tapetums
+//
+//  co_await pool.schedule();  プールのワーカーに移って続きを実行する
+//  co_await future;           Submit() の結果を待つ
+//  co_await group;            TaskGroup の全てのタスクの完了を待つ
+//  co_await co_task;          子のコルーチンを実行して結果を受け取る
+//
+//  コルーチンのフレームはスレッドごとに使い回す (FrameCache)
+//
+//---------------------------------------------------------------------------//
+
+#if ! defined(__cpp_impl_coroutine)
+  #error "Coroutine.hpp requires C++20 coroutines"
+#endif
+
+#include <cstddef>
+
+#include <coroutine>
+#include <exception>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "Task.hpp"
+
+//---------------------------------------------------------------------------//
+// Forward Declarations
+//---------------------------------------------------------------------------//
+
+namespace tapetums
+{
+    template<typename T = void> class co_task;
+
+    template<typename T>
+    future<T> spawn(ThreadPool& pool, co_task<T> task, PRIORITY priority = PRIORITY::NORMAL);
+
+    namespace detail
+    {
+        class FrameCache;
+        class CoPromiseBase;
+        template<typename T> class CoPromise;
+        struct Detached;
+    }
+}
+
+//---------------------------------------------------------------------------//
+// FrameCache
+//  コルーチンのフレームのメモリを大きさごとに使い回す
+//  NodeCache と同じく, スレッドごとに手元に置き BATCH 個単位で共有の倉庫とやり取りする
+//  (再開したワーカーで解放されることが多いので, 確保したスレッドには戻さない)
+//---------------------------------------------------------------------------//
+
+class tapetums::detail::FrameCache final
+{
+private:
+    static constexpr size_t CLASS_COUNT { 7 }; // 64, 128, ... , 4096 bytes
+    static constexpr size_t MIN_SIZE    { 64 };
+    static constexpr size_t BATCH       { 16 };
+    static constexpr size_t LOCAL_LIMIT { BATCH * 2 };
+    static constexpr size_t DEPOT_LIMIT { 64 }; // 大きさごとに倉庫に置く束の数
+
+    struct Block
+    {
+        Block* next;
+    };
+
+    struct Bin
+    {
+        Block* free  { nullptr };
+        size_t count { 0 };
+    };
+
+    struct Depot
+    {
+        std::mutex          lock;
+        std::vector<Block*> batches [CLASS_COUNT];
+
+        ~Depot()
+        {
+            for ( auto& list : batches )
+            {
+                for ( auto batch : list ) { free_chain(batch); }
+            }
+        }
+    };
+
+private:
+    Bin m_bins [CLASS_COUNT];
+
+private:
+    FrameCache() = default;
+    ~FrameCache()
+    {
+        for ( auto& bin : m_bins ) { free_chain(bin.free); }
+    }
+
+public:
+    FrameCache(const FrameCache&)             = delete;
+    FrameCache& operator =(const FrameCache&) = delete;
+
+public:
+    static void* allocate  (size_t size);
+    static void  deallocate(void* p, size_t size) noexcept;
+
+private:
+    static FrameCache& local() noexcept
+    {
+        static thread_local FrameCache cache;
+        return cache;
+    }
+
+    static Depot& depot() noexcept
+    {
+        static Depot depot;
+        return depot;
+    }
+
+    // 大きさの区分. CLASS_COUNT なら使い回さない
+    static size_t class_of(size_t size) noexcept
+    {
+        size_t size_class { 0 };
+        while ( size_class < CLASS_COUNT && (MIN_SIZE << size_class) < size )
+        {
+            ++size_class;
+        }
+        return size_class;
+    }
+
+    static void free_chain(Block* block) noexcept
+    {
+        while ( block )
+        {
+            const auto next = block->next;
+            ::operator delete(block);
+            block = next;
+        }
+    }
+};
+
+//---------------------------------------------------------------------------//
+
+inline void* tapetums::detail::FrameCache::allocate(size_t size)
+{
+    const auto size_class = class_of(size);
+    if ( size_class == CLASS_COUNT )
+    {
+        return ::operator new(size);
+    }
+
+    auto& bin = local().m_bins[size_class];
+    if ( bin.free == nullptr )
+    {
+        // 倉庫から一束もらう
+        auto& d = depot();
+        std::lock_guard<std::mutex> lock(d.lock);
+
+        auto& list = d.batches[size_class];
+        if ( list.empty() )
+        {
+            return ::operator new(MIN_SIZE << size_class);
+        }
+
+        bin.free  = list.back();
+        bin.count = BATCH;
+        list.pop_back();
+    }
+
+    const auto block = bin.free;
+    bin.free = block->next;
+    --bin.count;
+
+    return block;
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::FrameCache::deallocate(void* p, size_t size) noexcept
+{
+    const auto size_class = class_of(size);
+    if ( size_class == CLASS_COUNT )
+    {
+        ::operator delete(p);
+        return;
+    }
+
+    auto& bin = local().m_bins[size_class];
+
+    const auto block = static_cast<Block*>(p);
+    block->next = bin.free;
+    bin.free = block;
+    ++bin.count;
+
+    if ( bin.count < LOCAL_LIMIT )
+    {
+        return;
+    }
+
+    // 溢れた分を一束にして倉庫に返す
+    auto tail = bin.free;
+    for ( size_t i = 1; i < BATCH; ++i )
+    {
+        tail = tail->next;
+    }
+    const auto batch = bin.free;
+    bin.free = tail->next;
+    tail->next = nullptr;
+    bin.count -= BATCH;
+
+    auto& d = depot();
+    {
+        std::lock_guard<std::mutex> lock(d.lock);
+
+        auto& list = d.batches[size_class];
+        if ( list.size() < DEPOT_LIMIT )
+        {
+            list.push_back(batch);
+            return;
+        }
+    }
+
+    free_chain(batch);
+}
+
+//---------------------------------------------------------------------------//
+// CoPromiseBase
+//  co_task の promise_type の共通部分
+//  呼ばれるまで始まらず, 終わったら待っていたコルーチンへ直接移る (スタックを積まない)
+//---------------------------------------------------------------------------//
+
+class tapetums::detail::CoPromiseBase
+{
+private:
+    struct FinalAwaiter
+    {
+        bool await_ready() const noexcept { return false; }
+
+        template<typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            const auto continuation = handle.promise().m_continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+
+        void await_resume() const noexcept { }
+    };
+
+private:
+    std::coroutine_handle<> m_continuation;
+    std::coroutine_handle<> m_root; // 待っている側を辿った一番外側の, 誰も持っていないフレーム
+
+protected:
+    std::exception_ptr m_error;
+
+public:
+    static void* operator new(size_t size) { return FrameCache::allocate(size); }
+    static void  operator delete(void* p, size_t size) noexcept { FrameCache::deallocate(p, size); }
+
+public:
+    std::suspend_always initial_suspend() const noexcept { return { }; }
+    FinalAwaiter        final_suspend  () const noexcept { return { }; }
+
+    void unhandled_exception() noexcept { m_error = std::current_exception(); }
+
+    void set_continuation(std::coroutine_handle<> continuation, std::coroutine_handle<> root) noexcept
+    {
+        m_continuation = continuation;
+        m_root         = root;
+    }
+
+    // 再開されないまま捨てられたら, 一番外側のフレームごと破棄する (ResumeTask)
+    std::coroutine_handle<> dropped_frame() const noexcept { return m_root; }
+};
+
+//---------------------------------------------------------------------------//
+// CoPromise
+//---------------------------------------------------------------------------//
+
+template<typename T>
+class tapetums::detail::CoPromise final : public CoPromiseBase
+{
+    static_assert(! std::is_reference<T>::value, "T must not be a reference");
+
+private:
+    std::optional<T> m_value;
+
+public:
+    co_task<T> get_return_object() noexcept;
+
+    template<typename U>
+    void return_value(U&& value)
+    {
+        m_value.emplace(std::forward<U>(value));
+    }
+
+    T result()
+    {
+        if ( m_error ) { std::rethrow_exception(m_error); }
+
+        return std::move(*m_value);
+    }
+};
+
+//---------------------------------------------------------------------------//
+
+template<>
+class tapetums::detail::CoPromise<void> final : public CoPromiseBase
+{
+public:
+    co_task<void> get_return_object() noexcept;
+
+    void return_void() const noexcept { }
+
+    void result()
+    {
+        if ( m_error ) { std::rethrow_exception(m_error); }
+    }
+};
+
+//---------------------------------------------------------------------------//
+// co_task Class
+//  co_await されたときに, 待っている側のスレッドで始まるコルーチン
+//  別のワーカーに移したければ中で co_await pool.schedule(); する
+//  外から始めるには spawn() を使う
+//---------------------------------------------------------------------------//
+
+template<typename T>
+class tapetums::co_task final
+{
+    friend class detail::CoPromise<T>;
+
+public:
+    using promise_type = detail::CoPromise<T>;
+    using handle_type  = std::coroutine_handle<promise_type>;
+
+    class Awaiter;
+
+private:
+    handle_type m_handle;
+
+private:
+    explicit co_task(handle_type handle) noexcept : m_handle(handle) { }
+
+public:
+    co_task() noexcept = default;
+
+    co_task(const co_task&)             = delete;
+    co_task& operator =(const co_task&) = delete;
+
+    co_task(co_task&& rhs) noexcept : m_handle(std::exchange(rhs.m_handle, nullptr)) { }
+    co_task& operator =(co_task&& rhs) noexcept
+    {
+        if ( this != &rhs )
+        {
+            reset();
+            m_handle = std::exchange(rhs.m_handle, nullptr);
+        }
+        return *this;
+    }
+
+    ~co_task() { reset(); }
+
+public:
+    bool valid   () const noexcept { return static_cast<bool>(m_handle); }
+    bool is_ready() const noexcept { return m_handle && m_handle.done(); }
+
+public:
+    Awaiter operator co_await() const noexcept { return Awaiter(m_handle); }
+
+private:
+    void reset() noexcept
+    {
+        if ( m_handle )
+        {
+            m_handle.destroy();
+            m_handle = nullptr;
+        }
+    }
+};
+
+//---------------------------------------------------------------------------//
+
+template<typename T>
+class tapetums::co_task<T>::Awaiter final
+{
+private:
+    handle_type m_handle;
+
+public:
+    explicit Awaiter(handle_type handle) noexcept : m_handle(handle) { }
+
+public:
+    bool await_ready() const noexcept { return ! m_handle || m_handle.done(); }
+
+    // 子のコルーチンへ直接移り, 終わったら戻ってくる
+    template<typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> continuation) noexcept
+    {
+        m_handle.promise().set_continuation(continuation, root_of(continuation, 0));
+        return m_handle;
+    }
+
+    T await_resume() { return m_handle.promise().result(); }
+
+private:
+    // 待っている側が誰も持っていないフレームの中なら, それを伝える
+    template<typename Promise>
+    static auto root_of(std::coroutine_handle<Promise> handle, int) noexcept
+        -> decltype(std::coroutine_handle<>(handle.promise().dropped_frame()))
+    {
+        return handle.promise().dropped_frame();
+    }
+
+    template<typename Promise>
+    static std::coroutine_handle<> root_of(std::coroutine_handle<Promise>, long) noexcept
+    {
+        return { };
+    }
+};
+
+//---------------------------------------------------------------------------//
+// CoPromise Methods
+//---------------------------------------------------------------------------//
+
+template<typename T>
+inline tapetums::co_task<T> tapetums::detail::CoPromise<T>::get_return_object() noexcept
+{
+    return co_task<T>(std::coroutine_handle<CoPromise>::from_promise(*this));
+}
+
+//---------------------------------------------------------------------------//
+
+inline tapetums::co_task<void> tapetums::detail::CoPromise<void>::get_return_object() noexcept
+{
+    return co_task<void>(std::coroutine_handle<CoPromise>::from_promise(*this));
+}
+
+//---------------------------------------------------------------------------//
+// Detached
+//  spawn() の中で使う, 誰にも待たれないコルーチン (終わったら自分で消える)
+//---------------------------------------------------------------------------//
+
+struct tapetums::detail::Detached
+{
+    struct promise_type
+    {
+        static void* operator new(size_t size) { return FrameCache::allocate(size); }
+        static void  operator delete(void* p, size_t size) noexcept { FrameCache::deallocate(p, size); }
+
+        Detached get_return_object() const noexcept { return { }; }
+
+        std::suspend_never initial_suspend() const noexcept { return { }; }
+        std::suspend_never final_suspend  () const noexcept { return { }; }
+
+        void return_void() const noexcept { }
+        void unhandled_exception() const noexcept { std::terminate(); }
+
+        // 再開されないまま捨てられたら ResumeTask がこのフレームを破棄する (Task.hpp)
+        std::coroutine_handle<> dropped_frame() noexcept
+        {
+            return std::coroutine_handle<promise_type>::from_promise(*this);
+        }
+    };
+};
+
+//---------------------------------------------------------------------------//
+// CoroutineBridge
+//  co_task の結果を future に渡す
+//---------------------------------------------------------------------------//
+
+struct tapetums::detail::CoroutineBridge
+{
+    template<typename T>
+    static future<T> spawn(ThreadPool& pool, co_task<T>&& task, PRIORITY priority)
+    {
+        const auto state = FutureState<T>::create(&pool);
+        future<T> result(state);
+
+        run(pool, priority, std::move(task), Promise<T>(state));
+
+        return result;
+    }
+
+private:
+    template<typename T>
+    static Detached run(ThreadPool& pool, PRIORITY priority, co_task<T> task, Promise<T> promise)
+    {
+        co_await pool.schedule(priority);
+
+        std::exception_ptr error;
+        if constexpr ( std::is_void<T>::value )
+        {
+            try
+            {
+                co_await task;
+            }
+            catch ( ... )
+            {
+                error = std::current_exception();
+            }
+
+            auto finish = [&error]()
+            {
+                if ( error ) { std::rethrow_exception(error); }
+            };
+            promise.run(finish);
+        }
+        else
+        {
+            std::optional<T> value;
+            try
+            {
+                value.emplace(co_await task);
+            }
+            catch ( ... )
+            {
+                error = std::current_exception();
+            }
+
+            auto finish = [&error, &value]() -> T
+            {
+                if ( error ) { std::rethrow_exception(error); }
+                return std::move(*value);
+            };
+            promise.run(finish);
+        }
+    }
+};
+
+//---------------------------------------------------------------------------//
+// Functions
+//---------------------------------------------------------------------------//
+
+// task をプールのワーカーで始め, 結果を future で受け取る
+// 始まる前に Stop() で破棄されたものは, future が broken_promise で完了する
+template<typename T>
+inline tapetums::future<T> tapetums::spawn(ThreadPool& pool, co_task<T> task, PRIORITY priority)
+{
+    return detail::CoroutineBridge::spawn(pool, std::move(task), priority);
+}
+
+//---------------------------------------------------------------------------//
+
+// Coroutine.hpp
\ No newline at end of file
@@ -3,7 +3,7 @@
 //---------------------------------------------------------------------------//
 //
 // File.hpp
-//  RAII class for Windows files
+//  RAII class for files (Windows / POSIX)
 //   Copyright (C) 2014-2017 tapetums
 //
 //---------------------------------------------------------------------------//
@@ -12,8 +12,22 @@
 
 #include <algorithm>
 
-#include <windows.h>
-#include <strsafe.h>
+#if defined(_WIN32)
+  #include <windows.h>
+  #include <strsafe.h>
+#else
+  #include <cerrno>
+  #include <cstring>
+  #include <climits>
+  #include <string>
+  #include <vector>
+  #include <fcntl.h>
+  #include <sys/file.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <sys/uio.h>
+  #include <unistd.h>
+#endif
 
 #if defined(DELETE)
   #undef DELETE
@@ -26,6 +40,8 @@
   #undef min
 #endif
 
+#include "IoBuffer.hpp"
+
 //---------------------------------------------------------------------------//
 // Forward Declarations
 //---------------------------------------------------------------------------//
@@ -33,8 +49,21 @@
 namespace tapetums
 {
     class File;
+    class IoEngine;
+
+    // ReadAsync で使うハンドル (FileAsync.hpp)
+    namespace detail
+    {
+      #if defined(_WIN32)
+        inline HANDLE AsyncHandle(File& file, IoEngine& engine);
+      #else
+        inline int    AsyncHandle(File& file, IoEngine& engine);
+      #endif
+    }
 }
 
+#if defined(_WIN32)
+
 //---------------------------------------------------------------------------//
 // Classes
 //---------------------------------------------------------------------------//
@@ -80,6 +109,14 @@ protected:
     int64_t  m_pos    { 0 };
     int64_t  m_size   { 0 };
 
+    // ReadAsync 用 (FileAsync.hpp)
+    //  m_async_state は 0: 未使用, 1: 用意中, 2: m_async が使える, 3: 開き直せない
+    HANDLE    m_async       { INVALID_HANDLE_VALUE }; // FILE_FLAG_OVERLAPPED で開き直したもの
+    IoEngine* m_engine      { nullptr };              // m_async を結び付けたエンジン
+    LONG      m_async_state { 0 };
+
+    friend HANDLE detail::AsyncHandle(File& file, IoEngine& engine);
+
 public:
     File() = default;
     ~File() { Close(); }
@@ -113,6 +150,10 @@ public:
     void    UnMap       ();
     size_t  Read        (void* buf, size_t size);
     size_t  Write       (const void* const buf, size_t size);
+    size_t  ReadAt      (int64_t offset, void* buf, size_t size) const;
+    size_t  WriteAt     (int64_t offset, const void* const buf, size_t size);
+    size_t  ReadAtV     (int64_t offset, const IoBuffer* buffers, size_t count) const;
+    size_t  WriteAtV    (int64_t offset, const IoBuffer* buffers, size_t count);
     int64_t Seek        (int64_t distance, ORIGIN origin = ORIGIN::BEGIN);
     bool    SetEndOfFile();
     bool    Flush       (size_t dwNumberOfBytesToFlush = 0);
@@ -137,6 +178,9 @@ inline void tapetums::File::swap(File&& rhs)
     std::swap(m_ptr,    rhs.m_ptr);
     std::swap(m_pos,    rhs.m_pos);
     std::swap(m_size,   rhs.m_size);
+    std::swap(m_async,       rhs.m_async);
+    std::swap(m_engine,      rhs.m_engine);
+    std::swap(m_async_state, rhs.m_async_state);
 }
 
 //---------------------------------------------------------------------------//
@@ -234,6 +278,13 @@ inline bool tapetums::File::Open
         return false;
     }
 
+    // 範囲の確認に使うので, ビューの大きさを覚えておく
+    MEMORY_BASIC_INFORMATION mbi;
+    if ( ::VirtualQuery(m_ptr, &mbi, sizeof(mbi)) )
+    {
+        m_size = (int64_t)mbi.RegionSize;
+    }
+
     return true;
 }
 
@@ -270,6 +321,13 @@ inline bool tapetums::File::Open
         return false;
     }
 
+    // 範囲の確認に使うので, ビューの大きさを覚えておく
+    MEMORY_BASIC_INFORMATION mbi;
+    if ( ::VirtualQuery(m_ptr, &mbi, sizeof(mbi)) )
+    {
+        m_size = (int64_t)mbi.RegionSize;
+    }
+
     return true;
 }
 
@@ -281,6 +339,13 @@ inline void tapetums::File::Close()
     UnMap();
     Flush();
 
+    if ( m_async != INVALID_HANDLE_VALUE )
+    {
+        ::CloseHandle(m_async);
+        m_async  = INVALID_HANDLE_VALUE;
+        m_engine = nullptr;
+    }
+    m_async_state = 0;
     if ( m_handle != INVALID_HANDLE_VALUE )
     {
         ::CloseHandle(m_handle);
@@ -413,22 +478,13 @@ inline void tapetums::File::UnMap()
 //---------------------------------------------------------------------------//
 
 // ファイルもしくはメモリマップトファイルから読み込む
+//  位置は m_pos で管理する (カーネルのファイルポインタは使わない)
 inline size_t tapetums::File::Read
 (
     void* buf, size_t size
 )
 {
-    size_t cb { 0 };
-
-    if ( m_map )
-    {
-        cb = std::min(size, (size_t)m_size - size);
-        ::memcpy(buf, m_ptr + m_pos, cb);
-    }
-    else
-    {
-        ::ReadFile(m_handle, buf, (DWORD)size, (DWORD*)&cb, nullptr);
-    }
+    const auto cb = ReadAt(m_pos, buf, size);
 
     m_pos += cb;
 
@@ -443,21 +499,132 @@ inline size_t tapetums::File::Write
     const void* const buf, size_t size
 )
 {
-    size_t cb { 0 };
+    const auto cb = WriteAt(m_pos, buf, size);
+
+    m_pos += cb;
+
+    return cb;
+}
+
+//---------------------------------------------------------------------------//
+
+// offset から読み込む. 位置 (m_pos) は動かさない
+//  m_pos に触らないので, 複数のスレッドから同時に呼べる
+//  (同期ハンドルへの I/O はカーネルの中では順に処理される)
+inline size_t tapetums::File::ReadAt
+(
+    int64_t offset, void* buf, size_t size
+)
+const
+{
+    if ( m_map )
+    {
+        if ( offset < 0 || offset >= m_size ) { return 0; }
+
+        const auto cb = std::min(size, size_t(m_size - offset));
+        ::memcpy(buf, m_ptr + offset, cb);
+        return cb;
+    }
+
+    size_t total { 0 };
+    while ( total < size )
+    {
+        const auto pos = uint64_t(offset) + total;
+
+        OVERLAPPED ov { };
+        ov.Offset     = DWORD(pos & 0xFFFFFFFF);
+        ov.OffsetHigh = DWORD(pos >> 32);
+
+        DWORD cb { 0 };
+        const auto chunk = (DWORD)std::min<size_t>(size - total, 0x40000000);
+        if ( ! ::ReadFile(m_handle, (uint8_t*)buf + total, chunk, &cb, &ov) || cb == 0 )
+        {
+            break; // 終端 (ERROR_HANDLE_EOF) もしくはエラー
+        }
+
+        total += cb;
+    }
+
+    return total;
+}
 
+//---------------------------------------------------------------------------//
+
+// offset に書き込む. 位置 (m_pos) は動かさない
+inline size_t tapetums::File::WriteAt
+(
+    int64_t offset, const void* const buf, size_t size
+)
+{
     if ( m_map )
     {
-        cb = std::min(size, (size_t)m_size - size);
-        ::memcpy((m_ptr + m_pos), buf, cb);
+        if ( offset < 0 || offset >= m_size ) { return 0; }
+
+        const auto cb = std::min(size, size_t(m_size - offset));
+        ::memcpy(m_ptr + offset, buf, cb);
+        return cb;
     }
-    else
+
+    size_t total { 0 };
+    while ( total < size )
     {
-        ::WriteFile(m_handle, buf, (DWORD)size, (DWORD*)&cb, nullptr);
+        const auto pos = uint64_t(offset) + total;
+
+        OVERLAPPED ov { };
+        ov.Offset     = DWORD(pos & 0xFFFFFFFF);
+        ov.OffsetHigh = DWORD(pos >> 32);
+
+        DWORD cb { 0 };
+        const auto chunk = (DWORD)std::min<size_t>(size - total, 0x40000000);
+        if ( ! ::WriteFile(m_handle, (const uint8_t*)buf + total, chunk, &cb, &ov) || cb == 0 )
+        {
+            break;
+        }
+
+        total += cb;
     }
 
-    m_pos += cb;
+    return total;
+}
 
-    return cb;
+//---------------------------------------------------------------------------//
+
+// offset から複数の領域へ順に読み込む. 位置 (m_pos) は動かさない
+//  ReadFileScatter はページ単位・バッファなしの I/O 専用なので, 領域ごとに読む
+inline size_t tapetums::File::ReadAtV
+(
+    int64_t offset, const IoBuffer* buffers, size_t count
+)
+const
+{
+    size_t total { 0 };
+    for ( size_t i = 0; i < count; ++i )
+    {
+        const auto cb = ReadAt(offset + int64_t(total), buffers[i].data, buffers[i].size);
+        total += cb;
+        if ( cb < buffers[i].size ) { break; }
+    }
+
+    return total;
+}
+
+//---------------------------------------------------------------------------//
+
+// offset へ複数の領域を順に書き込む. 位置 (m_pos) は動かさない
+inline size_t tapetums::File::WriteAtV
+(
+    int64_t offset, const IoBuffer* buffers, size_t count
+)
+{
+    size_t total { 0 };
+    for ( size_t i = 0; i < count; ++i )
+    {
+        const auto cb = WriteAt(offset + int64_t(total), buffers[i].data, buffers[i].size);
+        total += cb;
+        if ( cb < buffers[i].size ) { break; }
+    }
+
+    return total;
 }
 
 //---------------------------------------------------------------------------//
@@ -496,11 +663,22 @@ inline int64_t tapetums::File::Seek
     }
     else
     {
-        LARGE_INTEGER li;
-        li.QuadPart = distance;
-        ::SetFilePointerEx(m_handle, li, &li, (DWORD)origin);
+        auto pos = distance;
+        if ( origin == ORIGIN::END )
+        {
+            LARGE_INTEGER li;
+            if ( ! ::GetFileSizeEx(m_handle, &li) ) { return m_pos; }
+            pos += li.QuadPart;
+        }
+        else if ( origin == ORIGIN::CURRENT )
+        {
+            pos += m_pos;
+        }
 
-        m_pos = li.QuadPart;
+        if ( pos >= 0 )
+        {
+            m_pos = pos;
+        }
         return m_pos;
     }
 }
@@ -516,7 +694,13 @@ inline bool tapetums::File::SetEndOfFile()
     }
     else
     {
-        return ::SetEndOfFile(m_handle) ? true : false;
+        // ファイルポインタは ReadAt / WriteAt が動かすので, m_pos を直接渡す
+        FILE_END_OF_FILE_INFO info;
+        info.EndOfFile.QuadPart = m_pos;
+        return ::SetFileInformationByHandle
+        (
+            m_handle, FileEndOfFileInfo, &info, sizeof(info)
+        ) ? true : false;
     }
 }
 
@@ -540,4 +724,756 @@ inline bool tapetums::File::Flush
 
 //---------------------------------------------------------------------------//
 
+#else // POSIX
+
+//---------------------------------------------------------------------------//
+// Classes (POSIX)
+//  open / mmap で同じ操作を提供する
+//  共有モードは flock の助言ロックで近似する (EXCLUSIVE だけが他を締め出す)
+//  名前付きのメモリマップトファイルは shm_open の共有メモリになり,
+//  作ったインスタンスが UnMap するときに名前を消す (開いている者はそのまま使える)
+//  ファイルを開いた上で名前を付けて Map した場合, 名前は使わない
+//  (他のプロセスからはファイルそのものを開いてマップすればよい)
+//---------------------------------------------------------------------------//
+
+class tapetums::File final
+{
+public:
+    enum class ACCESS : int
+    {
+        UNKNOWN = -1,
+        READ    = O_RDONLY,
+        WRITE   = O_RDWR,
+    };
+
+    enum class SHARE : int
+    {
+        EXCLUSIVE = LOCK_EX,
+        READ      = LOCK_SH,
+        WRITE     = LOCK_SH,
+        DELETE    = LOCK_SH,
+    };
+
+    enum class OPEN : int
+    {
+        NEW         = O_CREAT | O_EXCL,  // Fails   if existing
+        OR_TRUNCATE = O_CREAT | O_TRUNC, // Clears  if existing
+        EXISTING    = 0,                 // Fails   if not existing
+        OR_CREATE   = O_CREAT,           // Creates if not existing
+        TRUNCATE    = O_TRUNC,           // Fails   if not existing
+    };
+
+    enum class ORIGIN : int
+    {
+        BEGIN   = SEEK_SET,
+        CURRENT = SEEK_CUR,
+        END     = SEEK_END,
+    };
+
+protected:
+    int      m_handle { -1 };
+    int      m_map    { -1 };      // 名前付き共有メモリ
+    uint8_t* m_ptr    { nullptr };
+    int64_t  m_pos    { 0 };
+    int64_t  m_size   { 0 };
+
+    std::string m_unlink; // 自分で作った共有メモリの名前 (UnMap で消す)
+
+    friend int detail::AsyncHandle(File& file, IoEngine& engine);
+
+public:
+    File() = default;
+    ~File() { Close(); }
+
+    File(const File&)             = delete;
+    File& operator =(const File&) = delete;
+
+    File(File&& rhs)             noexcept { swap(std::move(rhs)); }
+    File& operator =(File&& rhs) noexcept { swap(std::move(rhs)); return *this; }
+
+public:
+    void swap(File&& rhs);
+
+public:
+    auto is_open()   const noexcept { return m_handle >= 0; }
+    auto is_mapped() const noexcept { return m_ptr != nullptr; }
+    auto handle()    const noexcept { return m_handle; }
+    auto position()  const noexcept { return m_pos; }
+    auto pointer()   const noexcept { return m_ptr ? m_ptr + m_pos : nullptr; }
+    auto size()      const noexcept { return m_size; }
+
+public:
+    bool    Open        (const char*    lpFileName, ACCESS accessMode, SHARE shareMode, OPEN createMode);
+    bool    Open        (const wchar_t* lpFileName, ACCESS accessMode, SHARE shareMode, OPEN createMode);
+    bool    Open        (const char*    lpName, ACCESS accessMode);
+    bool    Open        (const wchar_t* lpName, ACCESS accessMode);
+    void    Close       ();
+    bool    Map         (ACCESS accessMode);
+    bool    Map         (int64_t size, const char*    lpName, ACCESS accessMode);
+    bool    Map         (int64_t size, const wchar_t* lpName, ACCESS accessMode);
+    void    UnMap       ();
+    size_t  Read        (void* buf, size_t size);
+    size_t  Write       (const void* const buf, size_t size);
+    size_t  ReadAt      (int64_t offset, void* buf, size_t size) const;
+    size_t  WriteAt     (int64_t offset, const void* const buf, size_t size);
+    size_t  ReadAtV     (int64_t offset, const IoBuffer* buffers, size_t count) const;
+    size_t  WriteAtV    (int64_t offset, const IoBuffer* buffers, size_t count);
+    int64_t Seek        (int64_t distance, ORIGIN origin = ORIGIN::BEGIN);
+    bool    SetEndOfFile();
+    bool    Flush       (size_t dwNumberOfBytesToFlush = 0);
+
+    template<typename T>
+    size_t Read(T* t) { return Read(t, sizeof(T)); }
+
+    template<typename T>
+    size_t Write(const T& t) { return Write((const T* const)&t, sizeof(T)); }
+
+private:
+    static std::string Narrow  (const wchar_t* str);
+    static bool        MakeName(std::string& name, const char* lpName);
+    static size_t      Vectored(int fd, int64_t offset, iovec* iov, size_t count, bool write);
+};
+
+//---------------------------------------------------------------------------//
+// ムーブコンストラクタ
+//---------------------------------------------------------------------------//
+
+inline void tapetums::File::swap(File&& rhs)
+{
+    if ( this == &rhs ) { return; }
+
+    std::swap(m_handle, rhs.m_handle);
+    std::swap(m_map,    rhs.m_map);
+    std::swap(m_ptr,    rhs.m_ptr);
+    std::swap(m_pos,    rhs.m_pos);
+    std::swap(m_size,   rhs.m_size);
+    std::swap(m_unlink, rhs.m_unlink);
+}
+
+//---------------------------------------------------------------------------//
+// メソッド
+//---------------------------------------------------------------------------//
+
+// ファイルを開く
+inline bool tapetums::File::Open
+(
+    const char* lpFileName,
+    ACCESS      accessMode,
+    SHARE       shareMode,
+    OPEN        createMode
+)
+{
+    if ( m_handle >= 0 ) { return true; }
+    if ( accessMode == ACCESS::UNKNOWN ) { return false; }
+
+    // 切り詰めるのはロックを取ってから (他が使っている中身を消さないように)
+    const auto truncate = ((int)createMode & O_TRUNC) != 0;
+
+    m_handle = ::open
+    (
+        lpFileName, (int)accessMode | ((int)createMode & ~O_TRUNC) | O_CLOEXEC, 0666
+    );
+    if ( m_handle < 0 )
+    {
+        return false;
+    }
+
+    struct stat st;
+    if ( ::flock(m_handle, (int)shareMode | LOCK_NB) != 0 ||
+         (truncate && ::ftruncate(m_handle, 0) != 0) ||
+         ::fstat(m_handle, &st) != 0 )
+    {
+        ::close(m_handle);
+        m_handle = -1;
+        return false;
+    }
+
+    m_size = st.st_size;
+
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+
+// ファイルを開く (ワイド文字版. UTF-8 に直して開く)
+inline bool tapetums::File::Open
+(
+    const wchar_t* lpFileName,
+    ACCESS         accessMode,
+    SHARE          shareMode,
+    OPEN           createMode
+)
+{
+    return Open(Narrow(lpFileName).c_str(), accessMode, shareMode, createMode);
+}
+
+//---------------------------------------------------------------------------//
+
+// 名前付きのメモリマップトファイルを開く
+inline bool tapetums::File::Open
+(
+    const char* lpName, ACCESS accessMode
+)
+{
+    if ( m_ptr ) { return true; }
+    if ( m_handle >= 0 ) { return false; }
+    if ( accessMode == ACCESS::UNKNOWN ) { return false; }
+
+    std::string name;
+    if ( ! MakeName(name, lpName) )
+    {
+        return false;
+    }
+
+    m_map = ::shm_open(name.c_str(), (int)accessMode, 0);
+    if ( m_map < 0 )
+    {
+        return false;
+    }
+
+    struct stat st;
+    if ( ::fstat(m_map, &st) != 0 || st.st_size == 0 )
+    {
+        UnMap();
+        return false;
+    }
+
+    const auto ptr = ::mmap
+    (
+        nullptr, size_t(st.st_size),
+        accessMode == ACCESS::READ ? PROT_READ : PROT_READ | PROT_WRITE,
+        MAP_SHARED, m_map, 0
+    );
+    if ( ptr == MAP_FAILED )
+    {
+        UnMap();
+        return false;
+    }
+
+    m_ptr  = (uint8_t*)ptr;
+    m_size = st.st_size;
+
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+
+// 名前付きのメモリマップトファイルを開く (ワイド文字版)
+inline bool tapetums::File::Open
+(
+    const wchar_t* lpName, ACCESS accessMode
+)
+{
+    return Open(lpName ? Narrow(lpName).c_str() : nullptr, accessMode);
+}
+
+//---------------------------------------------------------------------------//
+
+// ファイルを閉じる
+inline void tapetums::File::Close()
+{
+    UnMap();
+    Flush();
+
+    if ( m_handle >= 0 )
+    {
+        ::close(m_handle); // flock も外れる
+        m_handle = -1;
+    }
+
+    m_pos  = 0;
+    m_size = 0;
+}
+
+//---------------------------------------------------------------------------//
+
+// 既存のファイルをメモリにマップする
+inline bool tapetums::File::Map
+(
+    ACCESS accessMode
+)
+{
+    if ( m_handle < 0 ) { return false; }
+
+    return Map(0, (const char*)nullptr, accessMode);
+}
+
+//---------------------------------------------------------------------------//
+
+// メモリマップトファイルを生成する
+//  ファイルを開いていれば, ファイルを size まで伸ばしてマップする
+//  開いていなければ共有メモリ (名前がなければ無名) を作る
+inline bool tapetums::File::Map
+(
+    int64_t size, const char* lpName, ACCESS accessMode
+)
+{
+    if ( m_ptr ) { return true; }
+    if ( accessMode == ACCESS::UNKNOWN ) { return false; }
+
+    const auto length = (size > 0) ? size : m_size;
+    if ( length == 0 )
+    {
+        return false;
+    }
+
+    const auto prot  = (accessMode == ACCESS::READ) ? PROT_READ : PROT_READ | PROT_WRITE;
+    auto       flags = MAP_SHARED;
+    auto       fd    = m_handle;
+
+    if ( m_handle >= 0 )
+    {
+        if ( length > m_size )
+        {
+            // 読み込み専用では伸ばせない (終端を越えたページに触れると SIGBUS になる)
+            if ( accessMode == ACCESS::READ || ::ftruncate(m_handle, off_t(length)) != 0 )
+            {
+                return false;
+            }
+        }
+    }
+    else if ( lpName )
+    {
+        std::string name;
+        if ( ! MakeName(name, lpName) )
+        {
+            return false;
+        }
+
+        m_map = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+        if ( m_map >= 0 )
+        {
+            m_unlink = name;
+        }
+        else if ( errno == EEXIST )
+        {
+            m_map = ::shm_open(name.c_str(), O_RDWR, 0);
+        }
+        if ( m_map < 0 )
+        {
+            return false;
+        }
+
+        struct stat st;
+        if ( ::fstat(m_map, &st) != 0 ||
+             (st.st_size < length && ::ftruncate(m_map, off_t(length)) != 0) )
+        {
+            UnMap();
+            return false;
+        }
+
+        fd = m_map;
+    }
+    else
+    {
+        flags |= MAP_ANONYMOUS;
+    }
+
+    const auto ptr = ::mmap(nullptr, size_t(length), prot, flags, fd, 0);
+    if ( ptr == MAP_FAILED )
+    {
+        UnMap();
+        return false;
+    }
+
+    m_ptr  = (uint8_t*)ptr;
+    m_size = length;
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+
+// メモリマップトファイルを生成する (ワイド文字版)
+inline bool tapetums::File::Map
+(
+    int64_t size, const wchar_t* lpName, ACCESS accessMode
+)
+{
+    return Map(size, lpName ? Narrow(lpName).c_str() : nullptr, accessMode);
+}
+
+//---------------------------------------------------------------------------//
+
+// メモリマップトファイルを閉じる
+inline void tapetums::File::UnMap()
+{
+    if ( m_ptr )
+    {
+        ::msync(m_ptr, size_t(m_size), MS_ASYNC);
+        ::munmap(m_ptr, size_t(m_size));
+        m_ptr = nullptr;
+    }
+    if ( m_map >= 0 )
+    {
+        ::close(m_map);
+        m_map = -1;
+    }
+    if ( ! m_unlink.empty() )
+    {
+        ::shm_unlink(m_unlink.c_str());
+        m_unlink.clear();
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// ファイルもしくはメモリマップトファイルから読み込む
+//  位置は m_pos で管理する (カーネルのファイルオフセットは使わない)
+inline size_t tapetums::File::Read
+(
+    void* buf, size_t size
+)
+{
+    const auto cb = ReadAt(m_pos, buf, size);
+
+    m_pos += cb;
+
+    return cb;
+}
+
+//---------------------------------------------------------------------------//
+
+// ファイルもしくはメモリマップトファイルに書き込む
+inline size_t tapetums::File::Write
+(
+    const void* const buf, size_t size
+)
+{
+    const auto cb = WriteAt(m_pos, buf, size);
+
+    m_pos += cb;
+
+    return cb;
+}
+
+//---------------------------------------------------------------------------//
+
+// offset から読み込む (pread). 位置 (m_pos) は動かさない
+//  m_pos に触らないので, 複数のスレッドから同時に呼べる
+inline size_t tapetums::File::ReadAt
+(
+    int64_t offset, void* buf, size_t size
+)
+const
+{
+    if ( m_ptr )
+    {
+        if ( offset < 0 || offset >= m_size ) { return 0; }
+
+        const auto cb = std::min(size, size_t(m_size - offset));
+        ::memcpy(buf, m_ptr + offset, cb);
+        return cb;
+    }
+
+    size_t total { 0 };
+    while ( total < size )
+    {
+        const auto ret = ::pread
+        (
+            m_handle, (uint8_t*)buf + total, size - total, off_t(offset + int64_t(total))
+        );
+        if ( ret < 0 && errno == EINTR ) { continue; }
+        if ( ret <= 0 ) { break; } // 終端もしくはエラー
+
+        total += size_t(ret);
+    }
+
+    return total;
+}
+
+//---------------------------------------------------------------------------//
+
+// offset に書き込む (pwrite). 位置 (m_pos) は動かさない
+inline size_t tapetums::File::WriteAt
+(
+    int64_t offset, const void* const buf, size_t size
+)
+{
+    if ( m_ptr )
+    {
+        if ( offset < 0 || offset >= m_size ) { return 0; }
+
+        const auto cb = std::min(size, size_t(m_size - offset));
+        ::memcpy(m_ptr + offset, buf, cb);
+        return cb;
+    }
+
+    size_t total { 0 };
+    while ( total < size )
+    {
+        const auto ret = ::pwrite
+        (
+            m_handle, (const uint8_t*)buf + total, size - total, off_t(offset + int64_t(total))
+        );
+        if ( ret < 0 && errno == EINTR ) { continue; }
+        if ( ret <= 0 ) { break; }
+
+        total += size_t(ret);
+    }
+
+    return total;
+}
+
+//---------------------------------------------------------------------------//
+
+// offset から複数の領域へ順に読み込む (preadv). 位置 (m_pos) は動かさない
+inline size_t tapetums::File::ReadAtV
+(
+    int64_t offset, const IoBuffer* buffers, size_t count
+)
+const
+{
+    if ( m_ptr )
+    {
+        size_t total { 0 };
+        for ( size_t i = 0; i < count; ++i )
+        {
+            const auto cb = ReadAt(offset + int64_t(total), buffers[i].data, buffers[i].size);
+            total += cb;
+            if ( cb < buffers[i].size ) { break; }
+        }
+        return total;
+    }
+
+    std::vector<iovec> iov(count);
+    for ( size_t i = 0; i < count; ++i )
+    {
+        iov[i].iov_base = buffers[i].data;
+        iov[i].iov_len  = buffers[i].size;
+    }
+
+    return Vectored(m_handle, offset, iov.data(), count, false);
+}
+
+//---------------------------------------------------------------------------//
+
+// offset へ複数の領域を順に書き込む (pwritev). 位置 (m_pos) は動かさない
+inline size_t tapetums::File::WriteAtV
+(
+    int64_t offset, const IoBuffer* buffers, size_t count
+)
+{
+    if ( m_ptr )
+    {
+        size_t total { 0 };
+        for ( size_t i = 0; i < count; ++i )
+        {
+            const auto cb = WriteAt(offset + int64_t(total), buffers[i].data, buffers[i].size);
+            total += cb;
+            if ( cb < buffers[i].size ) { break; }
+        }
+        return total;
+    }
+
+    std::vector<iovec> iov(count);
+    for ( size_t i = 0; i < count; ++i )
+    {
+        iov[i].iov_base = buffers[i].data;
+        iov[i].iov_len  = buffers[i].size;
+    }
+
+    return Vectored(m_handle, offset, iov.data(), count, true);
+}
+
+//---------------------------------------------------------------------------//
+
+// ファイルポインタを移動する
+inline int64_t tapetums::File::Seek
+(
+    int64_t distance, ORIGIN origin
+)
+{
+    if ( m_ptr )
+    {
+        if ( origin == ORIGIN::END )
+        {
+            m_pos = m_size - distance;
+        }
+        else if ( origin == ORIGIN::CURRENT )
+        {
+            m_pos += distance;
+        }
+        else
+        {
+            m_pos = distance;
+        }
+
+        if ( m_pos < 0 )
+        {
+            m_pos = 0;
+        }
+        else if ( m_pos >= m_size )
+        {
+            m_pos = (distance > 0) ? m_size : 0;
+        }
+
+        return (intptr_t)m_ptr + m_pos;
+    }
+    else
+    {
+        auto pos = distance;
+        if ( origin == ORIGIN::END )
+        {
+            struct stat st;
+            if ( ::fstat(m_handle, &st) != 0 ) { return m_pos; }
+            pos += st.st_size;
+        }
+        else if ( origin == ORIGIN::CURRENT )
+        {
+            pos += m_pos;
+        }
+
+        if ( pos >= 0 )
+        {
+            m_pos = pos;
+        }
+        return m_pos;
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// ファイルを終端する
+inline bool tapetums::File::SetEndOfFile()
+{
+    if ( m_handle < 0 )
+    {
+        return true;
+    }
+    else
+    {
+        return ::ftruncate(m_handle, off_t(m_pos)) == 0;
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// ファイルもしくはメモリマップトファイルをフラッシュする
+inline bool tapetums::File::Flush
+(
+    size_t dwNumberOfBytesToFlush
+)
+{
+    if ( m_ptr )
+    {
+        const auto cb = dwNumberOfBytesToFlush ? std::min(dwNumberOfBytesToFlush, size_t(m_size)) : size_t(m_size);
+        return ::msync(m_ptr, cb, MS_SYNC) == 0;
+    }
+    else
+    {
+        return ::fsync(m_handle) == 0;
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// ワイド文字列を UTF-8 にする (wchar_t は UTF-32)
+inline std::string tapetums::File::Narrow
+(
+    const wchar_t* str
+)
+{
+    std::string s;
+    for ( ; *str; ++str )
+    {
+        const auto c = uint32_t(*str);
+        if ( c < 0x80 )
+        {
+            s += char(c);
+        }
+        else if ( c < 0x800 )
+        {
+            s += char(0xC0 | (c >> 6));
+            s += char(0x80 | (c & 0x3F));
+        }
+        else if ( c < 0x10000 )
+        {
+            s += char(0xE0 | (c >> 12));
+            s += char(0x80 | ((c >> 6) & 0x3F));
+            s += char(0x80 | (c & 0x3F));
+        }
+        else
+        {
+            s += char(0xF0 | (c >> 18));
+            s += char(0x80 | ((c >> 12) & 0x3F));
+            s += char(0x80 | ((c >> 6) & 0x3F));
+            s += char(0x80 | (c & 0x3F));
+        }
+    }
+    return s;
+}
+
+//---------------------------------------------------------------------------//
+
+// 共有メモリの名前を作る (先頭の '/' 以外に '/' は使えない)
+inline bool tapetums::File::MakeName
+(
+    std::string& name, const char* lpName
+)
+{
+    if ( lpName == nullptr || lpName[0] == '\0' )
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    name = (lpName[0] == '/') ? lpName : std::string("/") + lpName;
+    if ( name.find('/', 1) != std::string::npos )
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+
+// preadv / pwritev を IOV_MAX 個ずつ, 全て終わるか終端に達するまで繰り返す
+//  途中までしか済まなかった分は iov を進めて続ける
+inline size_t tapetums::File::Vectored
+(
+    int fd, int64_t offset, iovec* iov, size_t count, bool write
+)
+{
+    size_t total { 0 };
+    for ( ; ; )
+    {
+        // 長さ 0 の領域は飛ばす (全部が 0 だと戻り値 0 が終端と区別できない)
+        while ( count > 0 && iov->iov_len == 0 )
+        {
+            ++iov;
+            --count;
+        }
+        if ( count == 0 ) { break; }
+
+        const auto n   = (int)std::min<size_t>(count, IOV_MAX);
+        const auto pos = off_t(offset + int64_t(total));
+        const auto ret = write ? ::pwritev(fd, iov, n, pos) : ::preadv(fd, iov, n, pos);
+        if ( ret < 0 && errno == EINTR ) { continue; }
+        if ( ret <= 0 ) { break; }
+
+        total += size_t(ret);
+
+        auto cb = size_t(ret);
+        while ( count > 0 && cb >= iov->iov_len )
+        {
+            cb -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if ( count > 0 )
+        {
+            iov->iov_base = (uint8_t*)iov->iov_base + cb;
+            iov->iov_len -= cb;
+        }
+    }
+
+    return total;
+}
+
+#endif
+
+//---------------------------------------------------------------------------//
+
 // File.hpp
\ No newline at end of file
@@ -0,0 +1,144 @@
+﻿#pragma once
+
+//---------------------------------------------------------------------------//
+//
+// FileAsync.hpp
+//  File の非同期読み込み (AsyncIO.hpp の IoEngine で発行する)
+//   Copyright (C) 2017 tapetums
+//
+//  ファイルポインタは動かない. buf は completion が呼ばれるまで有効であること
+//  ファイルを閉じるのは全ての completion が呼ばれてから
+//
+//---------------------------------------------------------------------------//
+
+#include "File.hpp"
+#include "AsyncIO.hpp"
+
+//---------------------------------------------------------------------------//
+// Forward Declarations
+//---------------------------------------------------------------------------//
+
+namespace tapetums
+{
+    inline void ReadAsync(File& file, int64_t offset, void* buf, size_t size, IoCompletion&& completion);
+    inline void ReadAsync(File& file, IoBatch& batch, int64_t offset, void* buf, size_t size, IoCompletion&& completion);
+}
+
+//---------------------------------------------------------------------------//
+// Functions
+//---------------------------------------------------------------------------//
+
+// offset から非同期に読み込む (既定のエンジンで今すぐ発行する)
+inline void tapetums::ReadAsync
+(
+    File& file, int64_t offset, void* buf, size_t size, IoCompletion&& completion
+)
+{
+    auto& engine = IoEngine::Default();
+
+    const auto handle = detail::AsyncHandle(file, engine);
+  #if defined(_WIN32)
+    if ( handle == nullptr )
+    {
+        // 重複 I/O で読めないファイルは, ここで読んで完了通知だけを配送する
+        engine.Post(std::move(completion), (int64_t)file.ReadAt(offset, buf, size));
+        return;
+    }
+  #endif
+
+    engine.Read(handle, offset, buf, size, std::move(completion));
+}
+
+//---------------------------------------------------------------------------//
+
+// offset から非同期に読み込む要求をバッチに溜める
+inline void tapetums::ReadAsync
+(
+    File& file, IoBatch& batch, int64_t offset, void* buf, size_t size, IoCompletion&& completion
+)
+{
+    auto& engine = batch.engine();
+
+    const auto handle = detail::AsyncHandle(file, engine);
+  #if defined(_WIN32)
+    if ( handle == nullptr )
+    {
+        engine.Post(std::move(completion), (int64_t)file.ReadAt(offset, buf, size));
+        return;
+    }
+  #endif
+
+    batch.Read(handle, offset, buf, size, std::move(completion));
+}
+
+//---------------------------------------------------------------------------//
+
+#if defined(_WIN32)
+
+// 重複 I/O 用のハンドルを開き直して, 最初に使ったエンジンに結び付ける
+//  同時に呼ばれても開き直すのは一度だけ (他のスレッドは済むまで待つ)
+//  開き直せないとき (EXCLUSIVE で開いた場合など) と, 別のエンジンから使われたときは
+//  nullptr を返す (呼び出し側で同期的に読む). 開いていなければ INVALID_HANDLE_VALUE
+inline HANDLE tapetums::detail::AsyncHandle
+(
+    File& file, IoEngine& engine
+)
+{
+    if ( file.m_handle == INVALID_HANDLE_VALUE )
+    {
+        return INVALID_HANDLE_VALUE;
+    }
+
+    if ( ::InterlockedCompareExchange(&file.m_async_state, 1, 0) == 0 )
+    {
+        LONG state { 3 };
+
+        const auto async = ::ReOpenFile
+        (
+            file.m_handle, GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            FILE_FLAG_OVERLAPPED
+        );
+        if ( async != INVALID_HANDLE_VALUE )
+        {
+            if ( engine.Attach(async) )
+            {
+                file.m_async  = async;
+                file.m_engine = &engine;
+                state = 2;
+            }
+            else
+            {
+                ::CloseHandle(async);
+            }
+        }
+
+        ::InterlockedExchange(&file.m_async_state, state);
+    }
+
+    LONG state;
+    while ( (state = ::InterlockedCompareExchange(&file.m_async_state, 0, 0)) == 1 )
+    {
+        ::SwitchToThread();
+    }
+
+    return (state == 2 && file.m_engine == &engine) ? file.m_async : nullptr;
+}
+
+#else // POSIX
+
+// pread で読めるので, 開いているファイルか名前付き共有メモリをそのまま使う
+inline int tapetums::detail::AsyncHandle
+(
+    File& file, IoEngine& engine
+)
+{
+    (void)engine;
+    return (file.m_handle >= 0) ? file.m_handle : file.m_map;
+}
+
+#endif
+
+//---------------------------------------------------------------------------//
+
+// FileAsync.hpp
\ No newline at end of file
@@ -0,0 +1,35 @@
+﻿#pragma once
+
+//---------------------------------------------------------------------------//
+//
+// IoBuffer.hpp
+//  読み書きに使う領域 (File.hpp と AsyncIO.hpp で共用)
+//   Copyright (C) 2017 tapetums
+//
+//---------------------------------------------------------------------------//
+
+#include <cstddef>
+
+//---------------------------------------------------------------------------//
+// Forward Declarations
+//---------------------------------------------------------------------------//
+
+namespace tapetums
+{
+    struct IoBuffer;
+}
+
+//---------------------------------------------------------------------------//
+// IoBuffer
+//  File::ReadAtV / WriteAtV の並びと, IoEngine::RegisterBuffers で登録する領域
+//---------------------------------------------------------------------------//
+
+struct tapetums::IoBuffer
+{
+    void*  data;
+    size_t size;
+};
+
+//---------------------------------------------------------------------------//
+
+// IoBuffer.hpp
\ No newline at end of file
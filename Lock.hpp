@@ -6,9 +6,53 @@
 //  RAII classes for lock objects
 //   Copyright (C) 2015-2017 tapetums
 //
+//  Windows では既定で CRITICAL_SECTION / SRWLOCK を使う
+//  LOCK_PORTABLE を定義するか Windows 以外では, アトミック変数と
+//  futex (Linux) による実装を使う
+//
+//  See Also:
+//   U. Drepper, "Futexes Are Tricky" (2011)
+//   B. Brandenburg, J. Anderson, "Spin-Based Reader-Writer Synchronization
+//    for Multiprocessor Real-Time Systems" (Real-Time Systems 46, 2010)
+//
 //---------------------------------------------------------------------------//
 
-#include <windows.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#if defined(LOCK_PROFILE)
+  #include <chrono>
+  #include <mutex>
+#endif
+
+#if defined(_WIN32)
+  #include <windows.h>
+#endif
+
+#if defined(__linux__)
+  #include <climits>
+  #include <linux/futex.h>
+  #include <sys/syscall.h>
+  #include <unistd.h>
+#elif ! defined(__cpp_lib_atomic_wait)
+  #include <condition_variable>
+  #include <mutex>
+#endif
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+  #include <immintrin.h>
+#elif defined(_M_ARM) || defined(_M_ARM64)
+  #include <intrin.h>
+#endif
 
 //---------------------------------------------------------------------------//
 // Forward Declarations
@@ -25,132 +69,1441 @@ namespace tapetums
     namespace SRWL
     {
         class Lock;
-        class ReadGuard;
-        class WriteGuard;
+        class FairLock;
+
+        template<typename L> class BasicReadGuard;
+        template<typename L> class BasicWriteGuard;
+
+        using ReadGuard      = BasicReadGuard<Lock>;
+        using WriteGuard     = BasicWriteGuard<Lock>;
+        using FairReadGuard  = BasicReadGuard<FairLock>;
+        using FairWriteGuard = BasicWriteGuard<FairLock>;
+    }
+
+    struct LockStats;
+    class  LockProfiler;
+
+    template<typename T> class SeqLock;
+    template<typename T> class RcuCell;
+
+    namespace detail
+    {
+        inline void lock_pause() noexcept;
+        inline uint32_t lock_spin_limit() noexcept;
+
+        inline void futex_wait    (std::atomic<uint32_t>& word, uint32_t expected) noexcept;
+        inline void futex_wake_one(std::atomic<uint32_t>& word) noexcept;
+        inline void futex_wake_all(std::atomic<uint32_t>& word) noexcept;
+
+        class RecursiveLock;
+        class SharedLock;
+        class PhaseFairLock;
+
+        struct LockCounters;
+        class  LockRegistry;
+    }
+}
+
+//---------------------------------------------------------------------------//
+// Utility Functions
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::lock_pause() noexcept
+{
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+    _mm_pause();
+#elif defined(_M_ARM) || defined(_M_ARM64)
+    __yield();
+#elif defined(__arm__) || defined(__aarch64__)
+    __asm__ __volatile__ ("yield");
+#endif
+}
+
+//---------------------------------------------------------------------------//
+
+// スピンの上限. 単一 CPU では回しても持ち主は進まないので回さない
+inline uint32_t tapetums::detail::lock_spin_limit() noexcept
+{
+    static const uint32_t limit = std::thread::hardware_concurrency() > 1 ? 100 : 0;
+    return limit;
+}
+
+//---------------------------------------------------------------------------//
+
+#if defined(__linux__)
+
+inline void tapetums::detail::futex_wait
+(
+    std::atomic<uint32_t>& word, uint32_t expected
+)
+noexcept
+{
+    // 値が expected のままなら眠る. 起こされたか値が変わっていれば戻る (偽の起床あり)
+    ::syscall
+    (
+        SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE,
+        expected, nullptr, nullptr, 0
+    );
+}
+
+inline void tapetums::detail::futex_wake_one(std::atomic<uint32_t>& word) noexcept
+{
+    ::syscall
+    (
+        SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE_PRIVATE,
+        1, nullptr, nullptr, 0
+    );
+}
+
+inline void tapetums::detail::futex_wake_all(std::atomic<uint32_t>& word) noexcept
+{
+    ::syscall
+    (
+        SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE_PRIVATE,
+        INT_MAX, nullptr, nullptr, 0
+    );
+}
+
+#elif defined(__cpp_lib_atomic_wait)
+
+inline void tapetums::detail::futex_wait
+(
+    std::atomic<uint32_t>& word, uint32_t expected
+)
+noexcept
+{
+    word.wait(expected, std::memory_order_relaxed);
+}
+
+inline void tapetums::detail::futex_wake_one(std::atomic<uint32_t>& word) noexcept
+{
+    word.notify_one();
+}
+
+inline void tapetums::detail::futex_wake_all(std::atomic<uint32_t>& word) noexcept
+{
+    word.notify_all();
+}
+
+#else
+
+namespace tapetums { namespace detail
+{
+    // futex の代わり. アドレスのハッシュで選んだバケットで待つ
+    struct ParkingBucket
+    {
+        std::mutex              mutex;
+        std::condition_variable cv;
+    };
+
+    inline ParkingBucket& parking_bucket(const void* address) noexcept
+    {
+        static ParkingBucket buckets[64];
+        return buckets[(reinterpret_cast<uintptr_t>(address) >> 4) % 64];
+    }
+} }
+
+inline void tapetums::detail::futex_wait
+(
+    std::atomic<uint32_t>& word, uint32_t expected
+)
+noexcept
+{
+    auto& bucket = parking_bucket(&word);
+
+    std::unique_lock<std::mutex> lock(bucket.mutex);
+    if ( word.load(std::memory_order_relaxed) == expected )
+    {
+        bucket.cv.wait(lock);
+    }
+}
+
+inline void tapetums::detail::futex_wake_one(std::atomic<uint32_t>& word) noexcept
+{
+    // バケットは他のアドレスと共有しているので, 一つだけ起こすと取り違える
+    futex_wake_all(word);
+}
+
+inline void tapetums::detail::futex_wake_all(std::atomic<uint32_t>& word) noexcept
+{
+    auto& bucket = parking_bucket(&word);
+
+    { std::lock_guard<std::mutex> lock(bucket.mutex); }
+    bucket.cv.notify_all();
+}
+
+#endif
+
+//---------------------------------------------------------------------------//
+// detail::RecursiveLock
+//  CRITICAL_SECTION と同じく同じスレッドからの再入を許す排他ロック
+//  状態語は 0: 空き, 1: 保持, 2: 保持かつ待ちあり
+//  待つ前に, 前回までに要したスピン回数の移動平均から決めた回数だけ回る
+//---------------------------------------------------------------------------//
+
+class tapetums::detail::RecursiveLock final
+{
+private:
+    std::atomic<uint32_t>        m_state { 0 };
+    std::atomic<std::thread::id> m_owner { };
+    uint32_t                     m_depth { 0 };
+    std::atomic<uint32_t>        m_spin  { 0 }; // スピン回数の推定 (x8)
+    uint32_t                     m_max_spin;
+
+public:
+    explicit RecursiveLock(uint32_t max_spin = lock_spin_limit()) noexcept
+        : m_max_spin(max_spin) { }
+
+    RecursiveLock(const RecursiveLock&)             = delete;
+    RecursiveLock& operator =(const RecursiveLock&) = delete;
+
+public:
+    bool try_enter() noexcept;
+    void enter() noexcept;
+    void leave() noexcept;
+
+private:
+    void lock_contended() noexcept;
+};
+
+//---------------------------------------------------------------------------//
+
+inline bool tapetums::detail::RecursiveLock::try_enter() noexcept
+{
+    const auto self = std::this_thread::get_id();
+    if ( m_owner.load(std::memory_order_relaxed) == self )
+    {
+        ++m_depth;
+        return true;
+    }
+
+    uint32_t state { 0 };
+    if ( ! m_state.compare_exchange_strong(state, 1, std::memory_order_acquire) )
+    {
+        return false;
+    }
+
+    m_owner.store(self, std::memory_order_relaxed);
+    m_depth = 1;
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::RecursiveLock::enter() noexcept
+{
+    const auto self = std::this_thread::get_id();
+    if ( m_owner.load(std::memory_order_relaxed) == self )
+    {
+        ++m_depth;
+        return;
+    }
+
+    uint32_t state { 0 };
+    if ( ! m_state.compare_exchange_strong(state, 1, std::memory_order_acquire) )
+    {
+        lock_contended();
+    }
+
+    m_owner.store(self, std::memory_order_relaxed);
+    m_depth = 1;
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::RecursiveLock::leave() noexcept
+{
+    if ( --m_depth > 0 )
+    {
+        return;
+    }
+
+    m_owner.store(std::thread::id(), std::memory_order_relaxed);
+
+    if ( m_state.exchange(0, std::memory_order_release) == 2 )
+    {
+        futex_wake_one(m_state);
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::RecursiveLock::lock_contended() noexcept
+{
+    // 短い区間なら持ち主がすぐ抜けるので, 眠るより回って待つ方が安い
+    // 回数は推定の倍 + 余裕. 取れたら推定を実績に, 取れなければ上限に寄せる
+    const auto estimate = m_spin.load(std::memory_order_relaxed);
+    auto limit = estimate / 4 + 16;
+    if ( limit > m_max_spin ) { limit = m_max_spin; }
+
+    for ( uint32_t count = 0; count < limit; ++count )
+    {
+        lock_pause();
+
+        uint32_t state { 0 };
+        if ( m_state.load(std::memory_order_relaxed) == 0 &&
+             m_state.compare_exchange_weak(state, 1, std::memory_order_acquire) )
+        {
+            m_spin.store(estimate + count - estimate / 8, std::memory_order_relaxed);
+            return;
+        }
+    }
+
+    if ( limit > 0 )
+    {
+        m_spin.store(estimate + limit - estimate / 8, std::memory_order_relaxed);
+    }
+
+    // 待ちありの印を付けて眠る. 起きたら印を付けたまま取り直す
+    auto state = m_state.exchange(2, std::memory_order_acquire);
+    while ( state != 0 )
+    {
+        futex_wait(m_state, 2);
+        state = m_state.exchange(2, std::memory_order_acquire);
+    }
+}
+
+//---------------------------------------------------------------------------//
+// detail::SharedLock
+//  一語の読み書きロック. 書き手が待っている間は新しい読み手を入れない
+//  待ちがあるときだけ印を立て, 解放側は印を消して全員を起こす
+//---------------------------------------------------------------------------//
+
+class tapetums::detail::SharedLock final
+{
+private:
+    static constexpr uint32_t READER_MASK    { 0x0FFFFFFF };
+    static constexpr uint32_t WRITER         { 1u << 28 };
+    static constexpr uint32_t WRITER_WAITING { 1u << 29 };
+    static constexpr uint32_t READER_WAITING { 1u << 30 };
+    static constexpr uint32_t WAITING        { WRITER_WAITING | READER_WAITING };
+
+    std::atomic<uint32_t> m_state { 0 };
+
+public:
+    SharedLock() = default;
+
+    SharedLock(const SharedLock&)             = delete;
+    SharedLock& operator =(const SharedLock&) = delete;
+
+public:
+    bool try_read_lock() noexcept;
+    void read_lock() noexcept;
+    void read_unlock() noexcept;
+
+    bool try_write_lock() noexcept;
+    void write_lock() noexcept;
+    void write_unlock() noexcept;
+
+private:
+    void wake_waiters() noexcept;
+};
+
+//---------------------------------------------------------------------------//
+
+inline bool tapetums::detail::SharedLock::try_read_lock() noexcept
+{
+    auto state = m_state.load(std::memory_order_relaxed);
+    while ( (state & (WRITER | WRITER_WAITING)) == 0 )
+    {
+        if ( m_state.compare_exchange_weak(state, state + 1, std::memory_order_acquire) )
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::SharedLock::read_lock() noexcept
+{
+    if ( try_read_lock() )
+    {
+        return;
+    }
+
+    const auto limit = lock_spin_limit();
+    for ( uint32_t count = 0; count < limit; ++count )
+    {
+        lock_pause();
+        if ( try_read_lock() )
+        {
+            return;
+        }
+    }
+
+    auto state = m_state.load(std::memory_order_relaxed);
+    for ( ;; )
+    {
+        if ( (state & (WRITER | WRITER_WAITING)) == 0 )
+        {
+            if ( m_state.compare_exchange_weak(state, state + 1, std::memory_order_acquire) )
+            {
+                return;
+            }
+            continue;
+        }
+
+        if ( (state & READER_WAITING) == 0 )
+        {
+            if ( ! m_state.compare_exchange_weak(state, state | READER_WAITING, std::memory_order_relaxed) )
+            {
+                continue;
+            }
+            state |= READER_WAITING;
+        }
+
+        futex_wait(m_state, state);
+        state = m_state.load(std::memory_order_relaxed);
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::SharedLock::read_unlock() noexcept
+{
+    const auto state = m_state.fetch_sub(1, std::memory_order_release) - 1;
+    if ( (state & READER_MASK) == 0 && (state & WAITING) )
+    {
+        wake_waiters();
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+inline bool tapetums::detail::SharedLock::try_write_lock() noexcept
+{
+    auto state = m_state.load(std::memory_order_relaxed);
+    while ( (state & (READER_MASK | WRITER)) == 0 )
+    {
+        if ( m_state.compare_exchange_weak(state, state | WRITER, std::memory_order_acquire) )
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::SharedLock::write_lock() noexcept
+{
+    if ( try_write_lock() )
+    {
+        return;
+    }
+
+    const auto limit = lock_spin_limit();
+    for ( uint32_t count = 0; count < limit; ++count )
+    {
+        lock_pause();
+        if ( try_write_lock() )
+        {
+            return;
+        }
+    }
+
+    auto state = m_state.load(std::memory_order_relaxed);
+    for ( ;; )
+    {
+        // 他の書き手も待っているかもしれないので, 取るときも印は残す
+        if ( (state & (READER_MASK | WRITER)) == 0 )
+        {
+            if ( m_state.compare_exchange_weak(state, state | WRITER, std::memory_order_acquire) )
+            {
+                return;
+            }
+            continue;
+        }
+
+        if ( (state & WRITER_WAITING) == 0 )
+        {
+            if ( ! m_state.compare_exchange_weak(state, state | WRITER_WAITING, std::memory_order_relaxed) )
+            {
+                continue;
+            }
+            state |= WRITER_WAITING;
+        }
+
+        futex_wait(m_state, state);
+        state = m_state.load(std::memory_order_relaxed);
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::SharedLock::write_unlock() noexcept
+{
+    const auto state = m_state.fetch_and(~(WRITER | WAITING), std::memory_order_release);
+    if ( state & WAITING )
+    {
+        futex_wake_all(m_state);
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::SharedLock::wake_waiters() noexcept
+{
+    // 起きた側はまだ入れなければ印を立て直して眠る
+    const auto state = m_state.fetch_and(~WAITING, std::memory_order_relaxed);
+    if ( state & WAITING )
+    {
+        futex_wake_all(m_state);
     }
 }
 
-//---------------------------------------------------------------------------//
-// Critical Section
-//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+// detail::PhaseFairLock
+//  Phase-Fair チケットロック (PF-T)
+//  書き手は到着順. 読み手は書き手一人ごとに交互に入るので, どちらも飢えない
+//  rin / rout の上位は読み手の入退出数, rin の下位 2 ビットは書き手の在席と位相
+//---------------------------------------------------------------------------//
+
+class tapetums::detail::PhaseFairLock final
+{
+private:
+    static constexpr uint32_t RINC  { 0x100 };
+    static constexpr uint32_t WBITS { 0x3 };
+    static constexpr uint32_t PRES  { 0x2 };
+    static constexpr uint32_t PHID  { 0x1 };
+
+    std::atomic<uint32_t> m_rin     { 0 };
+    std::atomic<uint32_t> m_rout    { 0 };
+    std::atomic<uint32_t> m_win     { 0 };
+    std::atomic<uint32_t> m_wout    { 0 };
+    std::atomic<uint32_t> m_sleepers{ 0 };
+
+public:
+    PhaseFairLock() = default;
+
+    PhaseFairLock(const PhaseFairLock&)             = delete;
+    PhaseFairLock& operator =(const PhaseFairLock&) = delete;
+
+public:
+    bool try_read_lock() noexcept;
+    void read_lock() noexcept;
+    void read_unlock() noexcept;
+
+    bool try_write_lock() noexcept;
+    void write_lock() noexcept;
+    void write_unlock() noexcept;
+
+private:
+    void acquire_write(uint32_t ticket) noexcept;
+
+    template<typename Pred>
+    void wait_while(std::atomic<uint32_t>& word, Pred&& blocked) noexcept;
+
+    void wake(std::atomic<uint32_t>& word) noexcept;
+};
+
+//---------------------------------------------------------------------------//
+
+inline bool tapetums::detail::PhaseFairLock::try_read_lock() noexcept
+{
+    auto rin = m_rin.load(std::memory_order_relaxed);
+    if ( (rin & WBITS) || m_win.load(std::memory_order_relaxed) != m_wout.load(std::memory_order_relaxed) )
+    {
+        return false;
+    }
+
+    return m_rin.compare_exchange_strong(rin, rin + RINC, std::memory_order_acquire);
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::PhaseFairLock::read_lock() noexcept
+{
+    // 書き手がいれば, その位相が終わるまで (下位ビットが変わるまで) 待つ
+    const auto phase = m_rin.fetch_add(RINC, std::memory_order_acquire) & WBITS;
+    if ( phase != 0 )
+    {
+        wait_while(m_rin, [phase](uint32_t rin) { return (rin & WBITS) == phase; });
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::PhaseFairLock::read_unlock() noexcept
+{
+    m_rout.fetch_add(RINC, std::memory_order_seq_cst);
+
+    // 書き手が読み手の退出を待っていれば起こす
+    if ( m_rin.load(std::memory_order_seq_cst) & PRES )
+    {
+        wake(m_rout);
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+inline bool tapetums::detail::PhaseFairLock::try_write_lock() noexcept
+{
+    auto ticket = m_wout.load(std::memory_order_relaxed);
+
+    const auto rin = m_rin.load(std::memory_order_relaxed);
+    if ( (rin & WBITS) || rin != m_rout.load(std::memory_order_relaxed) )
+    {
+        return false;
+    }
+
+    if ( ! m_win.compare_exchange_strong(ticket, ticket + 1, std::memory_order_acquire) )
+    {
+        return false;
+    }
+
+    // 在席を示す. 確認の直後に読み手が入っていれば, 待たずに番を返して諦める
+    const auto entered = m_rin.fetch_add(PRES | (ticket & PHID), std::memory_order_seq_cst) & ~WBITS;
+    if ( m_rout.load(std::memory_order_seq_cst) != entered )
+    {
+        write_unlock();
+        return false;
+    }
+
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::PhaseFairLock::write_lock() noexcept
+{
+    const auto ticket = m_win.fetch_add(1, std::memory_order_relaxed);
+    wait_while(m_wout, [ticket](uint32_t wout) { return wout != ticket; });
+
+    acquire_write(ticket);
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::PhaseFairLock::write_unlock() noexcept
+{
+    m_rin.fetch_and(~WBITS, std::memory_order_seq_cst);
+    m_wout.fetch_add(1, std::memory_order_seq_cst);
+
+    wake(m_rin);
+    wake(m_wout);
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::PhaseFairLock::acquire_write(uint32_t ticket) noexcept
+{
+    // 在席を示して新しい読み手を止め, それまでに入った読み手の退出を待つ
+    const auto entered = m_rin.fetch_add(PRES | (ticket & PHID), std::memory_order_seq_cst) & ~WBITS;
+    wait_while(m_rout, [entered](uint32_t rout) { return rout != entered; });
+}
+
+//---------------------------------------------------------------------------//
+
+template<typename Pred>
+inline void tapetums::detail::PhaseFairLock::wait_while
+(
+    std::atomic<uint32_t>& word, Pred&& blocked
+)
+noexcept
+{
+    const auto limit = lock_spin_limit();
+    for ( uint32_t count = 0; count < limit; ++count )
+    {
+        if ( ! blocked(word.load(std::memory_order_acquire)) )
+        {
+            return;
+        }
+        lock_pause();
+    }
+
+    m_sleepers.fetch_add(1, std::memory_order_seq_cst);
+    for ( ;; )
+    {
+        const auto value = word.load(std::memory_order_seq_cst);
+        if ( ! blocked(value) )
+        {
+            break;
+        }
+        futex_wait(word, value);
+    }
+    m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::PhaseFairLock::wake(std::atomic<uint32_t>& word) noexcept
+{
+    if ( m_sleepers.load(std::memory_order_seq_cst) > 0 )
+    {
+        futex_wake_all(word);
+    }
+}
+
+//---------------------------------------------------------------------------//
+// Lock Profiler
+//  LOCK_PROFILE を定義すると, ロックごとに取得回数 / 競合回数 / 待ち時間 /
+//  最長保持時間を数える. 未定義なら何も数えず, ロックの大きさも変わらない
+//  ロックの名前は静的な文字列で付ける (LOCK_SITE で "ファイル(行)" になる)
+//  保持時間は排他的な保持 (CS と SRWL の書き込み) だけを測る
+//---------------------------------------------------------------------------//
+
+#define LOCK_STRINGIZE_(x) #x
+#define LOCK_STRINGIZE(x)  LOCK_STRINGIZE_(x)
+#define LOCK_SITE          __FILE__ "(" LOCK_STRINGIZE(__LINE__) ")"
+
+struct tapetums::LockStats
+{
+    const char* name         { nullptr };
+    size_t      instances    { 0 }; // 同じ名前のロックの数 (破棄済みを含む)
+    uint64_t    acquisitions { 0 };
+    uint64_t    contended    { 0 }; // すぐに取れず待った回数
+    uint64_t    wait_ns      { 0 };
+    uint64_t    max_hold_ns  { 0 };
+};
+
+//---------------------------------------------------------------------------//
+
+class tapetums::LockProfiler final
+{
+public:
+    LockProfiler() = delete;
+
+public:
+  #if defined(LOCK_PROFILE)
+    static constexpr bool enabled() noexcept { return true; }
+  #else
+    static constexpr bool enabled() noexcept { return false; }
+  #endif
+
+    static std::vector<LockStats> top(size_t count = 10);
+    static void dump(FILE* out = stderr, size_t count = 10);
+    static void reset();
+};
+
+//---------------------------------------------------------------------------//
+
+#if defined(LOCK_PROFILE)
+
+// ロック一つ分の計数. 名前ごとの集計はレジストリが行う
+struct tapetums::detail::LockCounters
+{
+    std::atomic<const char*> name;
+
+    std::atomic<uint64_t> acquisitions { 0 };
+    std::atomic<uint64_t> contended    { 0 };
+    std::atomic<uint64_t> wait_ns      { 0 };
+    std::atomic<uint64_t> max_hold_ns  { 0 };
+
+    // 排他的に保持している間だけ触る
+    int64_t  since { 0 };
+    uint32_t depth { 0 };
+
+    LockCounters* prev { nullptr };
+    LockCounters* next { nullptr };
+
+    explicit LockCounters(const char* name) noexcept;
+    ~LockCounters();
+
+    void rename(const char* new_name) noexcept;
+
+    LockCounters(const LockCounters&)             = delete;
+    LockCounters& operator =(const LockCounters&) = delete;
+
+    static int64_t now() noexcept
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>
+        (
+            std::chrono::steady_clock::now().time_since_epoch()
+        ).count();
+    }
+
+    void waited(int64_t start) noexcept
+    {
+        contended.fetch_add(1, std::memory_order_relaxed);
+        wait_ns  .fetch_add(uint64_t(now() - start), std::memory_order_relaxed);
+    }
+
+    void acquired() noexcept
+    {
+        acquisitions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void entered() noexcept
+    {
+        acquired();
+        if ( depth++ == 0 ) { since = now(); }
+    }
+
+    void leaving() noexcept
+    {
+        if ( --depth > 0 )
+        {
+            return;
+        }
+
+        const auto hold = uint64_t(now() - since);
+        auto current = max_hold_ns.load(std::memory_order_relaxed);
+        while ( current < hold && ! max_hold_ns.compare_exchange_weak
+        (
+            current, hold, std::memory_order_relaxed, std::memory_order_relaxed
+        ) ) { }
+    }
+
+    LockStats load() const noexcept;
+};
+
+//---------------------------------------------------------------------------//
+
+// 生きているロックの一覧と, 破棄されたロックの名前ごとの累計
+class tapetums::detail::LockRegistry final
+{
+private:
+    std::mutex             m_mutex;
+    LockCounters*          m_head { nullptr };
+    std::vector<LockStats> m_retired;
+
+public:
+    static LockRegistry& instance()
+    {
+        static LockRegistry registry;
+        return registry;
+    }
+
+public:
+    void add(LockCounters* counters);
+    void remove(LockCounters* counters);
+
+    std::vector<LockStats> collect();
+    void reset();
+
+private:
+    static void merge(std::vector<LockStats>& list, const LockStats& stats);
+};
+
+//---------------------------------------------------------------------------//
+
+inline tapetums::detail::LockCounters::LockCounters(const char* name) noexcept
+    : name(name ? name : "(unnamed)")
+{
+    LockRegistry::instance().add(this);
+}
+
+inline void tapetums::detail::LockCounters::rename(const char* new_name) noexcept
+{
+    name.store(new_name ? new_name : "(unnamed)", std::memory_order_relaxed);
+}
+
+inline tapetums::detail::LockCounters::~LockCounters()
+{
+    LockRegistry::instance().remove(this);
+}
+
+//---------------------------------------------------------------------------//
+
+inline tapetums::LockStats tapetums::detail::LockCounters::load() const noexcept
+{
+    LockStats stats;
+
+    stats.name         = name.load(std::memory_order_relaxed);
+    stats.instances    = 1;
+    stats.acquisitions = acquisitions.load(std::memory_order_relaxed);
+    stats.contended    = contended   .load(std::memory_order_relaxed);
+    stats.wait_ns      = wait_ns     .load(std::memory_order_relaxed);
+    stats.max_hold_ns  = max_hold_ns .load(std::memory_order_relaxed);
+
+    return stats;
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::LockRegistry::add(LockCounters* counters)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    counters->next = m_head;
+    if ( m_head ) { m_head->prev = counters; }
+    m_head = counters;
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::LockRegistry::remove(LockCounters* counters)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if ( counters->prev ) { counters->prev->next = counters->next; }
+    else                  { m_head = counters->next; }
+    if ( counters->next ) { counters->next->prev = counters->prev; }
+
+    merge(m_retired, counters->load());
+}
+
+//---------------------------------------------------------------------------//
+
+inline std::vector<tapetums::LockStats> tapetums::detail::LockRegistry::collect()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto list = m_retired;
+    for ( auto counters = m_head; counters; counters = counters->next )
+    {
+        merge(list, counters->load());
+    }
+
+    return list;
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::LockRegistry::reset()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_retired.clear();
+    for ( auto counters = m_head; counters; counters = counters->next )
+    {
+        counters->acquisitions.store(0, std::memory_order_relaxed);
+        counters->contended   .store(0, std::memory_order_relaxed);
+        counters->wait_ns     .store(0, std::memory_order_relaxed);
+        counters->max_hold_ns .store(0, std::memory_order_relaxed);
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::LockRegistry::merge
+(
+    std::vector<LockStats>& list, const LockStats& stats
+)
+{
+    for ( auto& entry : list )
+    {
+        if ( std::strcmp(entry.name, stats.name) == 0 )
+        {
+            entry.instances    += stats.instances;
+            entry.acquisitions += stats.acquisitions;
+            entry.contended    += stats.contended;
+            entry.wait_ns      += stats.wait_ns;
+            entry.max_hold_ns   = (std::max)(entry.max_hold_ns, stats.max_hold_ns);
+            return;
+        }
+    }
+
+    list.push_back(stats);
+}
+
+#endif
+
+//---------------------------------------------------------------------------//
+// LockProfiler Methods
+//---------------------------------------------------------------------------//
+
+// 競合回数の多い順 (同数なら待ち時間の長い順) に count 件
+inline std::vector<tapetums::LockStats> tapetums::LockProfiler::top(size_t count)
+{
+  #if defined(LOCK_PROFILE)
+    auto list = detail::LockRegistry::instance().collect();
+
+    std::sort(list.begin(), list.end(), [](const LockStats& lhs, const LockStats& rhs)
+    {
+        if ( lhs.contended != rhs.contended ) { return lhs.contended > rhs.contended; }
+        return lhs.wait_ns > rhs.wait_ns;
+    });
+
+    if ( list.size() > count )
+    {
+        list.resize(count);
+    }
+
+    return list;
+  #else
+    (void)count;
+    return { };
+  #endif
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::LockProfiler::dump(FILE* out, size_t count)
+{
+    if ( ! enabled() )
+    {
+        std::fprintf(out, "# lock profiler is disabled (define LOCK_PROFILE)\n");
+        return;
+    }
+
+    std::fprintf
+    (
+        out, "%-40s %5s %12s %12s %14s %14s\n",
+        "name", "locks", "acquired", "contended", "wait(us)", "max_hold(us)"
+    );
+
+    for ( const auto& stats : top(count) )
+    {
+        std::fprintf
+        (
+            out, "%-40s %5zu %12llu %12llu %14.1f %14.1f\n",
+            stats.name, stats.instances,
+            static_cast<unsigned long long>(stats.acquisitions),
+            static_cast<unsigned long long>(stats.contended),
+            stats.wait_ns / 1000.0, stats.max_hold_ns / 1000.0
+        );
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::LockProfiler::reset()
+{
+  #if defined(LOCK_PROFILE)
+    detail::LockRegistry::instance().reset();
+  #endif
+}
+
+//---------------------------------------------------------------------------//
+// Critical Section
+//---------------------------------------------------------------------------//
+
+class tapetums::CS::Lock final
+{
+private:
+#if defined(_WIN32) && ! defined(LOCK_PORTABLE)
+    CRITICAL_SECTION cs;
+#else
+    detail::RecursiveLock cs;
+#endif
+
+#if defined(LOCK_PROFILE)
+    detail::LockCounters m_profile { nullptr };
+#endif
+
+public:
+    Lock();
+    explicit Lock(uint32_t spin_count);
+    explicit Lock(const char* name);
+    Lock(const char* name, uint32_t spin_count);
+    ~Lock();
+
+    Lock(const Lock&)             = delete;
+    Lock& operator =(const Lock&) = delete;
+
+    Lock(Lock&& rhs)            noexcept = delete;
+    Lock& operator=(Lock&& rhs) noexcept = delete;
+
+public:
+    bool try_enter();
+    void enter();
+    void leave();
+
+private:
+    bool raw_try_enter();
+    void raw_enter();
+    void raw_leave();
+};
+
+//---------------------------------------------------------------------------//
+
+#if defined(_WIN32) && ! defined(LOCK_PORTABLE)
+
+inline tapetums::CS::Lock::Lock()                    { ::InitializeCriticalSection(&cs); }
+inline tapetums::CS::Lock::Lock(uint32_t spin_count) { ::InitializeCriticalSectionAndSpinCount(&cs, spin_count); }
+inline tapetums::CS::Lock::~Lock()                   { ::DeleteCriticalSection(&cs); }
+
+inline bool tapetums::CS::Lock::raw_try_enter() { return ::TryEnterCriticalSection(&cs) ? true : false; }
+inline void tapetums::CS::Lock::raw_enter()     { ::EnterCriticalSection(&cs); }
+inline void tapetums::CS::Lock::raw_leave()     { ::LeaveCriticalSection(&cs); }
+
+#else
+
+inline tapetums::CS::Lock::Lock() { }
+inline tapetums::CS::Lock::Lock(uint32_t spin_count) : cs(spin_count) { }
+inline tapetums::CS::Lock::~Lock() { }
+
+inline bool tapetums::CS::Lock::raw_try_enter() { return cs.try_enter(); }
+inline void tapetums::CS::Lock::raw_enter()     { cs.enter(); }
+inline void tapetums::CS::Lock::raw_leave()     { cs.leave(); }
+
+#endif
+
+//---------------------------------------------------------------------------//
+
+#if defined(LOCK_PROFILE)
+
+inline tapetums::CS::Lock::Lock(const char* name)
+    : Lock() { m_profile.rename(name); }
+
+inline tapetums::CS::Lock::Lock(const char* name, uint32_t spin_count)
+    : Lock(spin_count) { m_profile.rename(name); }
+
+inline bool tapetums::CS::Lock::try_enter()
+{
+    if ( ! raw_try_enter() )
+    {
+        return false;
+    }
+
+    m_profile.entered();
+    return true;
+}
+
+inline void tapetums::CS::Lock::enter()
+{
+    if ( ! raw_try_enter() )
+    {
+        const auto start = detail::LockCounters::now();
+        raw_enter();
+        m_profile.waited(start);
+    }
+
+    m_profile.entered();
+}
+
+inline void tapetums::CS::Lock::leave()
+{
+    m_profile.leaving();
+    raw_leave();
+}
+
+#else
+
+inline tapetums::CS::Lock::Lock(const char*) : Lock() { }
+inline tapetums::CS::Lock::Lock(const char*, uint32_t spin_count) : Lock(spin_count) { }
+
+inline bool tapetums::CS::Lock::try_enter() { return raw_try_enter(); }
+inline void tapetums::CS::Lock::enter()     { raw_enter(); }
+inline void tapetums::CS::Lock::leave()     { raw_leave(); }
+
+#endif
+
+//---------------------------------------------------------------------------//
+
+class tapetums::CS::LockGuard final
+{
+private:
+    Lock& m_lock;
+
+public:
+    LockGuard() = delete;
+
+    LockGuard(const LockGuard&)             = delete;
+    LockGuard& operator =(const LockGuard&) = delete;
+
+    LockGuard(LockGuard&& rhs)            noexcept = delete;
+    LockGuard& operator=(LockGuard&& rhs) noexcept = delete;
+
+    explicit LockGuard(Lock& lock) : m_lock(lock) { m_lock.enter(); }
+
+    ~LockGuard() { m_lock.leave(); }
+};
+
+//---------------------------------------------------------------------------//
+// Slim Reader/Writer Lock
+//  読み手と書き手を交互に入れたいときは FairLock を使う (SRWLOCK には公平性の保証がない)
+//---------------------------------------------------------------------------//
+
+class tapetums::SRWL::Lock final
+{
+private:
+#if defined(_WIN32) && ! defined(LOCK_PORTABLE)
+    SRWLOCK m_srwl;
+#else
+    detail::SharedLock m_srwl;
+#endif
+
+#if defined(LOCK_PROFILE)
+    detail::LockCounters m_profile { nullptr };
+#endif
+
+public:
+    Lock();
+    explicit Lock(const char* name);
+
+    Lock(const Lock&)             = delete;
+    Lock& operator =(const Lock&) = delete;
+
+    Lock(Lock&&)             noexcept = delete;
+    Lock& operator =(Lock&&) noexcept = delete;
+
+    ~Lock() noexcept = default;
+
+public:
+#if defined(_WIN32) && ! defined(LOCK_PORTABLE)
+    // SleepConditionVariableSRW 用
+    auto operator &() const noexcept { return &m_srwl; }
+    auto operator &() noexcept       { return &m_srwl; }
+#endif
+
+public:
+    bool read_lock();
+    void read_lock_with_blocking();
+    void read_unlock();
+
+    bool write_lock();
+    void write_lock_with_blocking();
+    void write_unlock();
+
+private:
+    bool raw_read_lock();
+    void raw_read_lock_with_blocking();
+    void raw_read_unlock();
+
+    bool raw_write_lock();
+    void raw_write_lock_with_blocking();
+    void raw_write_unlock();
+};
+
+//---------------------------------------------------------------------------//
+
+#if defined(_WIN32) && ! defined(LOCK_PORTABLE)
+
+inline tapetums::SRWL::Lock::Lock() { ::InitializeSRWLock(&m_srwl); }
+
+inline bool tapetums::SRWL::Lock::raw_read_lock()                { return ::TryAcquireSRWLockShared(&m_srwl) ? true : false; }
+inline void tapetums::SRWL::Lock::raw_read_lock_with_blocking()  { ::AcquireSRWLockShared(&m_srwl); }
+inline void tapetums::SRWL::Lock::raw_read_unlock()              { ::ReleaseSRWLockShared(&m_srwl); }
+
+inline bool tapetums::SRWL::Lock::raw_write_lock()               { return ::TryAcquireSRWLockExclusive(&m_srwl) ? true : false; }
+inline void tapetums::SRWL::Lock::raw_write_lock_with_blocking() { ::AcquireSRWLockExclusive(&m_srwl); }
+inline void tapetums::SRWL::Lock::raw_write_unlock()             { ::ReleaseSRWLockExclusive(&m_srwl); }
+
+#else
+
+inline tapetums::SRWL::Lock::Lock() { }
+
+inline bool tapetums::SRWL::Lock::raw_read_lock()                { return m_srwl.try_read_lock(); }
+inline void tapetums::SRWL::Lock::raw_read_lock_with_blocking()  { m_srwl.read_lock(); }
+inline void tapetums::SRWL::Lock::raw_read_unlock()              { m_srwl.read_unlock(); }
+
+inline bool tapetums::SRWL::Lock::raw_write_lock()               { return m_srwl.try_write_lock(); }
+inline void tapetums::SRWL::Lock::raw_write_lock_with_blocking() { m_srwl.write_lock(); }
+inline void tapetums::SRWL::Lock::raw_write_unlock()             { m_srwl.write_unlock(); }
+
+#endif
+
+//---------------------------------------------------------------------------//
+
+#if defined(LOCK_PROFILE)
+
+inline tapetums::SRWL::Lock::Lock(const char* name)
+    : Lock() { m_profile.rename(name); }
+
+inline bool tapetums::SRWL::Lock::read_lock()
+{
+    if ( ! raw_read_lock() )
+    {
+        return false;
+    }
+
+    m_profile.acquired();
+    return true;
+}
+
+inline void tapetums::SRWL::Lock::read_lock_with_blocking()
+{
+    if ( ! raw_read_lock() )
+    {
+        const auto start = detail::LockCounters::now();
+        raw_read_lock_with_blocking();
+        m_profile.waited(start);
+    }
+
+    m_profile.acquired();
+}
+
+inline void tapetums::SRWL::Lock::read_unlock()
+{
+    raw_read_unlock();
+}
+
+inline bool tapetums::SRWL::Lock::write_lock()
+{
+    if ( ! raw_write_lock() )
+    {
+        return false;
+    }
+
+    m_profile.entered();
+    return true;
+}
+
+inline void tapetums::SRWL::Lock::write_lock_with_blocking()
+{
+    if ( ! raw_write_lock() )
+    {
+        const auto start = detail::LockCounters::now();
+        raw_write_lock_with_blocking();
+        m_profile.waited(start);
+    }
+
+    m_profile.entered();
+}
 
-class tapetums::CS::Lock final
+inline void tapetums::SRWL::Lock::write_unlock()
 {
-private:
-    CRITICAL_SECTION cs;
+    m_profile.leaving();
+    raw_write_unlock();
+}
 
-public:
-    Lock()  { ::InitializeCriticalSection(&cs); }
-    ~Lock() { ::DeleteCriticalSection(&cs); }
+#else
 
-    Lock(const Lock&)             = delete;
-    Lock& operator =(const Lock&) = delete;
+inline tapetums::SRWL::Lock::Lock(const char*) : Lock() { }
 
-    Lock(Lock&& rhs)            noexcept = default;
-    Lock& operator=(Lock&& rhs) noexcept = default;
+inline bool tapetums::SRWL::Lock::read_lock()                { return raw_read_lock(); }
+inline void tapetums::SRWL::Lock::read_lock_with_blocking()  { raw_read_lock_with_blocking(); }
+inline void tapetums::SRWL::Lock::read_unlock()              { raw_read_unlock(); }
 
-public:
-    void enter() { ::EnterCriticalSection(&cs); }
-    void leave() { ::LeaveCriticalSection(&cs); }
-};
+inline bool tapetums::SRWL::Lock::write_lock()               { return raw_write_lock(); }
+inline void tapetums::SRWL::Lock::write_lock_with_blocking() { raw_write_lock_with_blocking(); }
+inline void tapetums::SRWL::Lock::write_unlock()             { raw_write_unlock(); }
+
+#endif
 
+//---------------------------------------------------------------------------//
+// Phase-Fair Reader/Writer Lock
+//  SRWL::Lock と同じ使い方で, 読み手と書き手が交互に入る (どちらも飢えない)
+//  SleepConditionVariableSRW には使えない
 //---------------------------------------------------------------------------//
 
-class tapetums::CS::LockGuard final
+class tapetums::SRWL::FairLock final
 {
 private:
-    Lock& m_lock;
+    detail::PhaseFairLock m_fair;
+
+#if defined(LOCK_PROFILE)
+    detail::LockCounters m_profile { nullptr };
+#endif
 
 public:
-    LockGuard() = delete;
+    FairLock() = default;
+    explicit FairLock(const char* name);
 
-    LockGuard(const LockGuard&)             = delete;
-    LockGuard& operator =(const LockGuard&) = delete;
+    FairLock(const FairLock&)             = delete;
+    FairLock& operator =(const FairLock&) = delete;
 
-    LockGuard(LockGuard&& rhs)            noexcept = delete;
-    LockGuard& operator=(LockGuard&& rhs) noexcept = delete;
+    FairLock(FairLock&&)             noexcept = delete;
+    FairLock& operator =(FairLock&&) noexcept = delete;
 
-    explicit LockGuard(Lock& lock) : m_lock(lock) { m_lock.enter(); }
+    ~FairLock() noexcept = default;
 
-    ~LockGuard() { m_lock.leave(); }
-};
+public:
+    bool read_lock();
+    void read_lock_with_blocking();
+    void read_unlock();
 
-//---------------------------------------------------------------------------//
-// Slim Reader/Writer Lock
-//---------------------------------------------------------------------------//
+    bool write_lock();
+    void write_lock_with_blocking();
+    void write_unlock();
 
-class tapetums::SRWL::Lock final
-{
 private:
-    SRWLOCK m_srwl;
-
-public:
-    Lock() { ::InitializeSRWLock(&m_srwl); }
+    bool raw_read_lock()                { return m_fair.try_read_lock(); }
+    void raw_read_lock_with_blocking()  { m_fair.read_lock(); }
+    void raw_read_unlock()              { m_fair.read_unlock(); }
 
-    Lock(const Lock&)             = delete;
-    Lock& operator =(const Lock&) = delete;
+    bool raw_write_lock()               { return m_fair.try_write_lock(); }
+    void raw_write_lock_with_blocking() { m_fair.write_lock(); }
+    void raw_write_unlock()             { m_fair.write_unlock(); }
+};
 
-    Lock(Lock&&)             noexcept = default;
-    Lock& operator =(Lock&&) noexcept = default;
+//---------------------------------------------------------------------------//
 
-    ~Lock() noexcept = default;
+#if defined(LOCK_PROFILE)
 
-public:
-    auto operator &() const noexcept { return &m_srwl; }
-    auto operator &() noexcept       { return &m_srwl; }
+inline tapetums::SRWL::FairLock::FairLock(const char* name)
+    : FairLock() { m_profile.rename(name); }
 
-public:
-    bool read_lock()
+inline bool tapetums::SRWL::FairLock::read_lock()
+{
+    if ( ! raw_read_lock() )
     {
-        return ::TryAcquireSRWLockShared(&m_srwl) ? true : false;
+        return false;
     }
 
-    void read_lock_with_blocking()
-    {
-        ::AcquireSRWLockShared(&m_srwl);
-    }
+    m_profile.acquired();
+    return true;
+}
 
-    void read_unlock()
+inline void tapetums::SRWL::FairLock::read_lock_with_blocking()
+{
+    if ( ! raw_read_lock() )
     {
-        ::ReleaseSRWLockShared(&m_srwl);
+        const auto start = detail::LockCounters::now();
+        raw_read_lock_with_blocking();
+        m_profile.waited(start);
     }
 
-    bool write_lock()
-    {
-        return ::TryAcquireSRWLockExclusive(&m_srwl) ? true : false;
-    }
+    m_profile.acquired();
+}
 
-    void write_lock_with_blocking()
+inline void tapetums::SRWL::FairLock::read_unlock()
+{
+    raw_read_unlock();
+}
+
+inline bool tapetums::SRWL::FairLock::write_lock()
+{
+    if ( ! raw_write_lock() )
     {
-        ::AcquireSRWLockExclusive(&m_srwl);
+        return false;
     }
 
-    void write_unlock()
+    m_profile.entered();
+    return true;
+}
+
+inline void tapetums::SRWL::FairLock::write_lock_with_blocking()
+{
+    if ( ! raw_write_lock() )
     {
-        ::ReleaseSRWLockExclusive(&m_srwl);
+        const auto start = detail::LockCounters::now();
+        raw_write_lock_with_blocking();
+        m_profile.waited(start);
     }
-};
+
+    m_profile.entered();
+}
+
+inline void tapetums::SRWL::FairLock::write_unlock()
+{
+    m_profile.leaving();
+    raw_write_unlock();
+}
+
+#else
+
+inline tapetums::SRWL::FairLock::FairLock(const char*) : FairLock() { }
+
+inline bool tapetums::SRWL::FairLock::read_lock()                { return raw_read_lock(); }
+inline void tapetums::SRWL::FairLock::read_lock_with_blocking()  { raw_read_lock_with_blocking(); }
+inline void tapetums::SRWL::FairLock::read_unlock()              { raw_read_unlock(); }
+
+inline bool tapetums::SRWL::FairLock::write_lock()               { return raw_write_lock(); }
+inline void tapetums::SRWL::FairLock::write_lock_with_blocking() { raw_write_lock_with_blocking(); }
+inline void tapetums::SRWL::FairLock::write_unlock()             { raw_write_unlock(); }
+
+#endif
 
 //---------------------------------------------------------------------------//
 
-class tapetums::SRWL::ReadGuard final
+// SRWL::Lock / SRWL::FairLock の読み手側 (ReadGuard / FairReadGuard)
+template<typename L>
+class tapetums::SRWL::BasicReadGuard final
 {
 private:
-    Lock& m_lock;
-    bool  m_acquired { false };
+    L&   m_lock;
+    bool m_acquired { false };
 
 public:
-    ReadGuard() noexcept = delete;
+    BasicReadGuard() noexcept = delete;
 
-    ReadGuard(const ReadGuard&)             = delete;
-    ReadGuard& operator =(const ReadGuard&) = delete;
+    BasicReadGuard(const BasicReadGuard&)             = delete;
+    BasicReadGuard& operator =(const BasicReadGuard&) = delete;
 
-    ReadGuard(ReadGuard&&)             noexcept = delete;
-    ReadGuard& operator =(ReadGuard&&) noexcept = delete;
+    BasicReadGuard(BasicReadGuard&&)             noexcept = delete;
+    BasicReadGuard& operator =(BasicReadGuard&&) noexcept = delete;
 
-    explicit ReadGuard(Lock& lock) noexcept : m_lock(lock) { }
+    explicit BasicReadGuard(L& lock) noexcept : m_lock(lock) { }
 
-    ~ReadGuard() { release(); }
+    ~BasicReadGuard() { release(); }
 
 public:
     bool is_acquired() const noexcept { return m_acquired; }
@@ -196,24 +1549,26 @@ public:
 
 //---------------------------------------------------------------------------//
 
-class tapetums::SRWL::WriteGuard final
+// SRWL::Lock / SRWL::FairLock の書き手側 (WriteGuard / FairWriteGuard)
+template<typename L>
+class tapetums::SRWL::BasicWriteGuard final
 {
 private:
-    Lock& m_lock;
-    bool  m_acquired { false };
+    L&   m_lock;
+    bool m_acquired { false };
 
 public:
-    WriteGuard() noexcept = delete;
+    BasicWriteGuard() noexcept = delete;
 
-    WriteGuard(const WriteGuard&)             = delete;
-    WriteGuard& operator =(const WriteGuard&) = delete;
+    BasicWriteGuard(const BasicWriteGuard&)             = delete;
+    BasicWriteGuard& operator =(const BasicWriteGuard&) = delete;
 
-    WriteGuard(WriteGuard&&)             = delete;
-    WriteGuard& operator =(WriteGuard&&) = delete;
+    BasicWriteGuard(BasicWriteGuard&&)             = delete;
+    BasicWriteGuard& operator =(BasicWriteGuard&&) = delete;
 
-    explicit WriteGuard(Lock& lock) noexcept : m_lock(lock) { }
+    explicit BasicWriteGuard(L& lock) noexcept : m_lock(lock) { }
 
-    ~WriteGuard() { release(); }
+    ~BasicWriteGuard() { release(); }
 
 public:
     bool is_acquired() const noexcept { return m_acquired; }
@@ -259,4 +1614,372 @@ public:
 
 //---------------------------------------------------------------------------//
 
+//---------------------------------------------------------------------------//
+// Sequence Lock
+//  小さな POD の読み取り専用スナップショット
+//  二面のバッファを交互に書くので, 読み手は書き込み中でも待たずに読める
+//  読み直しは一回の読み取り中に書き込みが二回始まったときだけ
+//---------------------------------------------------------------------------//
+
+template<typename T>
+class tapetums::SeqLock final
+{
+    static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+    static_assert(std::is_default_constructible<T>::value, "T must be default constructible");
+
+private:
+    static constexpr size_t WORD_COUNT { (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t) };
+
+    // 偶数: 安定, 奇数: 次の面へ書き込み中. 今の面は (m_seq / 2) % 2
+    std::atomic<uint32_t> m_seq { 0 };
+    std::atomic<uint64_t> m_words[2][WORD_COUNT];
+    detail::SharedLock    m_writer;
+
+public:
+    SeqLock() : SeqLock(T { }) { }
+    explicit SeqLock(const T& value) noexcept { write_words(0, value); write_words(1, value); }
+
+    SeqLock(const SeqLock&)             = delete;
+    SeqLock& operator =(const SeqLock&) = delete;
+
+    SeqLock(SeqLock&&)             = delete;
+    SeqLock& operator =(SeqLock&&) = delete;
+
+public:
+    uint32_t version() const noexcept { return m_seq.load(std::memory_order_acquire) / 2; }
+
+public:
+    T    load() const noexcept;
+    void store(const T& value) noexcept;
+
+    template<typename F>
+    void update(F&& f);
+
+private:
+    void publish(const T& value) noexcept;
+    void write_words(uint32_t face, const T& value) noexcept;
+};
+
+//---------------------------------------------------------------------------//
+
+template<typename T>
+inline T tapetums::SeqLock<T>::load() const noexcept
+{
+    uint64_t words[WORD_COUNT];
+
+    for ( ;; )
+    {
+        const auto begin  = m_seq.load(std::memory_order_acquire);
+        const auto stable = begin & ~1u;
+        const auto face   = (begin / 2) % 2;
+
+        for ( size_t i = 0; i < WORD_COUNT; ++i )
+        {
+            words[i] = m_words[face][i].load(std::memory_order_relaxed);
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        // この面に次に書き込むのは stable + 3 を付けた書き手
+        if ( m_seq.load(std::memory_order_relaxed) - stable < 3 )
+        {
+            break;
+        }
+    }
+
+    T value;
+    std::memcpy(&value, words, sizeof(T));
+    return value;
+}
+
+//---------------------------------------------------------------------------//
+
+template<typename T>
+inline void tapetums::SeqLock<T>::store(const T& value) noexcept
+{
+    m_writer.write_lock();
+    publish(value);
+    m_writer.write_unlock();
+}
+
+//---------------------------------------------------------------------------//
+
+// f(T&) で今の値を書き換える. 書き手同士は排他する
+template<typename T>
+template<typename F>
+inline void tapetums::SeqLock<T>::update(F&& f)
+{
+    m_writer.write_lock();
+
+    auto value = load();
+    try
+    {
+        f(value);
+    }
+    catch ( ... )
+    {
+        m_writer.write_unlock();
+        throw;
+    }
+
+    publish(value);
+    m_writer.write_unlock();
+}
+
+//---------------------------------------------------------------------------//
+
+// 書き込み開始を読み手に見せてから, 今と反対の面に書く
+// 同じ原子変数への RMW なので前回の公開 (release) の連鎖が途切れない
+template<typename T>
+inline void tapetums::SeqLock<T>::publish(const T& value) noexcept
+{
+    const auto seq = m_seq.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    write_words((seq / 2 + 1) % 2, value);
+
+    m_seq.fetch_add(1, std::memory_order_release);
+}
+
+//---------------------------------------------------------------------------//
+
+template<typename T>
+inline void tapetums::SeqLock<T>::write_words(uint32_t face, const T& value) noexcept
+{
+    uint64_t words[WORD_COUNT] { };
+    std::memcpy(words, &value, sizeof(T));
+
+    for ( size_t i = 0; i < WORD_COUNT; ++i )
+    {
+        m_words[face][i].store(words[i], std::memory_order_relaxed);
+    }
+}
+
+//---------------------------------------------------------------------------//
+// Read-Copy-Update Cell
+//  読み取りが大半の大きなオブジェクトを差し替えで更新する
+//  読み手はスレッドごとに分けたカウンタを増減するだけで待たない
+//  書き手は差し替えた後, 古い版を読んでいる読み手が抜けるのを待ってから解放する
+//---------------------------------------------------------------------------//
+
+template<typename T>
+class tapetums::RcuCell final
+{
+public:
+    class ReadGuard;
+
+private:
+    static constexpr size_t STRIPE_COUNT { 16 };
+
+    // 読み手の入室数. 世代の偶奇ごとに数える
+    struct alignas(64) Stripe
+    {
+        std::atomic<uint32_t> readers[2];
+    };
+
+    std::atomic<T*>       m_value { nullptr };
+    std::atomic<uint32_t> m_epoch { 0 };
+    mutable Stripe        m_stripes[STRIPE_COUNT];
+    detail::SharedLock    m_writer;
+
+public:
+    RcuCell() : RcuCell(std::unique_ptr<T>(new T)) { }
+    explicit RcuCell(std::unique_ptr<T> value) noexcept;
+    ~RcuCell() { delete m_value.load(std::memory_order_relaxed); }
+
+    RcuCell(const RcuCell&)             = delete;
+    RcuCell& operator =(const RcuCell&) = delete;
+
+    RcuCell(RcuCell&&)             = delete;
+    RcuCell& operator =(RcuCell&&) = delete;
+
+public:
+    ReadGuard read() const noexcept;
+
+    void store(std::unique_ptr<T> value);
+    std::unique_ptr<T> exchange(std::unique_ptr<T> value);
+
+    template<typename F>
+    void update(F&& f);
+
+    void synchronize();
+
+private:
+    void wait_readers(uint32_t parity) const;
+    Stripe& stripe() const noexcept;
+};
+
+//---------------------------------------------------------------------------//
+
+// 保持している間は読んだ版が解放されない
+// 保持したまま同じスレッドで同じセルに書き込むとデッドロックする
+template<typename T>
+class tapetums::RcuCell<T>::ReadGuard final
+{
+    friend class RcuCell<T>;
+
+private:
+    std::atomic<uint32_t>* m_readers { nullptr };
+    const T*               m_value   { nullptr };
+
+public:
+    ReadGuard() noexcept = delete;
+
+    ReadGuard(const ReadGuard&)             = delete;
+    ReadGuard& operator =(const ReadGuard&) = delete;
+
+    ReadGuard(ReadGuard&& rhs) noexcept
+        : m_readers(rhs.m_readers), m_value(rhs.m_value) { rhs.m_readers = nullptr; }
+    ReadGuard& operator =(ReadGuard&&) = delete;
+
+    ~ReadGuard() { release(); }
+
+private:
+    explicit ReadGuard(std::atomic<uint32_t>* readers) noexcept : m_readers(readers) { }
+
+public:
+    bool is_acquired() const noexcept { return m_readers != nullptr; }
+
+    const T* get() const noexcept { return m_value; }
+    const T& operator *() const noexcept { return *m_value; }
+    const T* operator ->() const noexcept { return m_value; }
+
+public:
+    void release() noexcept
+    {
+        if ( m_readers )
+        {
+            m_readers->fetch_sub(1, std::memory_order_release);
+            m_readers = nullptr;
+            m_value   = nullptr;
+        }
+    }
+};
+
+//---------------------------------------------------------------------------//
+
+template<typename T>
+inline tapetums::RcuCell<T>::RcuCell(std::unique_ptr<T> value) noexcept
+{
+    for ( auto& stripe : m_stripes )
+    {
+        stripe.readers[0].store(0, std::memory_order_relaxed);
+        stripe.readers[1].store(0, std::memory_order_relaxed);
+    }
+
+    m_value.store(value.release(), std::memory_order_release);
+}
+
+//---------------------------------------------------------------------------//
+
+template<typename T>
+inline typename tapetums::RcuCell<T>::ReadGuard tapetums::RcuCell<T>::read() const noexcept
+{
+    // 入室を数えてから版を読む. 書き手は差し替えの後に数を見るので取りこぼさない
+    const auto parity = m_epoch.load(std::memory_order_relaxed) % 2;
+
+    auto& readers = stripe().readers[parity];
+    readers.fetch_add(1, std::memory_order_seq_cst);
+
+    ReadGuard guard(&readers);
+    guard.m_value = m_value.load(std::memory_order_seq_cst);
+    return guard;
+}
+
+//---------------------------------------------------------------------------//
+
+template<typename T>
+inline void tapetums::RcuCell<T>::store(std::unique_ptr<T> value)
+{
+    exchange(std::move(value));
+}
+
+//---------------------------------------------------------------------------//
+
+// 差し替えて, 誰も読んでいなくなった古い版を返す
+template<typename T>
+inline std::unique_ptr<T> tapetums::RcuCell<T>::exchange(std::unique_ptr<T> value)
+{
+    m_writer.write_lock();
+
+    std::unique_ptr<T> old(m_value.exchange(value.release(), std::memory_order_seq_cst));
+    synchronize();
+
+    m_writer.write_unlock();
+    return old;
+}
+
+//---------------------------------------------------------------------------//
+
+// 今の版の複製を f(T&) で書き換えて差し替える. 書き手同士は排他する
+template<typename T>
+template<typename F>
+inline void tapetums::RcuCell<T>::update(F&& f)
+{
+    m_writer.write_lock();
+
+    std::unique_ptr<T> old;
+    try
+    {
+        std::unique_ptr<T> copy(new T(*m_value.load(std::memory_order_relaxed)));
+        f(*copy);
+
+        old.reset(m_value.exchange(copy.release(), std::memory_order_seq_cst));
+        synchronize();
+    }
+    catch ( ... )
+    {
+        m_writer.write_unlock();
+        throw;
+    }
+
+    m_writer.write_unlock();
+}
+
+//---------------------------------------------------------------------------//
+
+// この呼び出しより前に始まった読み取りが全て終わるまで待つ
+// 世代を二回進め, 偶奇それぞれの入室数が 0 になるのを待つ
+// (古い世代を読んだまま遅れて入室した読み手も, 二回目で必ず捕まえる)
+template<typename T>
+inline void tapetums::RcuCell<T>::synchronize()
+{
+    for ( int i = 0; i < 2; ++i )
+    {
+        const auto epoch = m_epoch.fetch_add(1, std::memory_order_seq_cst);
+        wait_readers(epoch % 2);
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+template<typename T>
+inline void tapetums::RcuCell<T>::wait_readers(uint32_t parity) const
+{
+    for ( auto& stripe : m_stripes )
+    {
+        uint32_t count { 0 };
+        while ( stripe.readers[parity].load(std::memory_order_acquire) != 0 )
+        {
+            if ( ++count < detail::lock_spin_limit() ) { detail::lock_pause(); }
+            else                                       { std::this_thread::yield(); }
+        }
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// スレッドごとに決まったカウンタを使い, 読み手同士でキャッシュラインを取り合わない
+template<typename T>
+inline typename tapetums::RcuCell<T>::Stripe& tapetums::RcuCell<T>::stripe() const noexcept
+{
+    static thread_local const size_t index
+    {
+        std::hash<std::thread::id>()(std::this_thread::get_id()) % STRIPE_COUNT
+    };
+    return m_stripes[index];
+}
+
+//---------------------------------------------------------------------------//
+
 // Lock.hpp
\ No newline at end of file
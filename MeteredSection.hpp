@@ -20,8 +20,29 @@
 
 #include <utility>
 
-#include <windows.h>
-#include <strsafe.h>
+#if defined(_WIN32)
+  #include <windows.h>
+  #include <strsafe.h>
+#else
+  #include <cerrno>
+  #include <cstdint>
+  #include <cstdio>
+  #include <cstring>
+  #include <atomic>
+  #include <chrono>
+  #include <thread>
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+  #include <time.h>
+  #if defined(__linux__)
+    #include <linux/futex.h>
+    #include <sys/syscall.h>
+  #endif
+#endif
+
+#if defined(_WIN32)
 
 //---------------------------------------------------------------------------//
 //
@@ -32,27 +53,40 @@
 class MeteredSection final
 {
     static constexpr size_t MAX_METSECT_NAMELEN = 128;
+    static constexpr LONG   SLOT_COUNT          = 64; // 同時に並べる待ちの数
+
+    enum SLOT_STATE : LONG { SLOT_FREE, SLOT_WAITING, SLOT_ABANDONED };
 
 private:
+    struct METSECT_WAIT_SLOT
+    {
+        LONG lRequest; // Requested resource count
+        LONG lState;   // SLOT_STATE
+    };
+
     struct METSECT_SHARED_INFO
     {
-        BOOL fInitialized;    // Is the metered section initialized?
-        LONG lSpinLock;       // Used to gain access to this structure
-        LONG lThreadsWaiting; // Count of threads waiting
-        LONG lAvailableCount; // Available resource count
-        LONG lMaximumCount;   // Maximum resource count
+        BOOL  fInitialized;    // Is the metered section initialized?
+        LONG  lSpinLock;       // Used to gain access to this structure
+        LONG  lThreadsWaiting; // Count of threads waiting (queued)
+        LONG  lAvailableCount; // Available resource count
+        LONG  lMaximumCount;   // Maximum resource count
+        DWORD lNextTicket;     // Ticket for the next waiter
+        DWORD lServingTicket;  // Ticket of the waiter at the head
+        METSECT_WAIT_SLOT aSlots[SLOT_COUNT];
     };
 
     struct METERED_SECTION
     {
-        HANDLE hEvent;   // Handle to a kernel event object
-        HANDLE hFileMap; // Handle to memory mapped file
+        HANDLE hEvents[SLOT_COUNT]; // Kernel event objects per wait slot (opened on demand)
+        HANDLE hFileMap;            // Handle to memory mapped file
         METSECT_SHARED_INFO* lpSharedInfo;
+        WCHAR  szName[MAX_METSECT_NAMELEN + 1];
     };
 
 private:
     METSECT_SHARED_INFO m_met_info;
-    METERED_SECTION     m_met_sect;
+    METERED_SECTION     m_met_sect { };
 
 public:
     MeteredSection() noexcept { m_met_sect.lpSharedInfo = nullptr; }
@@ -60,8 +94,8 @@ public:
     MeteredSection(const MeteredSection&) = delete;
     MeteredSection& operator =(const MeteredSection&) = delete;
 
-    MeteredSection(MeteredSection&&) noexcept = default;
-    MeteredSection& operator =(MeteredSection&&) noexcept = default;
+    MeteredSection(MeteredSection&& rhs) noexcept { std::swap(m_met_sect, rhs.m_met_sect); }
+    MeteredSection& operator =(MeteredSection&& rhs) noexcept { std::swap(m_met_sect, rhs.m_met_sect); return *this; }
 
     ~MeteredSection() { Close(); }
 
@@ -79,14 +113,20 @@ public:
     bool Open(LPCWSTR lpName);
 
     DWORD Enter(DWORD dwMilliseconds);
+    DWORD Enter(LONG lCount, DWORD dwMilliseconds);
+    bool  TryEnter(LONG lCount = 1);
     bool  Leave(LONG lReleaseCount, LONG* lpPreviousCount = nullptr);
     void  Close();
 
 private:
     bool Initialize     (LONG lInitialCount, LONG lMaximumCount, LPCWSTR lpName, BOOL bOpenOnly);
-    bool CreateSectEvent(LPCWSTR lpName, BOOL bOpenOnly);
     bool CreateFileView (LONG lInitialCount, LONG lMaximumCount, LPCWSTR lpName, BOOL bOpenOnly);
 
+    HANDLE SlotEvent(DWORD slot);
+
+    LONG Dequeue (DWORD ticket);
+    LONG WakeHead();
+
     void GetLock    ();
     void ReleaseLock();
 };
@@ -182,6 +222,19 @@ inline DWORD MeteredSection::Enter
 (
     DWORD dwMilliseconds
 )
+{
+    return Enter(1, dwMilliseconds);
+}
+
+//---------------------------------------------------------------------------//
+
+// lCount 個をまとめて確保する. 待つ場合は到着順に並び,
+// 先頭の要求数が満たせるようになったときに先頭だけが起こされる
+inline DWORD MeteredSection::Enter
+(
+    LONG  lCount,
+    DWORD dwMilliseconds
+)
 {
     if ( ! initialized() )
     {
@@ -189,33 +242,108 @@ inline DWORD MeteredSection::Enter
         return WAIT_FAILED;
     }
 
-    for ( ; ; )
+    auto info = m_met_sect.lpSharedInfo;
+    if ( lCount < 1 || lCount > info->lMaximumCount )
     {
-        GetLock();
+        ::SetLastError(ERROR_INVALID_PARAMETER);
+        return WAIT_FAILED;
+    }
+
+    // 残り時間 (無期限なら INFINITE, 時間切れなら 0)
+    const auto start = ::GetTickCount64();
+    const auto remaining = [&]() -> DWORD
+    {
+        if ( dwMilliseconds == INFINITE ) { return INFINITE; }
+
+        const auto elapsed = ::GetTickCount64() - start;
+        return elapsed < dwMilliseconds ? DWORD(dwMilliseconds - elapsed) : 0;
+    };
 
+    // Get in at once if nobody is queued; otherwise take a ticket
+    GetLock();
+    for ( ; ; )
+    {
         // We have access to the metered section, everything we do now will be atomic
-        if ( m_met_sect.lpSharedInfo->lAvailableCount >= 1 )
+        if ( info->lThreadsWaiting == 0 && info->lAvailableCount >= lCount )
         {
-            m_met_sect.lpSharedInfo->lAvailableCount--;
+            info->lAvailableCount -= lCount;
             ReleaseLock();
             return WAIT_OBJECT_0;
         }
+        if ( dwMilliseconds == 0 )
+        {
+            ReleaseLock();
+            return WAIT_TIMEOUT;
+        }
+        if ( info->lNextTicket - info->lServingTicket < DWORD(SLOT_COUNT) )
+        {
+            break;
+        }
 
-        // Couldn't get in. Wait on the event object
-        m_met_sect.lpSharedInfo->lThreadsWaiting++;
-        ::ResetEvent(m_met_sect.hEvent);
-
+        // The queue is full; wait for a slot
         ReleaseLock();
-
-        if ( WAIT_TIMEOUT == ::WaitForSingleObject(m_met_sect.hEvent, dwMilliseconds) )
+        if ( remaining() == 0 )
         {
             return WAIT_TIMEOUT;
         }
+        ::Sleep(1);
+        GetLock();
+    }
+
+    const auto ticket = info->lNextTicket++;
+    const auto slot   = ticket % SLOT_COUNT;
+    info->aSlots[slot].lRequest = lCount;
+    info->aSlots[slot].lState   = SLOT_WAITING;
+    info->lThreadsWaiting++;
+
+    ReleaseLock();
+
+    const auto hEvent = SlotEvent(slot);
+
+    for ( ; ; )
+    {
+        GetLock();
+
+        if ( info->lServingTicket == ticket && info->lAvailableCount >= lCount )
+        {
+            info->lAvailableCount -= lCount;
+            const auto next = Dequeue(ticket);
+            ReleaseLock();
+
+            if ( next >= 0 ) { ::SetEvent(SlotEvent(next)); }
+            return WAIT_OBJECT_0;
+        }
+
+        const auto dwWait = remaining();
+        if ( hEvent == nullptr || dwWait == 0 )
+        {
+            const auto next = Dequeue(ticket);
+            ReleaseLock();
+
+            if ( next >= 0 ) { ::SetEvent(SlotEvent(next)); }
+            return hEvent ? WAIT_TIMEOUT : WAIT_FAILED;
+        }
+
+        ReleaseLock();
+
+        // Couldn't get in. Wait on the event object of our slot
+        ::WaitForSingleObject(hEvent, dwWait);
     }
 }
 
 //---------------------------------------------------------------------------//
 
+// 待たずに lCount 個をまとめて確保する. 並んでいる者がいれば追い越さない
+inline bool MeteredSection::TryEnter
+(
+    LONG lCount
+)
+{
+    return Enter(lCount, 0) == WAIT_OBJECT_0;
+}
+
+//---------------------------------------------------------------------------//
+
 inline bool MeteredSection::Leave
 (
     LONG  lReleaseCount,
@@ -247,21 +375,14 @@ inline bool MeteredSection::Leave
 
     m_met_sect.lpSharedInfo->lAvailableCount += lReleaseCount;
 
-    // Set the event the appropriate number of times
-    lReleaseCount = min(lReleaseCount, m_met_sect.lpSharedInfo->lThreadsWaiting);
-    if ( m_met_sect.lpSharedInfo->lThreadsWaiting )
-    {
-        for ( int iCount = 0; iCount < lReleaseCount; ++iCount )
-        {
-            m_met_sect.lpSharedInfo->lThreadsWaiting--;
-        }
+    // Wake the head of the queue if its request can now be satisfied
+    const auto next = WakeHead();
 
-        ReleaseLock();
-        ::SetEvent(m_met_sect.hEvent);
-    }
-    else
+    ReleaseLock();
+
+    if ( next >= 0 )
     {
-        ReleaseLock();
+        ::SetEvent(SlotEvent(next));
     }
 
     return true;
@@ -269,14 +390,12 @@ inline bool MeteredSection::Leave
 
 //---------------------------------------------------------------------------//
 
-void MeteredSection::Close()
+inline void MeteredSection::Close()
 {
     if ( ! initialized() ) { return; }
 
-    // Block so that other threads cannot enter anymore
-    GetLock();
-
     // Clean up
+    // (共有のロックは他のプロセスも使うので, ここで取ったまま閉じてはいけない)
     if ( m_met_sect.lpSharedInfo )
     {
         ::UnmapViewOfFile(m_met_sect.lpSharedInfo );
@@ -287,10 +406,13 @@ void MeteredSection::Close()
         ::CloseHandle(m_met_sect.hFileMap );
         m_met_sect.hFileMap = nullptr;
     }
-    if ( m_met_sect.hEvent )
+    for ( auto& hEvent : m_met_sect.hEvents )
     {
-        ::CloseHandle(m_met_sect.hEvent );
-        m_met_sect.hEvent = nullptr;
+        if ( hEvent )
+        {
+            ::CloseHandle(hEvent);
+            hEvent = nullptr;
+        }
     }
 }
 
@@ -309,18 +431,20 @@ inline bool MeteredSection::Initialize
         return false; // Already initialized
     }
 
-    m_met_sect.hEvent       = nullptr;
     m_met_sect.hFileMap     = nullptr;
     m_met_sect.lpSharedInfo = nullptr;
 
-    // Try to create the event object
-    if ( CreateSectEvent(lpName, bOpenOnly) )
+    // Event objects are created per wait slot on demand
+    m_met_sect.szName[0] = L'\0';
+    if ( lpName )
     {
-        // Try to create the memory mapped file
-        if ( CreateFileView(lInitialCount, lMaximumCount, lpName, bOpenOnly) )
-        {
-            return true;
-        }
+        ::StringCchCopyW(m_met_sect.szName, MAX_METSECT_NAMELEN + 1, lpName);
+    }
+
+    // Try to create the memory mapped file
+    if ( CreateFileView(lInitialCount, lMaximumCount, lpName, bOpenOnly) )
+    {
+        return true;
     }
 
     // Error occured, return false so the caller knows to clean up
@@ -329,35 +453,99 @@ inline bool MeteredSection::Initialize
 
 //---------------------------------------------------------------------------//
 
-inline bool MeteredSection::CreateSectEvent
+// 待ち席ごとの自動リセットイベント. 名前付きなら他のプロセスと共有する
+inline HANDLE MeteredSection::SlotEvent
 (
-    LPCWSTR lpName,
-    BOOL    bOpenOnly
+    DWORD slot
 )
 {
-    WCHAR sz [MAX_PATH];
+    auto& hSlot = m_met_sect.hEvents[slot];
+    if ( hSlot )
+    {
+        return hSlot;
+    }
 
-    if ( lpName )
+    HANDLE hEvent;
+    if ( m_met_sect.szName[0] )
     {
-        ::StringCchPrintfW(sz, MAX_PATH, L"DKC_MSECT_EVT_%s", lpName);
+        WCHAR sz [MAX_PATH];
+        ::StringCchPrintfW(sz, MAX_PATH, L"DKC_MSECT_EVT_%s_%u", m_met_sect.szName, slot);
 
-        if ( bOpenOnly )
-        {
-            m_met_sect.hEvent = ::OpenEventW(EVENT_ALL_ACCESS, FALSE, sz);
-        }
-        else
-        {
-            // Create an auto-reset named event object
-            m_met_sect.hEvent = ::CreateEventW(nullptr, FALSE, FALSE, sz);
-        }
+        // Create (or open) an auto-reset named event object
+        hEvent = ::CreateEventW(nullptr, FALSE, FALSE, sz);
     }
     else
     {
         // Create an auto-reset unnamed event object
-        m_met_sect.hEvent = ::CreateEventW(nullptr, FALSE, FALSE, nullptr);
+        hEvent = ::CreateEventW(nullptr, FALSE, FALSE, nullptr);
+    }
+
+    // 同じインスタンスの他のスレッドが先に作っていたらそちらを使う
+    const auto hOther = ::InterlockedCompareExchangePointer(&hSlot, hEvent, nullptr);
+    if ( hOther )
+    {
+        if ( hEvent ) { ::CloseHandle(hEvent); }
+        return hOther;
+    }
+
+    return hEvent;
+}
+
+//---------------------------------------------------------------------------//
+
+// 列から抜ける (要ロック). 先頭なら次へ進め, 途中なら席を放棄済みにしておく
+// 次の先頭を起こすべきならその席を返す (なければ -1)
+inline LONG MeteredSection::Dequeue
+(
+    DWORD ticket
+)
+{
+    auto info = m_met_sect.lpSharedInfo;
+
+    info->lThreadsWaiting--;
+
+    if ( info->lServingTicket != ticket )
+    {
+        info->aSlots[ticket % SLOT_COUNT].lState = SLOT_ABANDONED;
+        return -1;
+    }
+
+    info->aSlots[ticket % SLOT_COUNT].lState = SLOT_FREE;
+    ++info->lServingTicket;
+
+    // Skip the slots of waiters which timed out
+    while ( info->lServingTicket != info->lNextTicket )
+    {
+        auto& slot = info->aSlots[info->lServingTicket % SLOT_COUNT];
+        if ( slot.lState != SLOT_ABANDONED )
+        {
+            break;
+        }
+        slot.lState = SLOT_FREE;
+        ++info->lServingTicket;
+    }
+
+    return WakeHead();
+}
+
+//---------------------------------------------------------------------------//
+
+// 先頭の要求数が満たせるなら, その席を返す (要ロック. なければ -1)
+inline LONG MeteredSection::WakeHead()
+{
+    auto info = m_met_sect.lpSharedInfo;
+    if ( info->lServingTicket == info->lNextTicket )
+    {
+        return -1;
+    }
+
+    const auto slot = LONG(info->lServingTicket % SLOT_COUNT);
+    if ( info->lAvailableCount < info->aSlots[slot].lRequest )
+    {
+        return -1;
     }
 
-    return m_met_sect.hEvent ? true : false;
+    return slot;
 }
 
 //---------------------------------------------------------------------------//
@@ -418,6 +606,13 @@ inline bool MeteredSection::CreateFileView
                 m_met_sect.lpSharedInfo->lThreadsWaiting = 0;
                 m_met_sect.lpSharedInfo->lAvailableCount = lInitialCount;
                 m_met_sect.lpSharedInfo->lMaximumCount   = lMaximumCount;
+                m_met_sect.lpSharedInfo->lNextTicket     = 0;
+                m_met_sect.lpSharedInfo->lServingTicket  = 0;
+                for ( auto& slot : m_met_sect.lpSharedInfo->aSlots )
+                {
+                    slot.lRequest = 0;
+                    slot.lState   = SLOT_FREE;
+                }
                 ::InterlockedExchange((LONG*)&(m_met_sect.lpSharedInfo->fInitialized), (LONG)TRUE);
             }
             else
@@ -452,4 +647,701 @@ inline void MeteredSection::ReleaseLock()
 
 //---------------------------------------------------------------------------//
 
+#else // POSIX
+
+//---------------------------------------------------------------------------//
+//
+// Class (POSIX)
+//  共有メモリ (shm_open / mmap) 上の計数を futex で待つ
+//  空きがあれば Enter / Leave は共有語への CAS 一回で済み,
+//  本当に待つスレッドだけがカーネルに入る
+//  待ち行列は到着順で, 先頭の要求数が満たせるときだけ先頭を起こす
+//  名前付きの共有メモリは最後に閉じても残るので, 不要になったら Unlink する
+//
+//---------------------------------------------------------------------------//
+
+class MeteredSection final
+{
+    static constexpr size_t MAX_METSECT_NAMELEN = 128;
+
+public:
+    static constexpr uint32_t WAIT_OBJECT_0 = 0x00000000;
+    static constexpr uint32_t WAIT_TIMEOUT  = 0x00000102;
+    static constexpr uint32_t WAIT_FAILED   = 0xFFFFFFFF;
+    static constexpr uint32_t INFINITE      = 0xFFFFFFFF;
+
+private:
+    static constexpr uint32_t SLOT_COUNT      = 64;   // 同時に並べる待ちの数
+    static constexpr uint32_t INIT_TIMEOUT_MS = 5000; // 作成者が大きさを決め, 初期化するのを待つ上限
+
+    enum SLOT_STATE : uint32_t { SLOT_FREE, SLOT_WAITING, SLOT_ABANDONED };
+
+    struct METSECT_WAIT_SLOT
+    {
+        std::atomic<uint32_t> lWakeCount; // Bumped to wake the waiter (futex word)
+        int32_t               lRequest;   // Requested resource count
+        uint32_t              lState;     // SLOT_STATE
+    };
+
+    struct METSECT_SHARED_INFO
+    {
+        std::atomic<uint32_t> fInitialized;    // Is the metered section initialized?
+        std::atomic<uint32_t> lAvailableCount; // Available resource count
+        std::atomic<uint32_t> lThreadsWaiting; // Count of threads waiting (queued)
+        std::atomic<uint32_t> lQueueLock;      // Guards the wait queue (futex word)
+        int32_t               lMaximumCount;   // Maximum resource count
+        uint32_t              lNextTicket;     // Ticket for the next waiter
+        uint32_t              lServingTicket;  // Ticket of the waiter at the head
+        METSECT_WAIT_SLOT     aSlots[SLOT_COUNT];
+    };
+
+    struct METERED_SECTION
+    {
+        int                  hFileMap;  // File descriptor of the shared memory object
+        METSECT_SHARED_INFO* lpSharedInfo;
+    };
+
+private:
+    METERED_SECTION m_met_sect { -1, nullptr };
+
+public:
+    MeteredSection() noexcept = default;
+
+    MeteredSection(const MeteredSection&) = delete;
+    MeteredSection& operator =(const MeteredSection&) = delete;
+
+    MeteredSection(MeteredSection&& rhs) noexcept { std::swap(m_met_sect, rhs.m_met_sect); }
+    MeteredSection& operator =(MeteredSection&& rhs) noexcept { std::swap(m_met_sect, rhs.m_met_sect); return *this; }
+
+    ~MeteredSection() { Close(); }
+
+public:
+    bool    initialized    () const noexcept { return m_met_sect.lpSharedInfo ? m_met_sect.lpSharedInfo->fInitialized.load(std::memory_order_acquire) != 0 : false; }
+    int32_t threads_waiting() const noexcept { return m_met_sect.lpSharedInfo ? int32_t(m_met_sect.lpSharedInfo->lThreadsWaiting.load(std::memory_order_relaxed)) : 0; }
+    int32_t available_count() const noexcept { return m_met_sect.lpSharedInfo ? int32_t(m_met_sect.lpSharedInfo->lAvailableCount.load(std::memory_order_relaxed)) : 0; }
+    int32_t maximum_count  () const noexcept { return m_met_sect.lpSharedInfo ? m_met_sect.lpSharedInfo->lMaximumCount : 0; }
+
+public:
+    bool Create(int32_t lInitialCount, int32_t lMaximumCount, const char* lpName);
+    bool Open(const char* lpName);
+
+    uint32_t Enter(uint32_t dwMilliseconds);
+    uint32_t Enter(int32_t lCount, uint32_t dwMilliseconds);
+    bool     TryEnter(int32_t lCount = 1);
+    bool     Leave(int32_t lReleaseCount, int32_t* lpPreviousCount = nullptr);
+    void     Close();
+
+    static bool Unlink(const char* lpName);
+
+private:
+    bool Initialize    (int32_t lInitialCount, int32_t lMaximumCount, const char* lpName, bool bOpenOnly);
+    bool CreateFileView(int32_t lInitialCount, int32_t lMaximumCount, const char* lpName, bool bOpenOnly);
+
+    bool TryAcquire(int32_t lCount) noexcept;
+    void Dequeue(uint32_t ticket) noexcept;
+    void WakeHead() noexcept;
+
+    void GetLock    () noexcept;
+    void ReleaseLock() noexcept;
+
+    static bool MakeName(char (&sz)[MAX_METSECT_NAMELEN + 32], const char* lpName) noexcept;
+
+    static bool FutexWait(std::atomic<uint32_t>& word, uint32_t expected, int64_t timeout_ns) noexcept;
+    static void FutexWake(std::atomic<uint32_t>& word, int32_t count) noexcept;
+};
+
+//---------------------------------------------------------------------------//
+//
+// Interface functions
+//
+//---------------------------------------------------------------------------//
+
+inline bool MeteredSection::Create
+(
+    int32_t     lInitialCount,
+    int32_t     lMaximumCount,
+    const char* lpName
+)
+{
+    // Verify the parameters
+    if ( (lMaximumCount < 1)             ||
+         (lInitialCount > lMaximumCount) ||
+         (lInitialCount < 0)             ||
+         ((lpName) && (std::strlen(lpName) > MAX_METSECT_NAMELEN)) )
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    // Initialize it
+    if ( ! Initialize(lInitialCount, lMaximumCount, lpName, false) )
+    {
+        // Metered section failed to initialize
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+
+inline bool MeteredSection::Open
+(
+    const char* lpName
+)
+{
+    if ( lpName == nullptr ) { return false; }
+
+    if ( ! Initialize(0, 0, lpName, true) )
+    {
+        // Metered section failed to initialize
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+
+inline uint32_t MeteredSection::Enter
+(
+    uint32_t dwMilliseconds
+)
+{
+    return Enter(1, dwMilliseconds);
+}
+
+//---------------------------------------------------------------------------//
+
+// lCount 個をまとめて確保する. 待つ場合は到着順に並ぶ
+inline uint32_t MeteredSection::Enter
+(
+    int32_t  lCount,
+    uint32_t dwMilliseconds
+)
+{
+    if ( ! initialized() )
+    {
+        errno = EINVAL;
+        return WAIT_FAILED;
+    }
+
+    auto info = m_met_sect.lpSharedInfo;
+    if ( lCount < 1 || lCount > info->lMaximumCount )
+    {
+        errno = EINVAL;
+        return WAIT_FAILED;
+    }
+
+    // 誰も並んでおらず空きがあれば CAS 一回
+    if ( info->lThreadsWaiting.load(std::memory_order_seq_cst) == 0 && TryAcquire(lCount) )
+    {
+        return WAIT_OBJECT_0;
+    }
+    if ( dwMilliseconds == 0 )
+    {
+        return WAIT_TIMEOUT;
+    }
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(dwMilliseconds);
+    const auto remaining_ns = [&]() -> int64_t
+    {
+        if ( dwMilliseconds == INFINITE ) { return -1; }
+
+        const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>
+        (
+            deadline - std::chrono::steady_clock::now()
+        ).count();
+        return ns > 0 ? ns : 0;
+    };
+
+    // 列に並ぶ. 席が埋まっていれば空くまで待つ
+    GetLock();
+    for ( ; ; )
+    {
+        if ( info->lThreadsWaiting.load(std::memory_order_relaxed) == 0 && TryAcquire(lCount) )
+        {
+            ReleaseLock();
+            return WAIT_OBJECT_0;
+        }
+        if ( info->lNextTicket - info->lServingTicket < SLOT_COUNT )
+        {
+            break;
+        }
+
+        ReleaseLock();
+        if ( remaining_ns() == 0 )
+        {
+            return WAIT_TIMEOUT;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        GetLock();
+    }
+
+    const auto ticket = info->lNextTicket++;
+    auto& slot = info->aSlots[ticket % SLOT_COUNT];
+    slot.lRequest = lCount;
+    slot.lState   = SLOT_WAITING;
+
+    // 待ち人数を先に公開する (Leave は空きを戻してから待ち人数を見る)
+    info->lThreadsWaiting.fetch_add(1, std::memory_order_seq_cst);
+    ReleaseLock();
+
+    for ( ; ; )
+    {
+        const auto wake = slot.lWakeCount.load(std::memory_order_acquire);
+
+        GetLock();
+        if ( info->lServingTicket == ticket && TryAcquire(lCount) )
+        {
+            Dequeue(ticket);
+            ReleaseLock();
+            return WAIT_OBJECT_0;
+        }
+
+        const auto timeout_ns = remaining_ns();
+        if ( timeout_ns == 0 )
+        {
+            Dequeue(ticket);
+            ReleaseLock();
+            return WAIT_TIMEOUT;
+        }
+        ReleaseLock();
+
+        // 先頭になって要求数が満たせるようになると起こされる
+        FutexWait(slot.lWakeCount, wake, timeout_ns);
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// 待たずに lCount 個をまとめて確保する. 並んでいる者がいれば追い越さない
+inline bool MeteredSection::TryEnter
+(
+    int32_t lCount
+)
+{
+    return Enter(lCount, 0) == WAIT_OBJECT_0;
+}
+
+//---------------------------------------------------------------------------//
+
+inline bool MeteredSection::Leave
+(
+    int32_t  lReleaseCount,
+    int32_t* lpPreviousCount
+)
+{
+    if ( ! initialized() )
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    auto info = m_met_sect.lpSharedInfo;
+
+    auto count = info->lAvailableCount.load(std::memory_order_relaxed);
+    do
+    {
+        if ( (lReleaseCount < 0) ||
+             (int64_t(count) + lReleaseCount > info->lMaximumCount) )
+        {
+            errno = EINVAL;
+            return false;
+        }
+    }
+    while ( ! info->lAvailableCount.compare_exchange_weak
+    (
+        count, count + uint32_t(lReleaseCount), std::memory_order_seq_cst, std::memory_order_relaxed
+    ) );
+
+    // Save the old value if they want it
+    if ( lpPreviousCount )
+    {
+        *lpPreviousCount = int32_t(count);
+    }
+
+    // 待っている者がいるときだけ列を見て, 先頭の要求数が満たせれば起こす
+    if ( lReleaseCount > 0 && info->lThreadsWaiting.load(std::memory_order_seq_cst) > 0 )
+    {
+        GetLock();
+        WakeHead();
+        ReleaseLock();
+    }
+
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+
+inline void MeteredSection::Close()
+{
+    // Clean up
+    if ( m_met_sect.lpSharedInfo )
+    {
+        ::munmap(m_met_sect.lpSharedInfo, sizeof(METSECT_SHARED_INFO));
+        m_met_sect.lpSharedInfo = nullptr;
+    }
+    if ( m_met_sect.hFileMap >= 0 )
+    {
+        ::close(m_met_sect.hFileMap);
+        m_met_sect.hFileMap = -1;
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// 名前付きの共有メモリを削除する. 開いている者はそのまま使い続けられる
+inline bool MeteredSection::Unlink
+(
+    const char* lpName
+)
+{
+    char sz [MAX_METSECT_NAMELEN + 32];
+    if ( ! MakeName(sz, lpName) )
+    {
+        return false;
+    }
+
+    return ::shm_unlink(sz) == 0;
+}
+
+//---------------------------------------------------------------------------//
+
+inline bool MeteredSection::Initialize
+(
+    int32_t     lInitialCount,
+    int32_t     lMaximumCount,
+    const char* lpName,
+    bool        bOpenOnly
+)
+{
+    if ( initialized() )
+    {
+        return false; // Already initialized
+    }
+
+    m_met_sect.hFileMap     = -1;
+    m_met_sect.lpSharedInfo = nullptr;
+
+    // Error occured, return false so the caller knows to clean up
+    return CreateFileView(lInitialCount, lMaximumCount, lpName, bOpenOnly);
+}
+
+//---------------------------------------------------------------------------//
+
+inline bool MeteredSection::CreateFileView
+(
+    int32_t     lInitialCount,
+    int32_t     lMaximumCount,
+    const char* lpName,
+    bool        bOpenOnly
+)
+{
+    constexpr auto size = sizeof(METSECT_SHARED_INFO);
+
+    // 作成者が途中で死んだり失敗したりしても, 開く側が待ち続けないようにする
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(INIT_TIMEOUT_MS);
+
+    bool bCreated { false };
+
+    char sz [MAX_METSECT_NAMELEN + 32];
+    if ( lpName )
+    {
+        if ( ! MakeName(sz, lpName) )
+        {
+            return false;
+        }
+
+        if ( ! bOpenOnly )
+        {
+            // Create a named shared memory object
+            m_met_sect.hFileMap = ::shm_open(sz, O_RDWR | O_CREAT | O_EXCL, 0666);
+            if ( m_met_sect.hFileMap >= 0 )
+            {
+                bCreated = true;
+                if ( ::ftruncate(m_met_sect.hFileMap, off_t(size)) != 0 )
+                {
+                    ::shm_unlink(sz);
+                    return false;
+                }
+            }
+            else if ( errno != EEXIST )
+            {
+                return false;
+            }
+        }
+
+        if ( ! bCreated )
+        {
+            m_met_sect.hFileMap = ::shm_open(sz, O_RDWR, 0);
+            if ( m_met_sect.hFileMap < 0 )
+            {
+                return false;
+            }
+
+            // Already exists; wait for the creator to size it
+            struct stat st;
+            for ( ; ; )
+            {
+                if ( ::fstat(m_met_sect.hFileMap, &st) != 0 )
+                {
+                    return false;
+                }
+                if ( size_t(st.st_size) >= size )
+                {
+                    break;
+                }
+                if ( std::chrono::steady_clock::now() >= deadline )
+                {
+                    errno = ETIMEDOUT;
+                    return false;
+                }
+                std::this_thread::yield();
+            }
+        }
+
+        m_met_sect.lpSharedInfo = static_cast<METSECT_SHARED_INFO*>(::mmap
+        (
+            nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_met_sect.hFileMap, 0
+        ));
+    }
+    else
+    {
+        // Create an unnamed mapping (shared with child processes after fork)
+        bCreated = true;
+        m_met_sect.lpSharedInfo = static_cast<METSECT_SHARED_INFO*>(::mmap
+        (
+            nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0
+        ));
+    }
+
+    if ( m_met_sect.lpSharedInfo == MAP_FAILED )
+    {
+        m_met_sect.lpSharedInfo = nullptr;
+
+        // 作りかけの名前は残さない (開いてしまった側は初期化を待って時間切れになる)
+        if ( bCreated && lpName )
+        {
+            ::shm_unlink(sz);
+        }
+        return false;
+    }
+
+    auto info = m_met_sect.lpSharedInfo;
+    if ( bCreated )
+    {
+        // 新しい共有メモリは 0 で埋まっている
+        info->lThreadsWaiting.store(0, std::memory_order_relaxed);
+        info->lQueueLock     .store(0, std::memory_order_relaxed);
+        info->lAvailableCount.store(uint32_t(lInitialCount), std::memory_order_relaxed);
+        info->lMaximumCount  = lMaximumCount;
+        info->lNextTicket    = 0;
+        info->lServingTicket = 0;
+        for ( auto& slot : info->aSlots )
+        {
+            slot.lWakeCount.store(0, std::memory_order_relaxed);
+            slot.lRequest = 0;
+            slot.lState   = SLOT_FREE;
+        }
+        info->fInitialized.store(1, std::memory_order_release);
+    }
+    else
+    {
+        // Already exists; wait for it to be initialized by the creator
+        while ( ! info->fInitialized.load(std::memory_order_acquire) )
+        {
+            if ( std::chrono::steady_clock::now() >= deadline )
+            {
+                errno = ETIMEDOUT;
+                return false;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+
+inline bool MeteredSection::TryAcquire(int32_t lCount) noexcept
+{
+    auto& available = m_met_sect.lpSharedInfo->lAvailableCount;
+
+    auto count = available.load(std::memory_order_relaxed);
+    while ( count >= uint32_t(lCount) )
+    {
+        if ( available.compare_exchange_weak(count, count - uint32_t(lCount), std::memory_order_seq_cst, std::memory_order_relaxed) )
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+
+// 列から抜ける (要ロック). 先頭なら次へ進め, 途中なら席を放棄済みにしておく
+inline void MeteredSection::Dequeue(uint32_t ticket) noexcept
+{
+    auto info = m_met_sect.lpSharedInfo;
+
+    info->lThreadsWaiting.fetch_sub(1, std::memory_order_relaxed);
+
+    if ( info->lServingTicket != ticket )
+    {
+        info->aSlots[ticket % SLOT_COUNT].lState = SLOT_ABANDONED;
+        return;
+    }
+
+    info->aSlots[ticket % SLOT_COUNT].lState = SLOT_FREE;
+    ++info->lServingTicket;
+
+    // 時間切れで抜けた者の席は飛ばす
+    while ( info->lServingTicket != info->lNextTicket )
+    {
+        auto& slot = info->aSlots[info->lServingTicket % SLOT_COUNT];
+        if ( slot.lState != SLOT_ABANDONED )
+        {
+            break;
+        }
+        slot.lState = SLOT_FREE;
+        ++info->lServingTicket;
+    }
+
+    // 残りで次の先頭が満たせるなら続けて起こす
+    WakeHead();
+}
+
+//---------------------------------------------------------------------------//
+
+// 先頭の要求数が満たせるなら先頭だけを起こす (要ロック)
+inline void MeteredSection::WakeHead() noexcept
+{
+    auto info = m_met_sect.lpSharedInfo;
+    if ( info->lServingTicket == info->lNextTicket )
+    {
+        return;
+    }
+
+    auto& slot = info->aSlots[info->lServingTicket % SLOT_COUNT];
+    if ( info->lAvailableCount.load(std::memory_order_seq_cst) >= uint32_t(slot.lRequest) )
+    {
+        slot.lWakeCount.fetch_add(1, std::memory_order_release);
+        FutexWake(slot.lWakeCount, 1);
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// 待ち行列のロック. 0: 空き, 1: 保持, 2: 保持かつ待ちあり
+inline void MeteredSection::GetLock() noexcept
+{
+    auto& lock = m_met_sect.lpSharedInfo->lQueueLock;
+
+    uint32_t state { 0 };
+    if ( lock.compare_exchange_strong(state, 1, std::memory_order_acquire) )
+    {
+        return;
+    }
+
+    if ( state != 2 )
+    {
+        state = lock.exchange(2, std::memory_order_acquire);
+    }
+    while ( state != 0 )
+    {
+        FutexWait(lock, 2, -1);
+        state = lock.exchange(2, std::memory_order_acquire);
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+inline void MeteredSection::ReleaseLock() noexcept
+{
+    auto& lock = m_met_sect.lpSharedInfo->lQueueLock;
+
+    if ( lock.exchange(0, std::memory_order_release) == 2 )
+    {
+        FutexWake(lock, 1);
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+inline bool MeteredSection::MakeName
+(
+    char (&sz)[MAX_METSECT_NAMELEN + 32], const char* lpName
+)
+noexcept
+{
+    if ( lpName == nullptr || std::strlen(lpName) > MAX_METSECT_NAMELEN || std::strchr(lpName, '/') )
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    std::snprintf(sz, sizeof(sz), "/DKC_MSECT_MMF_%s", lpName);
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+
+// 値が expected のままなら眠る. timeout_ns < 0 なら無期限. 時間切れなら false
+inline bool MeteredSection::FutexWait
+(
+    std::atomic<uint32_t>& word, uint32_t expected, int64_t timeout_ns
+)
+noexcept
+{
+  #if defined(__linux__)
+    struct timespec ts;
+    ts.tv_sec  = time_t(timeout_ns / 1000000000);
+    ts.tv_nsec = long  (timeout_ns % 1000000000);
+
+    // プロセスをまたぐので FUTEX_PRIVATE_FLAG は付けない
+    const auto result = ::syscall
+    (
+        SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT,
+        expected, timeout_ns < 0 ? nullptr : &ts, nullptr, 0
+    );
+    return result == 0 || errno != ETIMEDOUT;
+  #else
+    // futex のない環境では短く眠って見直す
+    (void)word; (void)expected;
+    const int64_t nap_ns = 200000;
+    const auto nap = timeout_ns < 0 || timeout_ns > nap_ns ? nap_ns : timeout_ns;
+    std::this_thread::sleep_for(std::chrono::nanoseconds(nap));
+    return nap == nap_ns;
+  #endif
+}
+
+//---------------------------------------------------------------------------//
+
+inline void MeteredSection::FutexWake
+(
+    std::atomic<uint32_t>& word, int32_t count
+)
+noexcept
+{
+  #if defined(__linux__)
+    ::syscall
+    (
+        SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE,
+        count, nullptr, nullptr, 0
+    );
+  #else
+    (void)word; (void)count;
+  #endif
+}
+
+#endif
+
+//---------------------------------------------------------------------------//
+
 // MeteredSection.hpp
\ No newline at end of file
@@ -0,0 +1,297 @@
+﻿#pragma once
+
+//---------------------------------------------------------------------------//
+//
+// Parallel.hpp
+//  ThreadPool 上の並列アルゴリズム
+//   Copyright (C) 2017 tapetums
+//
+//  呼び出し元のスレッドも処理に加わり, 終わりを待つ間は他のタスクを手伝う
+//  そのため, タスクの中から呼び出しても (入れ子にしても) デッドロックしない
+//
+//---------------------------------------------------------------------------//
+
+#include <cstddef>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "Task.hpp"
+
+//---------------------------------------------------------------------------//
+// Forward Declarations
+//---------------------------------------------------------------------------//
+
+namespace tapetums
+{
+    template<typename Index, typename F>
+    void parallel_for
+    (
+        ThreadPool& pool, Index begin, Index end, Index grain, F&& fn
+    );
+
+    template<typename Index, typename T, typename Map, typename Reduce>
+    T parallel_reduce
+    (
+        ThreadPool& pool, Index begin, Index end, Index grain,
+        T identity, Map&& map, Reduce&& reduce
+    );
+
+    template<typename RandomIt, typename Compare = std::less<>>
+    void parallel_sort
+    (
+        ThreadPool& pool, RandomIt first, RandomIt last,
+        Compare comp = Compare(), size_t grain = 2048
+    );
+
+    namespace detail
+    {
+        template<typename Left, typename Right>
+        void fork_join(ThreadPool& pool, Left&& left, Right&& right);
+    }
+}
+
+//---------------------------------------------------------------------------//
+// Fork-Join
+//  right をタスクとして積み, left をその場で実行してから right の完了を待つ
+//  ワーカー上なら right は自分のキューの末尾にあるので, 盗まれていなければ自分で拾う
+//---------------------------------------------------------------------------//
+
+template<typename Left, typename Right>
+inline void tapetums::detail::fork_join
+(
+    ThreadPool& pool, Left&& left, Right&& right
+)
+{
+    TaskGroup group(pool);
+    group.AddTask([&](TaskWorker&) { right(); });
+
+    // left が例外を投げても, right が終わるまでは TaskGroup の破棄で待たされる
+    left();
+
+    // right が Stop() で実行されずに捨てられたら future_error (broken_promise) になる
+    group.Wait();
+}
+
+//---------------------------------------------------------------------------//
+// parallel_for
+//  [begin, end) の各 i について fn(i) を呼ぶ
+//  範囲を grain 以下になるまで再帰的に二分し, 後半をワークスティーリングに委ねる
+//---------------------------------------------------------------------------//
+
+namespace tapetums { namespace detail {
+
+template<typename Index, typename F>
+inline void for_range
+(
+    ThreadPool& pool, Index begin, Index end, Index grain, F& fn
+)
+{
+    if ( end - begin <= grain )
+    {
+        for ( auto i = begin; i < end; ++i )
+        {
+            fn(i);
+        }
+        return;
+    }
+
+    const auto mid = begin + (end - begin) / 2;
+    fork_join
+    (
+        pool,
+        [&]() { for_range(pool, begin, mid, grain, fn); },
+        [&]() { for_range(pool, mid,   end, grain, fn); }
+    );
+}
+
+} } // namespace tapetums::detail
+
+//---------------------------------------------------------------------------//
+
+template<typename Index, typename F>
+inline void tapetums::parallel_for
+(
+    ThreadPool& pool, Index begin, Index end, Index grain, F&& fn
+)
+{
+    static_assert(std::is_integral<Index>::value, "Index must be an integral type");
+
+    if ( begin >= end ) { return; }
+    if ( grain < 1 )    { grain = 1; }
+
+    detail::for_range(pool, begin, end, grain, fn);
+}
+
+//---------------------------------------------------------------------------//
+// parallel_reduce
+//  reduce(... reduce(reduce(identity, map(begin)), map(begin + 1)) ..., map(end - 1))
+//  grain 個ずつの部分和を並列に求め, 最後に添字の順で畳み込む
+//  (畳み込みの順序は実行ごとに変わらないので, 浮動小数点でも結果は再現する)
+//---------------------------------------------------------------------------//
+
+template<typename Index, typename T, typename Map, typename Reduce>
+inline T tapetums::parallel_reduce
+(
+    ThreadPool& pool, Index begin, Index end, Index grain,
+    T identity, Map&& map, Reduce&& reduce
+)
+{
+    static_assert(std::is_integral<Index>::value, "Index must be an integral type");
+
+    if ( begin >= end ) { return identity; }
+    if ( grain < 1 )    { grain = 1; }
+
+    const auto count  = static_cast<size_t>(end - begin);
+    const auto chunks = (count + grain - 1) / static_cast<size_t>(grain);
+
+    std::vector<T> partials(chunks, identity);
+
+    parallel_for(pool, size_t(0), chunks, size_t(1), [&](size_t chunk)
+    {
+        const auto first = begin + static_cast<Index>(chunk * grain);
+        const auto last  = (end - first > grain) ? first + grain : end;
+
+        T acc = identity;
+        for ( auto i = first; i < last; ++i )
+        {
+            acc = reduce(std::move(acc), map(i));
+        }
+        partials[chunk] = std::move(acc);
+    });
+
+    T result = std::move(identity);
+    for ( auto& partial : partials )
+    {
+        result = reduce(std::move(result), std::move(partial));
+    }
+
+    return result;
+}
+
+//---------------------------------------------------------------------------//
+// parallel_sort
+//  並列マージソート (安定ではない)
+//  作業用に要素数分のバッファを確保し, 元の範囲とバッファを交互に使う
+//  (要素はデフォルト構築とムーブ代入ができること)
+//---------------------------------------------------------------------------//
+
+namespace tapetums { namespace detail {
+
+// [x1, x2) と [y1, y2) をマージして out へムーブする
+template<typename It, typename Out, typename Compare>
+inline void parallel_merge
+(
+    ThreadPool& pool, It x1, It x2, It y1, It y2, Out out,
+    Compare& comp, size_t grain
+)
+{
+    auto n1 = static_cast<size_t>(x2 - x1);
+    auto n2 = static_cast<size_t>(y2 - y1);
+
+    if ( n1 + n2 <= grain )
+    {
+        std::merge
+        (
+            std::make_move_iterator(x1), std::make_move_iterator(x2),
+            std::make_move_iterator(y1), std::make_move_iterator(y2),
+            out, comp
+        );
+        return;
+    }
+
+    // 長い方の中央で分割する
+    if ( n1 < n2 )
+    {
+        std::swap(x1, y1);
+        std::swap(x2, y2);
+        std::swap(n1, n2);
+    }
+
+    const auto xm = x1 + n1 / 2;
+    const auto ym = std::lower_bound(y1, y2, *xm, comp);
+    const auto om = out + (xm - x1) + (ym - y1);
+
+    *om = std::move(*xm);
+
+    fork_join
+    (
+        pool,
+        [&]() { parallel_merge(pool, x1, xm, y1, ym, out, comp, grain); },
+        [&]() { parallel_merge(pool, xm + 1, x2, ym, y2, om + 1, comp, grain); }
+    );
+}
+
+//---------------------------------------------------------------------------//
+
+// a[0, n) を整列する. 結果は into_a なら a に, そうでなければ b に置く
+template<typename RandomIt, typename T, typename Compare>
+inline void sort_range
+(
+    ThreadPool& pool, RandomIt a, T* b, size_t n, bool into_a,
+    Compare& comp, size_t grain
+)
+{
+    if ( n <= grain )
+    {
+        std::sort(a, a + n, comp);
+        if ( ! into_a )
+        {
+            std::move(a, a + n, b);
+        }
+        return;
+    }
+
+    // 半分ずつを逆側に整列してから, こちら側にマージする
+    const auto half = n / 2;
+    fork_join
+    (
+        pool,
+        [&]() { sort_range(pool, a,        b,        half,     ! into_a, comp, grain); },
+        [&]() { sort_range(pool, a + half, b + half, n - half, ! into_a, comp, grain); }
+    );
+
+    if ( into_a )
+    {
+        parallel_merge(pool, b, b + half, b + half, b + n, a, comp, grain);
+    }
+    else
+    {
+        parallel_merge(pool, a, a + half, a + half, a + n, b, comp, grain);
+    }
+}
+
+} } // namespace tapetums::detail
+
+//---------------------------------------------------------------------------//
+
+template<typename RandomIt, typename Compare>
+inline void tapetums::parallel_sort
+(
+    ThreadPool& pool, RandomIt first, RandomIt last, Compare comp, size_t grain
+)
+{
+    using T = typename std::iterator_traits<RandomIt>::value_type;
+
+    const auto n = static_cast<size_t>(last - first);
+    if ( grain < 2 ) { grain = 2; }
+
+    if ( n <= grain )
+    {
+        std::sort(first, last, comp);
+        return;
+    }
+
+    std::unique_ptr<T[]> buffer(new T[n]);
+    detail::sort_range(pool, first, buffer.get(), n, true, comp, grain);
+}
+
+//---------------------------------------------------------------------------//
+
+// Parallel.hpp
\ No newline at end of file
@@ -1,19 +1,40 @@
 ﻿#pragma once
 
 //---------------------------------------------------------------------------//
-// 
+//
 // Task.hpp
 // タスク処理用スレッドプールクラス
 //   Copyright (C) 2013-2017 tapetums
 //
 //---------------------------------------------------------------------------//
 
-#include <functional>
-#include <deque>
+#include <cstddef>
+#include <cstdint>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <future>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
-#include "Lock.hpp"
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+  #include <immintrin.h>
+#elif defined(_M_ARM) || defined(_M_ARM64)
+  #include <intrin.h>
+#endif
+
+#include "TimerWheel.hpp"
+#include "Topology.hpp"
+#include "WorkStealingDeque.hpp"
 
 //---------------------------------------------------------------------------//
 // Forward Declarations
@@ -23,411 +44,3889 @@ namespace tapetums
 {
     class ThreadPool;
     class TaskWorker;
+    class TaskGroup;
+    class TimerHandle;
+
+    struct ThreadPoolConfig;
+    struct LatencyHistogram;
+    struct TaskWorkerStats;
+    struct ThreadPoolStats;
+
+    enum class PRIORITY : uint32_t;
 
-    using Task = std::function<void (TaskWorker&)>;
-    static constexpr Task task_null;
+    template<typename Signature> class unique_task;
+    template<typename R> class future;
+
+    using Task = unique_task<void (TaskWorker&)>;
+
+    namespace detail
+    {
+        struct TaskNode;
+        struct TimerNode;
+        class  TimerFire;
+        class  NodeCache;
+        template<typename Handle> class ResumeTask;
+        template<typename F> class GroupTask;
+        class  Parker;
+        class  Slab;
+        struct WaitBucket;
+        struct WorkerCounters;
+        struct CoroutineBridge;
+
+        class FutureStateBase;
+        template<typename R> class FutureState;
+        template<typename R> class Promise;
+
+        // std::result_of は C++17 で非推奨になったので自前で用意する
+        template<typename F, typename... Args>
+        using result_t = decltype(std::declval<typename std::decay<F>::type&>()(std::declval<Args>()...));
+
+        inline TaskNode* new_node   (Task&& task);
+        inline void      delete_node(TaskNode* node) noexcept;
+
+        inline TaskWorker*& current_worker() noexcept;
+        inline void cpu_relax() noexcept;
+        inline int64_t now_ns() noexcept;
+
+        template<typename Pred>
+        void help_until(ThreadPool& pool, Pred&& pred);
+        inline WaitBucket& wait_bucket(const void* p) noexcept;
+    }
 }
 
 //---------------------------------------------------------------------------//
-// ThreadPool Class
+// PRIORITY
+//  ワーカーは優先度の高いレーンから順にタスクを取り出す
 //---------------------------------------------------------------------------//
 
-class tapetums::ThreadPool final
+enum class tapetums::PRIORITY : uint32_t
+{
+    REALTIME   = 0,
+    NORMAL     = 1,
+    BACKGROUND = 2,
+};
+
+//---------------------------------------------------------------------------//
+// ThreadPoolConfig
+//  タスクが見つからないワーカーは
+//  spin_count 回 (pause しながら) → yield_count 回 (yield しながら) 探し直してから眠る
+//  期限付きタスクは期限まで deadline_window を切ると REALTIME の次に繰り上がる
+//  pin_threads が真なら, ワーカーを CpuTopology::PlacementOrder() の順に論理プロセッサへ固定する
+//  min_workers を 1 以上にすると伸縮するプールになる (コンストラクタのワーカー数が最大数)
+//   キューに spawn_backlog 個を超えて溜まり, 空いているワーカーがいなければ増やし,
+//   idle_timeout の間仕事のなかったワーカーは min_workers まで減らす
+//  max_blocking は BlockingRegion の間だけ動かす補充用ワーカーの枠の数
+//  AddTaskAfter / AddTaskEvery の時刻は 1 ミリ秒単位 (TIMER_RESOLUTION) に切り上げる
+//---------------------------------------------------------------------------//
+
+struct tapetums::ThreadPoolConfig
+{
+    uint32_t spin_count  { 64 };
+    uint32_t yield_count { 4 };
+
+    std::chrono::microseconds deadline_window { 2000 };
+
+    bool pin_threads { false };
+
+    uint32_t min_workers   { 0 };
+    uint32_t spawn_backlog { 64 };
+
+    std::chrono::milliseconds idle_timeout { 5000 };
+
+    uint32_t max_blocking { 4 };
+};
+
+//---------------------------------------------------------------------------//
+// LatencyHistogram
+//  buckets[i] は [2^i, 2^(i+1)) ナノ秒に入った回数 (buckets[0] は 2 ナノ秒未満)
+//  TASK_LATENCY を定義したときだけ計測する
+//---------------------------------------------------------------------------//
+
+struct tapetums::LatencyHistogram
+{
+    static constexpr size_t BUCKET_COUNT { 40 };
+
+    uint64_t buckets[BUCKET_COUNT] { };
+
+    static size_t bucket_of(uint64_t ns) noexcept;
+
+    uint64_t count     () const noexcept;
+    uint64_t percentile(double p) const noexcept;
+
+    LatencyHistogram& operator +=(const LatencyHistogram& rhs) noexcept;
+};
+
+//---------------------------------------------------------------------------//
+// TaskWorkerStats / ThreadPoolStats
+//  ThreadPool::Snapshot() で取り出す統計値
+//  ワーカーが動いている間に読むので, 値同士が厳密に揃っている保証はない
+//---------------------------------------------------------------------------//
+
+struct tapetums::TaskWorkerStats
+{
+    uint64_t executed      { 0 }; // 実行したタスク
+    uint64_t stolen        { 0 }; // 他のワーカーから盗んだタスク
+    uint64_t failed_steals { 0 }; // 全ての相手を回っても盗めなかった回数
+    uint64_t idle_ns       { 0 }; // 眠っていた時間
+    uint64_t parks         { 0 }; // 眠った回数
+    uint64_t wakes         { 0 }; // 他のスレッドに起こされた回数
+    uint64_t high_water    { 0 }; // ひとつのレーンの両端キューに溜まったタスク数の最大値
+
+    LatencyHistogram wait_latency; // 投入から実行開始まで
+    LatencyHistogram run_latency;  // 実行時間
+
+    TaskWorkerStats& operator +=(const TaskWorkerStats& rhs) noexcept;
+};
+
+//---------------------------------------------------------------------------//
+
+struct tapetums::ThreadPoolStats
+{
+    TaskWorkerStats total;
+    std::vector<TaskWorkerStats> workers;
+};
+
+//---------------------------------------------------------------------------//
+// unique_task
+//  ムーブのみ可能な関数オブジェクト
+//  小さな関数オブジェクト (INLINE_SIZE バイト以下) はヒープを使わずに内部に保持する
+//---------------------------------------------------------------------------//
+
+template<typename R, typename... Args>
+class tapetums::unique_task<R (Args...)> final
 {
 public:
-    static constexpr uint32_t MAX_THREADS_PER_PROCESSOR { 500 };
+    static constexpr size_t INLINE_SIZE  { 64 - sizeof(void*) };
+    static constexpr size_t INLINE_ALIGN { alignof(void*) };
+
+private:
+    struct VTable
+    {
+        R    (*invoke) (void* p, Args&&... args);
+        void (*move)   (void* dst, void* src) noexcept;
+        void (*destroy)(void* p) noexcept;
+    };
+
+    // 内部に保持する場合
+    template<typename F>
+    struct InlineOps
+    {
+        static R invoke(void* p, Args&&... args)
+        {
+            return (*static_cast<F*>(p))(std::forward<Args>(args)...);
+        }
+
+        static void move(void* dst, void* src) noexcept
+        {
+            new (dst) F(std::move(*static_cast<F*>(src)));
+            static_cast<F*>(src)->~F();
+        }
+
+        static void destroy(void* p) noexcept
+        {
+            static_cast<F*>(p)->~F();
+        }
+
+        static constexpr VTable vtable { invoke, move, destroy };
+    };
+
+    // ヒープに置く場合
+    template<typename F>
+    struct HeapOps
+    {
+        static R invoke(void* p, Args&&... args)
+        {
+            return (**static_cast<F**>(p))(std::forward<Args>(args)...);
+        }
+
+        static void move(void* dst, void* src) noexcept
+        {
+            *static_cast<F**>(dst) = *static_cast<F**>(src);
+        }
+
+        static void destroy(void* p) noexcept
+        {
+            delete *static_cast<F**>(p);
+        }
+
+        static constexpr VTable vtable { invoke, move, destroy };
+    };
+
+    template<typename F>
+    using fits_inline = std::integral_constant
+    <
+        bool,
+        sizeof(F)  <= INLINE_SIZE  &&
+        alignof(F) <= INLINE_ALIGN &&
+        std::is_nothrow_move_constructible<F>::value
+    >;
+
+private:
+    const VTable* m_vtable { nullptr };
+    typename std::aligned_storage<INLINE_SIZE, INLINE_ALIGN>::type m_storage;
+
+public:
+    unique_task() noexcept { }
+    unique_task(std::nullptr_t) noexcept { }
+
+    template
+    <
+        typename F,
+        typename = typename std::enable_if
+        <
+            ! std::is_same<typename std::decay<F>::type, unique_task>::value
+        >::type
+    >
+    unique_task(F&& f)
+    {
+        init<typename std::decay<F>::type>(std::forward<F>(f), fits_inline<typename std::decay<F>::type>());
+    }
+
+    unique_task(const unique_task&)             = delete;
+    unique_task& operator =(const unique_task&) = delete;
+
+    unique_task(unique_task&& rhs) noexcept { take(rhs); }
+    unique_task& operator =(unique_task&& rhs) noexcept
+    {
+        if ( this != &rhs )
+        {
+            reset();
+            take(rhs);
+        }
+        return *this;
+    }
+
+    ~unique_task() { reset(); }
+
+public:
+    explicit operator bool() const noexcept { return m_vtable != nullptr; }
+
+    R operator ()(Args... args)
+    {
+        return m_vtable->invoke(&m_storage, std::forward<Args>(args)...);
+    }
+
+    void reset() noexcept
+    {
+        if ( m_vtable )
+        {
+            m_vtable->destroy(&m_storage);
+            m_vtable = nullptr;
+        }
+    }
+
+private:
+    template<typename F, typename G>
+    void init(G&& g, std::true_type)
+    {
+        new (&m_storage) F(std::forward<G>(g));
+        m_vtable = &InlineOps<F>::vtable;
+    }
+
+    template<typename F, typename G>
+    void init(G&& g, std::false_type)
+    {
+        *reinterpret_cast<F**>(&m_storage) = new F(std::forward<G>(g));
+        m_vtable = &HeapOps<F>::vtable;
+    }
+
+    void take(unique_task& rhs) noexcept
+    {
+        if ( rhs.m_vtable )
+        {
+            rhs.m_vtable->move(&m_storage, &rhs.m_storage);
+            m_vtable = rhs.m_vtable;
+            rhs.m_vtable = nullptr;
+        }
+    }
+};
+
+//---------------------------------------------------------------------------//
+
+template<typename R, typename... Args>
+template<typename F>
+constexpr typename tapetums::unique_task<R (Args...)>::VTable
+tapetums::unique_task<R (Args...)>::InlineOps<F>::vtable;
+
+template<typename R, typename... Args>
+template<typename F>
+constexpr typename tapetums::unique_task<R (Args...)>::VTable
+tapetums::unique_task<R (Args...)>::HeapOps<F>::vtable;
+
+//---------------------------------------------------------------------------//
+// TaskNode
+//  キューにはノードへのポインタを積む (Chase-Lev のスロットはアトミックに読めること)
+//---------------------------------------------------------------------------//
+
+struct tapetums::detail::TaskNode
+{
+    Task      task;
+    TaskNode* next { nullptr };
+
+  #if defined(TASK_LATENCY)
+    int64_t enqueued { now_ns() };
+  #endif
+
+    explicit TaskNode(Task&& t) noexcept : task(std::move(t)) { }
+};
+
+//---------------------------------------------------------------------------//
+// TimerNode
+//  AddTaskAfter / AddTaskEvery で登録したタスク
+//  参照はホイール (または実行中のタスク) と TimerHandle が持ち, 最後に手放した側が破棄する
+//---------------------------------------------------------------------------//
+
+struct tapetums::detail::TimerNode : TimerWheelHook
+{
+    enum STATE : uint32_t
+    {
+        PENDING,   // ホイールで待っている
+        FIRING,    // キューに積まれたか実行中
+        CANCELLED,
+        DONE,
+    };
+
+    Task        task;
+    ThreadPool* pool;
+    uint64_t    period;   // 周期 (ティック). 0 なら一度だけ
+    PRIORITY    priority;
+    TimerNode*  chain { nullptr }; // ロックの外で処理するためのリスト
+
+    std::atomic<uint32_t> state { PENDING };
+    std::atomic<uint32_t> refs  { 2 };
+
+    TimerNode(ThreadPool* p, Task&& t, uint64_t per, PRIORITY prio) noexcept
+        : task(std::move(t)), pool(p), period(per), priority(prio) { }
+
+    void release() noexcept
+    {
+        if ( refs.fetch_sub(1, std::memory_order_acq_rel) == 1 )
+        {
+            delete this;
+        }
+    }
+};
+
+//---------------------------------------------------------------------------//
+// TimerHandle
+//  登録したタイマーを取り消すためのハンドル (コピーできる)
+//  ハンドルを捨ててもタイマーは取り消されない
+//---------------------------------------------------------------------------//
+
+class tapetums::TimerHandle final
+{
+    friend class ThreadPool;
+
+private:
+    detail::TimerNode* m_node { nullptr };
+
+    explicit TimerHandle(detail::TimerNode* node) noexcept : m_node(node) { }
+
+public:
+    TimerHandle() = default;
+    ~TimerHandle() { if ( m_node ) { m_node->release(); } }
+
+    TimerHandle(const TimerHandle& rhs) noexcept : m_node(rhs.m_node)
+    {
+        if ( m_node ) { m_node->refs.fetch_add(1, std::memory_order_relaxed); }
+    }
+    TimerHandle& operator =(const TimerHandle& rhs) noexcept { TimerHandle(rhs).swap(*this); return *this; }
+
+    TimerHandle(TimerHandle&& rhs) noexcept : m_node(rhs.m_node) { rhs.m_node = nullptr; }
+    TimerHandle& operator =(TimerHandle&& rhs) noexcept { TimerHandle(std::move(rhs)).swap(*this); return *this; }
+
+public:
+    bool valid() const noexcept { return m_node != nullptr; }
+
+    // 取り消しも終了もしていない (周期タイマーは取り消すまで真)
+    bool is_pending() const noexcept
+    {
+        if ( m_node == nullptr ) { return false; }
+
+        const auto state = m_node->state.load(std::memory_order_acquire);
+        return state == detail::TimerNode::PENDING || state == detail::TimerNode::FIRING;
+    }
+
+    bool Cancel();
+
+    void swap(TimerHandle& rhs) noexcept { std::swap(m_node, rhs.m_node); }
+};
+
+//---------------------------------------------------------------------------//
+// TimerFire
+//  期限の来たタイマーをキューに積むためのタスク
+//  実行されずに破棄されたら (Stop() など) タイマーも終わりにする
+//---------------------------------------------------------------------------//
+
+class tapetums::detail::TimerFire final
+{
+private:
+    TimerNode* m_node;
+
+public:
+    explicit TimerFire(TimerNode* node) noexcept : m_node(node) { }
+    TimerFire(TimerFire&& rhs) noexcept : m_node(rhs.m_node) { rhs.m_node = nullptr; }
+    ~TimerFire();
+
+    void operator()(TaskWorker& worker);
+};
+
+//---------------------------------------------------------------------------//
+// ResumeTask
+//  コルーチンをワーカーで再開するためのタスク
+//  実行されずに破棄されたら (Stop() など), promise の dropped_frame() が返す
+//  誰も持っていないフレーム (spawn() の外側) を破棄する. 中のフレームは連鎖して消える
+//  dropped_frame() がなければ何もしない (フレームは持ち主が破棄する)
+//---------------------------------------------------------------------------//
+
+template<typename Handle>
+class tapetums::detail::ResumeTask final
+{
+private:
+    Handle m_handle;
+
+public:
+    explicit ResumeTask(Handle handle) noexcept : m_handle(handle) { }
+    ResumeTask(ResumeTask&& rhs) noexcept : m_handle(rhs.m_handle) { rhs.m_handle = Handle(); }
+    ~ResumeTask() { if ( m_handle ) { drop(m_handle, 0); } }
+
+    void operator()(TaskWorker&)
+    {
+        const auto handle = m_handle;
+        m_handle = Handle();
+        handle.resume();
+    }
+
+private:
+    template<typename H>
+    static auto drop(H handle, int) -> decltype(handle.promise().dropped_frame(), void())
+    {
+        const auto frame = handle.promise().dropped_frame();
+        if ( frame ) { frame.destroy(); }
+    }
+
+    template<typename H>
+    static void drop(H, long) { }
+};
+
+//---------------------------------------------------------------------------//
+// NodeCache
+//  TaskNode のメモリを使い回す
+//  スレッドごとに手元に置き, 溢れた分 / 足りない分は BATCH 個単位で共有の倉庫とやり取りする
+//---------------------------------------------------------------------------//
+
+class tapetums::detail::NodeCache final
+{
+private:
+    static constexpr size_t BATCH       { 64 };
+    static constexpr size_t LOCAL_LIMIT { BATCH * 2 };
+    static constexpr size_t DEPOT_LIMIT { 256 }; // 倉庫に置く束の数
+
+    struct Block
+    {
+        Block* next;
+    };
+
+    struct Depot
+    {
+        std::mutex          lock;
+        std::vector<Block*> batches;
+
+        ~Depot()
+        {
+            for ( auto batch : batches ) { free_chain(batch); }
+        }
+    };
+
+private:
+    Block* m_free  { nullptr };
+    size_t m_count { 0 };
+
+private:
+    NodeCache() = default;
+    ~NodeCache() { free_chain(m_free); }
+
+public:
+    NodeCache(const NodeCache&)             = delete;
+    NodeCache& operator =(const NodeCache&) = delete;
+
+public:
+    static NodeCache& local() noexcept
+    {
+        static thread_local NodeCache cache;
+        return cache;
+    }
+
+public:
+    void* allocate();
+    void  deallocate(void* p) noexcept;
+
+private:
+    static Depot& depot() noexcept
+    {
+        static Depot depot;
+        return depot;
+    }
+
+    static void free_chain(Block* block) noexcept
+    {
+        while ( block )
+        {
+            const auto next = block->next;
+            ::operator delete(block);
+            block = next;
+        }
+    }
+};
+
+//---------------------------------------------------------------------------//
+
+inline void* tapetums::detail::NodeCache::allocate()
+{
+    if ( m_free == nullptr )
+    {
+        // 倉庫から一束もらう
+        auto& d = depot();
+        std::lock_guard<std::mutex> lock(d.lock);
+
+        if ( d.batches.empty() )
+        {
+            return ::operator new(std::max(sizeof(TaskNode), sizeof(Block)));
+        }
+
+        m_free  = d.batches.back();
+        m_count = BATCH;
+        d.batches.pop_back();
+    }
+
+    const auto block = m_free;
+    m_free = block->next;
+    --m_count;
+
+    return block;
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::NodeCache::deallocate(void* p) noexcept
+{
+    const auto block = static_cast<Block*>(p);
+    block->next = m_free;
+    m_free = block;
+    ++m_count;
+
+    if ( m_count < LOCAL_LIMIT )
+    {
+        return;
+    }
+
+    // 溢れた分を一束にして倉庫に返す
+    auto tail = m_free;
+    for ( size_t i = 1; i < BATCH; ++i )
+    {
+        tail = tail->next;
+    }
+    const auto batch = m_free;
+    m_free = tail->next;
+    tail->next = nullptr;
+    m_count -= BATCH;
+
+    auto& d = depot();
+    {
+        std::lock_guard<std::mutex> lock(d.lock);
+
+        if ( d.batches.size() < DEPOT_LIMIT )
+        {
+            d.batches.push_back(batch);
+            return;
+        }
+    }
+
+    free_chain(batch);
+}
+
+//---------------------------------------------------------------------------//
+
+inline tapetums::detail::TaskNode* tapetums::detail::new_node(Task&& task)
+{
+    const auto p = NodeCache::local().allocate();
+    return new (p) TaskNode(std::move(task));
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::delete_node(TaskNode* node) noexcept
+{
+    node->~TaskNode();
+    NodeCache::local().deallocate(node);
+}
+
+//---------------------------------------------------------------------------//
+// Parker
+//  ワーカーを眠らせておくための待機オブジェクト
+//  unpark() が先に呼ばれていた場合, 次の park() はすぐに戻る
+//---------------------------------------------------------------------------//
+
+class tapetums::detail::Parker final
+{
+private:
+    enum : int { EMPTY, PARKED, NOTIFIED };
+
+    std::atomic<int>        m_state { EMPTY };
+    std::mutex              m_mutex;
+    std::condition_variable m_cv;
+
+public:
+    void park  ();
+    bool park_until(std::chrono::steady_clock::time_point deadline);
+    void unpark();
+};
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::Parker::park()
+{
+    // 既に起こされていれば眠らない
+    int expected = NOTIFIED;
+    if ( m_state.compare_exchange_strong(expected, EMPTY, std::memory_order_acquire) )
+    {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    expected = EMPTY;
+    if ( ! m_state.compare_exchange_strong(expected, PARKED, std::memory_order_acquire) )
+    {
+        // ロックを取る間に起こされた
+        m_state.store(EMPTY, std::memory_order_relaxed);
+        return;
+    }
+
+    for ( ; ; )
+    {
+        m_cv.wait(lock);
+
+        expected = NOTIFIED;
+        if ( m_state.compare_exchange_strong(expected, EMPTY, std::memory_order_acquire) )
+        {
+            return;
+        }
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// deadline まで眠る. 起こされたら true, 時間切れなら false
+inline bool tapetums::detail::Parker::park_until
+(
+    std::chrono::steady_clock::time_point deadline
+)
+{
+    int expected = NOTIFIED;
+    if ( m_state.compare_exchange_strong(expected, EMPTY, std::memory_order_acquire) )
+    {
+        return true;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    expected = EMPTY;
+    if ( ! m_state.compare_exchange_strong(expected, PARKED, std::memory_order_acquire) )
+    {
+        m_state.store(EMPTY, std::memory_order_relaxed);
+        return true;
+    }
+
+    for ( ; ; )
+    {
+        const auto status = m_cv.wait_until(lock, deadline);
+
+        expected = NOTIFIED;
+        if ( m_state.compare_exchange_strong(expected, EMPTY, std::memory_order_acquire) )
+        {
+            return true;
+        }
+
+        if ( status == std::cv_status::timeout )
+        {
+            // 時間切れと同時に起こされていればそちらを優先する
+            return m_state.exchange(EMPTY, std::memory_order_acquire) == NOTIFIED;
+        }
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::Parker::unpark()
+{
+    if ( m_state.exchange(NOTIFIED, std::memory_order_release) != PARKED )
+    {
+        return;
+    }
+
+    // 眠りに入る途中のスレッドを取りこぼさないよう, 一度ロックを通過してから通知する
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+    }
+    m_cv.notify_one();
+}
+
+//---------------------------------------------------------------------------//
+// Slab
+//  ThreadPool が所有する固定長ブロックのアロケータ (future の共有状態用)
+//  プールが先に破棄されても, 貸し出したブロックが全て戻るまでは残る
+//---------------------------------------------------------------------------//
+
+class tapetums::detail::Slab final
+{
+private:
+    static constexpr size_t CLASS_COUNT      { 4 };  // 64, 128, 256, 512 bytes
+    static constexpr size_t MIN_BLOCK_SIZE   { 64 };
+    static constexpr size_t BLOCKS_PER_CHUNK { 64 };
+    static constexpr size_t LARGE_CLASS      { CLASS_COUNT };
+
+    // 各ブロックの直前に置くヘッダ
+    struct alignas(std::max_align_t) Header
+    {
+        Slab*  slab;
+        size_t size_class;
+    };
+
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    struct SizeClass
+    {
+        std::mutex         lock;
+        FreeBlock*         free { nullptr };
+        std::vector<char*> chunks;
+    };
+
+private:
+    SizeClass m_classes [CLASS_COUNT];
+    std::atomic<size_t> m_refs { 1 }; // 所有者 + 貸し出し中のブロック数
+
+private:
+    Slab() = default;
+
+    ~Slab()
+    {
+        for ( auto& c : m_classes )
+        {
+            for ( auto chunk : c.chunks )
+            {
+                ::operator delete(chunk);
+            }
+        }
+    }
+
+public:
+    Slab(const Slab&)             = delete;
+    Slab& operator =(const Slab&) = delete;
+
+    Slab(Slab&&)             = delete;
+    Slab& operator =(Slab&&) = delete;
+
+public:
+    static Slab* create() { return new Slab; }
+
+    void release() noexcept
+    {
+        if ( m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1 )
+        {
+            delete this;
+        }
+    }
+
+public:
+    void* allocate(size_t size);
+    static void deallocate(void* p) noexcept;
+};
+
+//---------------------------------------------------------------------------//
+
+inline void* tapetums::detail::Slab::allocate(size_t size)
+{
+    const auto total = size + sizeof(Header);
+
+    size_t size_class { 0 };
+    size_t block_size { MIN_BLOCK_SIZE };
+    while ( size_class < CLASS_COUNT && block_size < total )
+    {
+        ++size_class;
+        block_size <<= 1;
+    }
+
+    Header* header;
+    if ( size_class == LARGE_CLASS )
+    {
+        // 大きなものは普通に確保する
+        header = static_cast<Header*>(::operator new(total));
+    }
+    else
+    {
+        auto& c = m_classes[size_class];
+        std::lock_guard<std::mutex> lock(c.lock);
+
+        if ( c.free == nullptr )
+        {
+            // チャンクを確保して切り分ける
+            auto chunk = static_cast<char*>(::operator new(block_size * BLOCKS_PER_CHUNK));
+            c.chunks.push_back(chunk);
+
+            for ( auto i = BLOCKS_PER_CHUNK; i > 0; --i )
+            {
+                auto block = reinterpret_cast<FreeBlock*>(chunk + (i - 1) * block_size);
+                block->next = c.free;
+                c.free = block;
+            }
+        }
+
+        header = reinterpret_cast<Header*>(c.free);
+        c.free = c.free->next;
+    }
+
+    m_refs.fetch_add(1, std::memory_order_relaxed);
+
+    header->slab       = this;
+    header->size_class = size_class;
+
+    return header + 1;
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::Slab::deallocate(void* p) noexcept
+{
+    if ( p == nullptr ) { return; }
+
+    const auto header = static_cast<Header*>(p) - 1;
+    const auto slab   = header->slab;
+
+    if ( header->size_class == LARGE_CLASS )
+    {
+        ::operator delete(header);
+    }
+    else
+    {
+        auto& c = slab->m_classes[header->size_class];
+        std::lock_guard<std::mutex> lock(c.lock);
+
+        auto block = reinterpret_cast<FreeBlock*>(header);
+        block->next = c.free;
+        c.free = block;
+    }
+
+    slab->release();
+}
+
+//---------------------------------------------------------------------------//
+// WaitBucket
+//  future の完了を待つスレッドを眠らせる (アドレスで振り分けて共有する)
+//---------------------------------------------------------------------------//
+
+struct tapetums::detail::WaitBucket
+{
+    std::mutex              mutex;
+    std::condition_variable cv;
+};
+
+//---------------------------------------------------------------------------//
+
+inline tapetums::detail::WaitBucket& tapetums::detail::wait_bucket
+(
+    const void* p
+)
+noexcept
+{
+    static constexpr size_t BUCKET_COUNT { 64 };
+    static WaitBucket buckets [BUCKET_COUNT];
+
+    return buckets[(reinterpret_cast<uintptr_t>(p) >> 6) % BUCKET_COUNT];
+}
+
+//---------------------------------------------------------------------------//
+
+// スピン待ち中に CPU へ一息つかせる
+inline void tapetums::detail::cpu_relax() noexcept
+{
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+    _mm_pause();
+#elif defined(_M_ARM) || defined(_M_ARM64)
+    __yield();
+#elif defined(__arm__) || defined(__aarch64__)
+    __asm__ __volatile__ ("yield");
+#endif
+}
+
+//---------------------------------------------------------------------------//
+
+// 呼び出し元スレッドで動いている TaskWorker (ワーカースレッドでなければ nullptr)
+inline tapetums::TaskWorker*& tapetums::detail::current_worker() noexcept
+{
+    static thread_local TaskWorker* worker { nullptr };
+    return worker;
+}
+
+//---------------------------------------------------------------------------//
+
+inline int64_t tapetums::detail::now_ns() noexcept
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>
+    (
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+//---------------------------------------------------------------------------//
+// WorkerCounters
+//  TaskWorker ごとの計測値 (relaxed で更新する)
+//  所有スレッドしか書かないものは load + store で足す
+//---------------------------------------------------------------------------//
+
+struct tapetums::detail::WorkerCounters
+{
+    std::atomic<uint64_t> executed      { 0 };
+    std::atomic<uint64_t> stolen        { 0 };
+    std::atomic<uint64_t> failed_steals { 0 };
+    std::atomic<uint64_t> idle_ns       { 0 };
+    std::atomic<uint64_t> parks         { 0 };
+    std::atomic<uint64_t> wakes         { 0 };
+    std::atomic<uint64_t> high_water    { 0 };
+
+  #if defined(TASK_LATENCY)
+    std::atomic<uint64_t> wait_latency[LatencyHistogram::BUCKET_COUNT] { };
+    std::atomic<uint64_t> run_latency [LatencyHistogram::BUCKET_COUNT] { };
+  #endif
+
+    static void add(std::atomic<uint64_t>& counter, uint64_t value = 1) noexcept
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    static void raise(std::atomic<uint64_t>& counter, uint64_t value) noexcept
+    {
+        auto current = counter.load(std::memory_order_relaxed);
+        while ( current < value && ! counter.compare_exchange_weak
+        (
+            current, value, std::memory_order_relaxed, std::memory_order_relaxed
+        ) ) { }
+    }
+
+    TaskWorkerStats load() const noexcept;
+};
+
+inline tapetums::TaskWorkerStats tapetums::detail::WorkerCounters::load() const noexcept
+{
+    TaskWorkerStats stats;
+
+    stats.executed      = executed     .load(std::memory_order_relaxed);
+    stats.stolen        = stolen       .load(std::memory_order_relaxed);
+    stats.failed_steals = failed_steals.load(std::memory_order_relaxed);
+    stats.idle_ns       = idle_ns      .load(std::memory_order_relaxed);
+    stats.parks         = parks        .load(std::memory_order_relaxed);
+    stats.wakes         = wakes        .load(std::memory_order_relaxed);
+    stats.high_water    = high_water   .load(std::memory_order_relaxed);
+
+  #if defined(TASK_LATENCY)
+    for ( size_t i = 0; i < LatencyHistogram::BUCKET_COUNT; ++i )
+    {
+        stats.wait_latency.buckets[i] = wait_latency[i].load(std::memory_order_relaxed);
+        stats.run_latency .buckets[i] = run_latency [i].load(std::memory_order_relaxed);
+    }
+  #endif
+
+    return stats;
+}
+
+//---------------------------------------------------------------------------//
+// LatencyHistogram Methods
+//---------------------------------------------------------------------------//
+
+inline size_t tapetums::LatencyHistogram::bucket_of(uint64_t ns) noexcept
+{
+    size_t index { 0 };
+    for ( size_t shift = 32; shift > 0; shift /= 2 )
+    {
+        if ( ns >> shift )
+        {
+            ns >>= shift;
+            index += shift;
+        }
+    }
+
+    return std::min(index, BUCKET_COUNT - 1);
+}
+
+//---------------------------------------------------------------------------//
+
+inline uint64_t tapetums::LatencyHistogram::count() const noexcept
+{
+    uint64_t sum { 0 };
+    for ( const auto n : buckets )
+    {
+        sum += n;
+    }
+
+    return sum;
+}
+
+//---------------------------------------------------------------------------//
+
+// 全体の p (0.0 - 1.0) が収まるバケットの上限 (ナノ秒)
+inline uint64_t tapetums::LatencyHistogram::percentile(double p) const noexcept
+{
+    const auto total = count();
+    if ( total == 0 )
+    {
+        return 0;
+    }
+
+    const auto target = static_cast<uint64_t>(p * total);
+
+    uint64_t sum { 0 };
+    for ( size_t i = 0; i < BUCKET_COUNT; ++i )
+    {
+        sum += buckets[i];
+        if ( sum > target || sum == total )
+        {
+            return uint64_t(2) << i;
+        }
+    }
+
+    return uint64_t(2) << (BUCKET_COUNT - 1);
+}
+
+//---------------------------------------------------------------------------//
+
+inline tapetums::LatencyHistogram& tapetums::LatencyHistogram::operator +=
+(
+    const LatencyHistogram& rhs
+)
+noexcept
+{
+    for ( size_t i = 0; i < BUCKET_COUNT; ++i )
+    {
+        buckets[i] += rhs.buckets[i];
+    }
+
+    return *this;
+}
+
+//---------------------------------------------------------------------------//
+// TaskWorkerStats Methods
+//---------------------------------------------------------------------------//
+
+inline tapetums::TaskWorkerStats& tapetums::TaskWorkerStats::operator +=
+(
+    const TaskWorkerStats& rhs
+)
+noexcept
+{
+    executed      += rhs.executed;
+    stolen        += rhs.stolen;
+    failed_steals += rhs.failed_steals;
+    idle_ns       += rhs.idle_ns;
+    parks         += rhs.parks;
+    wakes         += rhs.wakes;
+    high_water     = std::max(high_water, rhs.high_water);
+
+    wait_latency += rhs.wait_latency;
+    run_latency  += rhs.run_latency;
+
+    return *this;
+}
+
+//---------------------------------------------------------------------------//
+// ThreadPool Class
+//---------------------------------------------------------------------------//
+
+class tapetums::ThreadPool final
+{
+    friend class TaskWorker;
+    friend class TimerHandle;
+    friend class detail::TimerFire;
+    friend class detail::FutureStateBase;
+    template<typename> friend class detail::FutureState;
+
+public:
+    static constexpr uint32_t MAX_THREADS_PER_PROCESSOR { 500 };
+    static constexpr size_t   PRIORITY_COUNT { 3 };
+
+    using clock = std::chrono::steady_clock;
+
+    using TIMER_RESOLUTION = std::chrono::milliseconds;
+
+    class BlockingRegion;
+    class ScheduleAwaiter;
+
+private:
+    struct DeadlineEntry
+    {
+        clock::time_point deadline;
+        detail::TaskNode* node;
+
+        // std::push_heap で期限の早いものを先頭に置くため逆順にする
+        bool operator <(const DeadlineEntry& rhs) const noexcept { return deadline > rhs.deadline; }
+    };
+
+private:
+    ThreadPoolConfig m_config;
+    detail::Slab*    m_slab;
+
+    std::vector<std::unique_ptr<TaskWorker>> m_workers;
+    std::atomic<size_t> m_index { 0 };
+
+    // 眠っているワーカーの一覧 (eventcount 方式)
+    std::mutex               m_idle_lock;
+    std::vector<TaskWorker*> m_idle;
+    std::atomic<size_t>      m_idle_count { 0 };
+
+    // タスクを探してスピン中のワーカー数
+    std::atomic<size_t> m_spinning { 0 };
+
+    // REALTIME レーンに積まれているタスク数 (0 なら探しに行かない)
+    std::atomic<size_t> m_realtime_count { 0 };
+
+    // 期限付きタスク (期限の早い順のヒープ)
+    std::mutex                 m_deadline_lock;
+    std::vector<DeadlineEntry> m_deadlines;
+    std::atomic<size_t>        m_deadline_count { 0 };
+    std::atomic<int64_t>       m_next_deadline  { 0 }; // 先頭の期限 (clock::duration の count)
+
+    // 伸縮用. m_workers は最大数 + 補充用の枠を持ったままにして, スレッドだけを増減させる
+    size_t              m_worker_count { 0 };
+    std::mutex          m_resize_lock;
+    std::atomic<size_t> m_active  { 0 };
+    bool                m_stopped { true };
+
+    // Stop() 中. 破棄したタスクから積まれる継続は, 積まずにその場で破棄する
+    std::atomic<bool>   m_closing { false };
+
+    // BlockingRegion の中にいるワーカー数と, 退くべき補充用ワーカー数
+    std::atomic<size_t> m_blocked { 0 };
+    std::atomic<size_t> m_surplus { 0 };
+
+    // 遅延 / 周期タスク (ティックは m_timer_epoch からの TIMER_RESOLUTION 単位)
+    // m_timer_keeper は次の期限まで眠って起きる役のワーカー
+    std::mutex               m_timer_lock;
+    TimerWheel               m_timers;
+    const clock::time_point  m_timer_epoch { clock::now() };
+    std::atomic<int64_t>     m_next_timer  { NO_TIMER }; // 次の期限 (clock::duration の count)
+    std::atomic<TaskWorker*> m_timer_keeper { nullptr };
+
+    static constexpr int64_t NO_TIMER { std::numeric_limits<int64_t>::max() };
+
+public:
+    explicit ThreadPool(size_t worker_count);
+    ThreadPool(size_t worker_count, const ThreadPoolConfig& config);
+
+public:
+    ThreadPool() = delete;
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // ワーカーがプールのアドレスを保持しているためムーブできない
+    ThreadPool(ThreadPool&& rhs) = delete;
+    ThreadPool& operator=(ThreadPool&&) = delete;
+
+    ~ThreadPool() { Stop(); m_slab->release(); }
+
+public:
+    size_t worker_count () const noexcept { return m_worker_count; }
+    size_t active_count () const noexcept { return m_active.load(std::memory_order_relaxed); }
+    size_t blocked_count() const noexcept { return m_blocked.load(std::memory_order_relaxed); }
+    bool   is_elastic  () const noexcept { return m_config.min_workers > 0 && m_config.min_workers < worker_count(); }
+    const ThreadPoolConfig& config() const noexcept { return m_config; }
+
+public:
+    void AddTask  (Task&& task, PRIORITY priority = PRIORITY::NORMAL);
+    void AddTask  (Task&& task, clock::time_point deadline);
+    TimerHandle AddTaskAfter(clock::duration delay,  Task&& task, PRIORITY priority = PRIORITY::NORMAL);
+    TimerHandle AddTaskEvery(clock::duration period, Task&& task, PRIORITY priority = PRIORITY::NORMAL);
+    template<typename It>
+    void AddTasks (It first, It last, PRIORITY priority = PRIORITY::NORMAL);
+    template<typename Range>
+    void AddTasks (Range&& tasks, PRIORITY priority = PRIORITY::NORMAL);
+    Task QueryTask();
+    bool RunPendingTask();
+    void Start    ();
+    void Stop     ();
+    void Pause    () noexcept;
+    void Resume   () noexcept;
+
+    ThreadPoolStats Snapshot() const;
+
+    template<typename F>
+    auto Submit(F&& f, PRIORITY priority = PRIORITY::NORMAL) -> future<detail::result_t<F>>;
+
+    // co_await pool.schedule(); でプールのワーカーに移って再開する (Coroutine.hpp)
+    ScheduleAwaiter schedule(PRIORITY priority = PRIORITY::NORMAL) noexcept;
+
+private:
+    void place_workers();
+    TaskWorker* pick_worker();
+    void grow  (size_t count);
+    bool retire(TaskWorker* worker, bool surplus);
+    void enter_blocking(TaskWorker* worker);
+    void leave_blocking(TaskWorker* worker);
+    void submit_node(detail::TaskNode* node, PRIORITY priority = PRIORITY::NORMAL);
+    detail::TaskNode* find_node (TaskWorker* self, TaskWorker** victim_out);
+    detail::TaskNode* steal_node(TaskWorker* thief, PRIORITY priority, TaskWorker** victim_out);
+    detail::TaskNode* pop_deadline(bool due_only);
+    void clear_deadlines();
+
+    TimerHandle add_timer(clock::duration delay, clock::duration period, Task&& task, PRIORITY priority);
+    bool cancel_timer(detail::TimerNode* node);
+    void rearm_timer (detail::TimerNode* node);
+    bool poll_timers ();
+    void clear_timers();
+    void publish_next_timer() noexcept;
+    void wake_timer_keeper ();
+    bool claim_timer_keeper  (TaskWorker* worker, clock::time_point& wake_at) noexcept;
+    void release_timer_keeper(TaskWorker* worker) noexcept;
+    uint64_t timer_now() const noexcept;
+
+    static uint64_t to_ticks(clock::duration d) noexcept;
+
+    bool has_task   () const noexcept;
+    void notify     (TaskWorker* preferred);
+    void notify_many(size_t count);
+    void prepare_park(TaskWorker* worker);
+    void cancel_park (TaskWorker* worker);
+};
+
+//---------------------------------------------------------------------------//
+// TaskWorker Class
+//---------------------------------------------------------------------------//
+
+class tapetums::TaskWorker final
+{
+    friend class ThreadPool; // インスタンスを生成できるのは ThreadPool だけ
+    friend class detail::FutureStateBase;
+
+private:
+    // 優先度ごとのキュー
+    struct Lane
+    {
+        // 所有スレッド専用の両端キュー
+        WorkStealingDeque<detail::TaskNode*> tasks;
+
+        // 他のスレッドから投入されたタスク (ロックフリーのスタック)
+        std::atomic<detail::TaskNode*> inbox { nullptr };
+    };
+
+private:
+    ThreadPool* m_pool { nullptr };
+
+    std::atomic<bool> m_working { false };
+    std::atomic<bool> m_running { false };
+    std::atomic<bool> m_stop    { false };
+    std::atomic<bool> m_retired { false }; // 伸縮で自分から退いた (スレッドは未回収)
+    std::atomic<bool> m_spare   { false }; // BlockingRegion の代わりに起動された
+
+    std::thread    m_thread;
+    detail::Parker m_parker;
+
+    // 割り当てられた論理プロセッサ (CpuTopology のインデックス)
+    size_t m_cpu { 0 };
+
+    // 盗みに行く相手 (近い順). m_tier_end[d] は距離 d までの相手の数
+    std::vector<TaskWorker*> m_victims;
+    size_t m_tier_end[CpuTopology::DISTANCE_MAX] { };
+    size_t m_steal_seed { 0 };
+
+    // BlockingRegion の入れ子の深さと, 代わりのワーカーを起動したかどうか (所有スレッドのみ)
+    uint32_t m_blocking_depth { 0 };
+    bool     m_compensated    { false };
+
+    detail::WorkerCounters m_stats;
+
+    Lane                m_lanes[ThreadPool::PRIORITY_COUNT];
+    std::atomic<size_t> m_inbox_count { 0 };
+
+private:
+    explicit TaskWorker(ThreadPool* pool) : m_pool(pool) { }
+
+public:
+    TaskWorker() = delete;
+
+    TaskWorker(const TaskWorker&) = delete;
+    TaskWorker& operator=(const TaskWorker&) = delete;
+
+    // 他のスレッドからキューを参照されるためムーブできない
+    TaskWorker(TaskWorker&& rhs) = delete;
+    TaskWorker& operator=(TaskWorker&& rhs) = delete;
+
+    ~TaskWorker() { Stop(); clear(); }
+
+public:
+    bool   empty     () const noexcept { return task_count() == 0; }
+    bool   is_paused () const noexcept { return ! m_working.load(std::memory_order_relaxed); }
+    bool   is_running() const noexcept { return m_running.load(std::memory_order_acquire); }
+    bool   is_active () const noexcept { return is_running() && ! m_retired.load(std::memory_order_acquire); }
+    size_t task_count() const noexcept;
+    auto   thread_id () const noexcept { return m_thread.get_id(); }
+
+    TaskWorkerStats stats() const noexcept { return m_stats.load(); }
+
+public:
+    void AddTask  (Task&& task, PRIORITY priority = PRIORITY::NORMAL);
+    Task QueryTask();
+    Task StealTask();
+    void Start    ();
+    void Stop     ();
+    void Pause    () noexcept;
+    void Resume   () noexcept;
+
+private:
+    bool is_owner() const noexcept { return detail::current_worker() == this; }
+    bool has_task() const noexcept;
+
+    Lane& lane(PRIORITY priority) noexcept { return m_lanes[static_cast<size_t>(priority)]; }
+
+    void push_node (detail::TaskNode* node, PRIORITY priority);
+    void push_inbox(PRIORITY priority, detail::TaskNode* head, detail::TaskNode* tail, size_t count);
+    bool drain_inbox(PRIORITY priority);
+    detail::TaskNode* pop_node  (PRIORITY priority);
+    detail::TaskNode* steal_node(PRIORITY priority);
+    void taken  (PRIORITY priority) noexcept;
+    void run    (detail::TaskNode* node);
+    bool run_one();
+    void clear  ();
+
+    void MainLoop();
+};
+
+//---------------------------------------------------------------------------//
+// ThreadPool::BlockingRegion
+//  タスクの中でブロックする処理 (ファイルの読み書きや通信の待ちなど) を囲む
+//  囲んでいる間は, 空いている枠で代わりのワーカーを動かす
+//  ワーカースレッド以外から使った場合は何もしない
+//---------------------------------------------------------------------------//
+
+class tapetums::ThreadPool::BlockingRegion final
+{
+private:
+    TaskWorker* m_worker;
+
+public:
+    BlockingRegion();
+    ~BlockingRegion();
+
+    BlockingRegion(const BlockingRegion&)             = delete;
+    BlockingRegion& operator =(const BlockingRegion&) = delete;
+
+    BlockingRegion(BlockingRegion&&)             = delete;
+    BlockingRegion& operator =(BlockingRegion&&) = delete;
+};
+
+//---------------------------------------------------------------------------//
+
+inline tapetums::ThreadPool::BlockingRegion::BlockingRegion()
+    : m_worker(detail::current_worker())
+{
+    if ( m_worker )
+    {
+        m_worker->m_pool->enter_blocking(m_worker);
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+inline tapetums::ThreadPool::BlockingRegion::~BlockingRegion()
+{
+    if ( m_worker )
+    {
+        m_worker->m_pool->leave_blocking(m_worker);
+    }
+}
+
+//---------------------------------------------------------------------------//
+// ThreadPool::ScheduleAwaiter
+//  ThreadPool::schedule() の戻り値
+//  <coroutine> に依存しないよう, await_suspend はハンドルの型をテンプレートで受ける
+//---------------------------------------------------------------------------//
+
+class tapetums::ThreadPool::ScheduleAwaiter final
+{
+private:
+    ThreadPool* m_pool;
+    PRIORITY    m_priority;
+
+public:
+    ScheduleAwaiter(ThreadPool* pool, PRIORITY priority) noexcept
+        : m_pool(pool), m_priority(priority) { }
+
+public:
+    // ワーカー上にいても一度キューに積み直す (長い処理の途中で譲るのにも使える)
+    bool await_ready() const noexcept { return false; }
+
+    template<typename Handle>
+    void await_suspend(Handle handle)
+    {
+        m_pool->AddTask(detail::ResumeTask<Handle>(handle), m_priority);
+    }
+
+    void await_resume() const noexcept { }
+};
+
+//---------------------------------------------------------------------------//
+// ThreadPool ctor
+//---------------------------------------------------------------------------//
+
+inline tapetums::ThreadPool::ThreadPool(size_t worker_count)
+    : ThreadPool(worker_count, ThreadPoolConfig())
+{
+}
+
+//---------------------------------------------------------------------------//
+
+inline tapetums::ThreadPool::ThreadPool
+(
+    size_t worker_count, const ThreadPoolConfig& config
+)
+    : m_config(config), m_slab(detail::Slab::create())
+{
+    const auto num_procs = std::max(CpuTopology::Get().cpu_count(), size_t(1));
+    const auto max_count = num_procs * MAX_THREADS_PER_PROCESSOR;
+
+    size_t count;
+    if ( worker_count == 0 )
+    {
+        count = num_procs;
+    }
+    else if ( worker_count > max_count )
+    {
+        count = max_count;
+    }
+    else
+    {
+        count = worker_count;
+    }
+
+    // BlockingRegion 用の補充枠も先に作っておく
+    m_worker_count = count;
+    count += m_config.max_blocking;
+
+    m_workers.reserve(count);
+    m_idle.reserve(count);
+    while ( count-- )
+    {
+        m_workers.emplace_back(new TaskWorker(this));
+    }
+
+    place_workers();
+}
+
+//---------------------------------------------------------------------------//
+// ThreadPool Methods
+//---------------------------------------------------------------------------//
+
+inline void tapetums::ThreadPool::AddTask(Task&& task, PRIORITY priority)
+{
+    submit_node(detail::new_node(std::move(task)), priority);
+}
+
+//---------------------------------------------------------------------------//
+
+// 期限付きのタスクを投入する
+// 期限まで config().deadline_window を切ると REALTIME の次に, それまでは NORMAL の次に実行される
+inline void tapetums::ThreadPool::AddTask(Task&& task, clock::time_point deadline)
+{
+    const auto node = detail::new_node(std::move(task));
+    {
+        std::lock_guard<std::mutex> lock(m_deadline_lock);
+
+        m_deadlines.push_back(DeadlineEntry{ deadline, node });
+        std::push_heap(m_deadlines.begin(), m_deadlines.end());
+
+        m_next_deadline.store
+        (
+            m_deadlines.front().deadline.time_since_epoch().count(),
+            std::memory_order_relaxed
+        );
+        m_deadline_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    notify(nullptr);
+}
+
+//---------------------------------------------------------------------------//
+
+// delay の後に一度だけ実行する
+inline tapetums::TimerHandle tapetums::ThreadPool::AddTaskAfter
+(
+    clock::duration delay, Task&& task, PRIORITY priority
+)
+{
+    return add_timer(delay, clock::duration::zero(), std::move(task), priority);
+}
+
+//---------------------------------------------------------------------------//
+
+// period ごとに実行する (最初は period の後)
+// 前回の実行が終わるまで次は積まない. 遅れた回はまとめて一度だけ実行する
+inline tapetums::TimerHandle tapetums::ThreadPool::AddTaskEvery
+(
+    clock::duration period, Task&& task, PRIORITY priority
+)
+{
+    if ( period < TIMER_RESOLUTION(1) )
+    {
+        period = TIMER_RESOLUTION(1);
+    }
+
+    return add_timer(period, period, std::move(task), priority);
+}
+
+//---------------------------------------------------------------------------//
+
+inline tapetums::Task tapetums::ThreadPool::QueryTask()
+{
+    auto self = detail::current_worker();
+    if ( self && self->m_pool != this )
+    {
+        self = nullptr;
+    }
+
+    TaskWorker* victim { nullptr };
+    auto node = find_node(self, &victim);
+    if ( node == nullptr )
+    {
+        return Task();
+    }
+
+    auto task = std::move(node->task);
+    detail::delete_node(node);
+
+    return task;
+}
+
+//---------------------------------------------------------------------------//
+
+// 呼び出し元のスレッドでタスクをひとつ実行する (待っている間に手伝うときに使う)
+// ワーカー以外のスレッドからは, 盗んできたタスクを元の持ち主のワーカーとして実行する
+inline bool tapetums::ThreadPool::RunPendingTask()
+{
+    const auto self = detail::current_worker();
+    if ( self && self->m_pool == this )
+    {
+        return self->run_one();
+    }
+
+    TaskWorker* victim { nullptr };
+    const auto node = find_node(nullptr, &victim);
+    if ( node == nullptr )
+    {
+        return false;
+    }
+
+    victim->run(node);
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::ThreadPool::Start()
+{
+    std::lock_guard<std::mutex> lock(m_resize_lock);
+
+    m_stopped = false;
+    m_closing.store(false, std::memory_order_release);
+
+    // 伸縮するプールは最小数から始める
+    const auto initial = is_elastic() ? size_t(m_config.min_workers) : worker_count();
+
+    size_t active { 0 };
+    for ( size_t i = 0; i < m_workers.size(); ++i )
+    {
+        const auto& worker = m_workers[i];
+        if ( i < initial || worker->is_active() )
+        {
+            worker->Start();
+            ++active;
+        }
+    }
+    m_active.store(active, std::memory_order_relaxed);
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::ThreadPool::Stop()
+{
+    // これ以降は増減させない (退こうとしているワーカーと取り合わないようロックの外で止める)
+    {
+        std::lock_guard<std::mutex> lock(m_resize_lock);
+        m_stopped = true;
+    }
+    m_closing.store(true, std::memory_order_seq_cst);
+
+    for ( auto& worker : m_workers )
+    {
+        worker->Stop();
+    }
+    m_active .store(0, std::memory_order_relaxed);
+    m_surplus.store(0, std::memory_order_relaxed);
+
+    clear_deadlines();
+    clear_timers();
+
+    // 止める前に外から積まれていたものが残っていれば, 全員が空になるまで破棄する
+    for ( bool empty = false; ! empty; )
+    {
+        empty = true;
+        for ( auto& worker : m_workers )
+        {
+            if ( worker->task_count() > 0 )
+            {
+                worker->clear();
+                empty = false;
+            }
+        }
+    }
+
+    // 破棄するのは止めている間に積まれたものだけ. 以降は次の Start() まで溜めておく
+    m_closing.store(false, std::memory_order_release);
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::ThreadPool::Pause() noexcept
+{
+    for ( auto& worker : m_workers )
+    {
+        worker->Pause();
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::ThreadPool::Resume() noexcept
+{
+    for ( auto& worker : m_workers )
+    {
+        worker->Resume();
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// 積まれたまま Stop() で破棄されたコルーチンは再開されない
+// (spawn() で始めたものはフレームごと破棄され, future は broken_promise になる)
+inline tapetums::ThreadPool::ScheduleAwaiter tapetums::ThreadPool::schedule(PRIORITY priority) noexcept
+{
+    return ScheduleAwaiter(this, priority);
+}
+
+//---------------------------------------------------------------------------//
+
+// 各ワーカーの計測値を集める (ワーカーを止めずに読む)
+inline tapetums::ThreadPoolStats tapetums::ThreadPool::Snapshot() const
+{
+    ThreadPoolStats stats;
+
+    stats.workers.reserve(m_workers.size());
+    for ( const auto& worker : m_workers )
+    {
+        stats.workers.push_back(worker->stats());
+        stats.total += stats.workers.back();
+    }
+
+    return stats;
+}
+
+//---------------------------------------------------------------------------//
+// ThreadPool Inner Methods
+//---------------------------------------------------------------------------//
+
+// ワーカーを論理プロセッサに割り当て, それぞれの盗み先を近い順に並べる
+inline void tapetums::ThreadPool::place_workers()
+{
+    const auto& topology = CpuTopology::Get();
+    const auto  order    = topology.PlacementOrder();
+
+    const auto count = m_workers.size();
+    for ( size_t i = 0; i < count; ++i )
+    {
+        m_workers[i]->m_cpu = order[i % order.size()];
+    }
+
+    for ( size_t i = 0; i < count; ++i )
+    {
+        const auto& thief = m_workers[i];
+
+        // 同じ距離の中では, 自分の次の番号から順に並べる (盗み先が偏らないように)
+        std::vector<std::pair<uint32_t, TaskWorker*>> victims;
+        victims.reserve(count - 1);
+        for ( size_t n = 1; n < count; ++n )
+        {
+            const auto& victim = m_workers[(i + n) % count];
+            const auto  d = topology.distance(thief->m_cpu, victim->m_cpu);
+            victims.emplace_back(uint32_t(d), victim.get());
+        }
+        std::stable_sort(victims.begin(), victims.end(), [](const auto& lhs, const auto& rhs)
+        {
+            return lhs.first < rhs.first;
+        });
+
+        thief->m_victims.clear();
+        for ( const auto& victim : victims )
+        {
+            thief->m_victims.push_back(victim.second);
+        }
+        for ( uint32_t d = 0; d < CpuTopology::DISTANCE_MAX; ++d )
+        {
+            thief->m_tier_end[d] = std::upper_bound
+            (
+                victims.begin(), victims.end(), d,
+                [](uint32_t value, const auto& victim) { return value < victim.first; }
+            ) - victims.begin();
+        }
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::ThreadPool::submit_node
+(
+    detail::TaskNode* node, PRIORITY priority
+)
+{
+    // ワーカースレッド内からの投入は自分のキューに積む (ロック不要)
+    const auto self = detail::current_worker();
+    if ( self && self->m_pool == this )
+    {
+        self->push_node(node, priority);
+        return;
+    }
+
+    // 外部スレッドからはラウンドロビンで振り分ける
+    pick_worker()->push_node(node, priority);
+}
+
+//---------------------------------------------------------------------------//
+
+// 外部から投入するときの振り分け先
+// 伸縮するプールや補充用ワーカーが動いているときは, 動いているワーカーだけから選ぶ
+inline tapetums::TaskWorker* tapetums::ThreadPool::pick_worker()
+{
+    const auto index = m_index.fetch_add(1, std::memory_order_relaxed);
+
+    // 番号順の枠が退いていれば (補充用ワーカーが残った場合など) 動いているものを探す
+    const auto& slot = m_workers[index % worker_count()];
+    if ( is_elastic() || active_count() > worker_count() || ! slot->is_active() )
+    {
+        const auto count = m_workers.size();
+        for ( size_t i = 0; i < count; ++i )
+        {
+            const auto& worker = m_workers[(index + i) % count];
+            if ( worker->is_active() )
+            {
+                return worker.get();
+            }
+        }
+    }
+
+    return slot.get();
+}
+
+//---------------------------------------------------------------------------//
+
+// 止まっている枠のワーカーを最大 count 個起動する
+// 投入する側から呼ばれるので, 他のスレッドが増減の最中なら何もしない
+inline void tapetums::ThreadPool::grow(size_t count)
+{
+    if ( count == 0 || ! is_elastic() || active_count() >= worker_count() + blocked_count() )
+    {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(m_resize_lock, std::try_to_lock);
+    if ( ! lock.owns_lock() || m_stopped )
+    {
+        return;
+    }
+
+    for ( auto& worker : m_workers )
+    {
+        if ( count == 0 )
+        {
+            break;
+        }
+        if ( worker->is_active() )
+        {
+            continue;
+        }
+
+        worker->Start();
+        m_active.fetch_add(1, std::memory_order_relaxed);
+        --count;
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// ワーカーが自分を止めてよいか確かめる
+//  surplus: BlockingRegion が終わって余った補充用ワーカーの分だけ退く
+//  それ以外: 長く仕事のなかったワーカーが退く (最小数までは残す)
+// 退く場合は, その間に受付口に届いたタスクを動いているワーカーに渡す
+inline bool tapetums::ThreadPool::retire(TaskWorker* worker, bool surplus)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_resize_lock);
+
+        if ( m_stopped )
+        {
+            return false;
+        }
+        if ( surplus )
+        {
+            auto count = m_surplus.load(std::memory_order_relaxed);
+            do
+            {
+                if ( count == 0 ) { return false; }
+            }
+            while ( ! m_surplus.compare_exchange_weak(count, count - 1, std::memory_order_relaxed) );
+        }
+        else if ( active_count() <= m_config.min_workers + blocked_count() )
+        {
+            return false;
+        }
+
+        m_active.fetch_sub(1, std::memory_order_relaxed);
+        worker->m_spare  .store(false, std::memory_order_relaxed);
+        worker->m_retired.store(true,  std::memory_order_release);
+    }
+
+    for ( size_t i = 0; i < PRIORITY_COUNT; ++i )
+    {
+        const auto priority = static_cast<PRIORITY>(i);
+        while ( const auto node = worker->pop_node(priority) )
+        {
+            pick_worker()->push_node(node, priority);
+        }
+    }
+
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+
+// ワーカーがブロックする処理に入る. 空いている枠があれば代わりのワーカーを起動する
+inline void tapetums::ThreadPool::enter_blocking(TaskWorker* worker)
+{
+    if ( worker->m_blocking_depth++ > 0 )
+    {
+        return;
+    }
+
+    m_blocked.fetch_add(1, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(m_resize_lock);
+
+    // 動ける数が最大数に届いていなければ, 減った分をひとつ補う
+    if ( m_stopped || active_count() >= worker_count() + blocked_count() )
+    {
+        return;
+    }
+
+    for ( auto& slot : m_workers )
+    {
+        if ( ! slot->is_active() )
+        {
+            slot->m_spare.store(true, std::memory_order_relaxed);
+            slot->Start();
+            m_active.fetch_add(1, std::memory_order_relaxed);
+            worker->m_compensated = true;
+            break;
+        }
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// ブロックする処理から戻った. 補ったワーカーがいれば, 補充用ワーカーをひとつ退かせる
+inline void tapetums::ThreadPool::leave_blocking(TaskWorker* worker)
+{
+    if ( --worker->m_blocking_depth > 0 )
+    {
+        return;
+    }
+
+    m_blocked.fetch_sub(1, std::memory_order_relaxed);
+
+    if ( ! worker->m_compensated )
+    {
+        return;
+    }
+    worker->m_compensated = false;
+    m_surplus.fetch_add(1, std::memory_order_relaxed);
+
+    // 眠っている補充用ワーカーがいれば起こして退かせる (起きているものは次の周回で退く)
+    TaskWorker* spare { nullptr };
+    {
+        std::lock_guard<std::mutex> lock(m_idle_lock);
+
+        const auto it = std::find_if(m_idle.begin(), m_idle.end(), [](TaskWorker* idle)
+        {
+            return idle->m_spare.load(std::memory_order_relaxed);
+        });
+        if ( it != m_idle.end() )
+        {
+            spare = *it;
+            m_idle.erase(it);
+            m_idle_count.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+    if ( spare )
+    {
+        spare->m_parker.unpark();
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// 次に実行するタスクを優先度の高い順に探す
+//  REALTIME → 期限の迫ったタスク → NORMAL → 期限付きタスク → BACKGROUND
+// 各レーンでは自分のキュー → 他人のキューの順に探す
+inline tapetums::detail::TaskNode* tapetums::ThreadPool::find_node
+(
+    TaskWorker* self, TaskWorker** victim_out
+)
+{
+    const auto take = [this, self, victim_out](PRIORITY priority) -> detail::TaskNode*
+    {
+        if ( self )
+        {
+            const auto node = self->pop_node(priority);
+            if ( node )
+            {
+                *victim_out = self;
+                return node;
+            }
+        }
+
+        return steal_node(self, priority, victim_out);
+    };
+
+    const auto take_deadline = [this, self, victim_out](bool due_only) -> detail::TaskNode*
+    {
+        const auto node = pop_deadline(due_only);
+        if ( node )
+        {
+            // 持ち主がいないので, 外部スレッドからは先頭のワーカーとして実行する
+            *victim_out = self ? self : m_workers.front().get();
+        }
+        return node;
+    };
+
+    detail::TaskNode* node { nullptr };
+
+    if ( m_realtime_count.load(std::memory_order_relaxed) > 0 )
+    {
+        node = take(PRIORITY::REALTIME);
+        if ( node ) { return node; }
+    }
+
+    node = take_deadline(true);
+    if ( node ) { return node; }
+
+    node = take(PRIORITY::NORMAL);
+    if ( node ) { return node; }
+
+    node = take_deadline(false);
+    if ( node ) { return node; }
+
+    return take(PRIORITY::BACKGROUND);
+}
+
+//---------------------------------------------------------------------------//
+
+inline tapetums::detail::TaskNode* tapetums::ThreadPool::steal_node
+(
+    TaskWorker* thief, PRIORITY priority, TaskWorker** victim_out
+)
+{
+    if ( thief && thief->m_pool == this )
+    {
+        // 同じコア → 同じ L3 → 同じノード → 他のノードの順に探す
+        // 同じ距離の中では開始位置をずらして, 特定の相手に集中しないようにする
+        const auto seed = thief->m_steal_seed++;
+
+        size_t begin { 0 };
+        for ( const auto end : thief->m_tier_end )
+        {
+            const auto size = end - begin;
+            for ( size_t i = 0; i < size; ++i )
+            {
+                const auto victim = thief->m_victims[begin + (seed + i) % size];
+
+                auto node = victim->steal_node(priority);
+                if ( node )
+                {
+                    detail::WorkerCounters::add(thief->m_stats.stolen);
+
+                    *victim_out = victim;
+                    return node;
+                }
+            }
+            begin = end;
+        }
+
+        detail::WorkerCounters::add(thief->m_stats.failed_steals);
+        return nullptr;
+    }
+
+    const auto count = worker_count();
+    const auto start = m_index.load(std::memory_order_relaxed);
+
+    for ( size_t i = 0; i < count; ++i )
+    {
+        const auto& victim = m_workers[(start + i) % count];
+
+        auto node = victim->steal_node(priority);
+        if ( node )
+        {
+            *victim_out = victim.get();
+            return node;
+        }
+    }
+
+    return nullptr;
+}
+
+//---------------------------------------------------------------------------//
+
+// 期限付きタスクを取り出す. due_only なら期限が迫っているものだけ
+inline tapetums::detail::TaskNode* tapetums::ThreadPool::pop_deadline(bool due_only)
+{
+    if ( m_deadline_count.load(std::memory_order_relaxed) == 0 )
+    {
+        return nullptr;
+    }
+
+    const auto limit = (clock::now() + m_config.deadline_window).time_since_epoch().count();
+    if ( due_only && m_next_deadline.load(std::memory_order_relaxed) > limit )
+    {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(m_deadline_lock);
+
+    if ( m_deadlines.empty() )
+    {
+        return nullptr;
+    }
+    if ( due_only && m_deadlines.front().deadline.time_since_epoch().count() > limit )
+    {
+        return nullptr;
+    }
+
+    std::pop_heap(m_deadlines.begin(), m_deadlines.end());
+    const auto node = m_deadlines.back().node;
+    m_deadlines.pop_back();
+
+    if ( ! m_deadlines.empty() )
+    {
+        m_next_deadline.store
+        (
+            m_deadlines.front().deadline.time_since_epoch().count(),
+            std::memory_order_relaxed
+        );
+    }
+    m_deadline_count.fetch_sub(1, std::memory_order_relaxed);
+
+    return node;
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::ThreadPool::clear_deadlines()
+{
+    while ( auto node = pop_deadline(false) )
+    {
+        detail::delete_node(node);
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+inline tapetums::TimerHandle tapetums::ThreadPool::add_timer
+(
+    clock::duration delay, clock::duration period, Task&& task, PRIORITY priority
+)
+{
+    const auto node = new detail::TimerNode(this, std::move(task), to_ticks(period), priority);
+
+    bool earlier;
+    {
+        std::lock_guard<std::mutex> lock(m_timer_lock);
+
+        const auto prev = m_next_timer.load(std::memory_order_relaxed);
+
+        // 今のティックも切り上げて, 期限より早く実行しないようにする
+        node->expiry = timer_now() + 1 + to_ticks(delay);
+        m_timers.insert(node);
+        publish_next_timer();
+
+        earlier = m_next_timer.load(std::memory_order_relaxed) < prev;
+    }
+
+    // 眠っている番人より早い期限なら起こし直す
+    if ( earlier )
+    {
+        wake_timer_keeper();
+    }
+
+    return TimerHandle(node);
+}
+
+//---------------------------------------------------------------------------//
+
+inline bool tapetums::ThreadPool::cancel_timer(detail::TimerNode* node)
+{
+    using detail::TimerNode;
+
+    auto state = node->state.load(std::memory_order_acquire);
+    for ( ;; )
+    {
+        if ( state == TimerNode::PENDING )
+        {
+            if ( ! node->state.compare_exchange_weak(state, TimerNode::CANCELLED, std::memory_order_acq_rel) )
+            {
+                continue;
+            }
+
+            // 期限切れの処理と入れ違いなら, そちらがホイールの参照を手放す
+            bool linked;
+            {
+                std::lock_guard<std::mutex> lock(m_timer_lock);
+
+                linked = node->linked;
+                if ( linked )
+                {
+                    m_timers.remove(node);
+                    publish_next_timer();
+                }
+            }
+            if ( linked )
+            {
+                node->release();
+            }
+            return true;
+        }
+
+        // 実行中なら, 次を積まないようにするだけ
+        if ( state == TimerNode::FIRING )
+        {
+            if ( node->state.compare_exchange_weak(state, TimerNode::CANCELLED, std::memory_order_acq_rel) )
+            {
+                return true;
+            }
+            continue;
+        }
+
+        return false;
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// 実行を終えたタイマーを次の期限で登録し直す (一度だけのものは終わりにする)
+inline void tapetums::ThreadPool::rearm_timer(detail::TimerNode* node)
+{
+    using detail::TimerNode;
+
+    if ( node->period == 0 )
+    {
+        auto expected = uint32_t(TimerNode::FIRING);
+        node->state.compare_exchange_strong(expected, TimerNode::DONE, std::memory_order_acq_rel);
+        node->release();
+        return;
+    }
+
+    bool rearmed { false };
+    bool earlier { false };
+    {
+        std::lock_guard<std::mutex> lock(m_timer_lock);
+
+        auto expected = uint32_t(TimerNode::FIRING);
+        if ( node->state.compare_exchange_strong(expected, TimerNode::PENDING, std::memory_order_acq_rel) )
+        {
+            const auto prev = m_next_timer.load(std::memory_order_relaxed);
+
+            // 元の周期を保つ. 遅れていれば飛ばした回の分は詰めずに次のティックにする
+            node->expiry = std::max(node->expiry + node->period, timer_now() + 1);
+            m_timers.insert(node);
+            publish_next_timer();
+
+            earlier = m_next_timer.load(std::memory_order_relaxed) < prev;
+            rearmed = true;
+        }
+    }
+
+    if ( ! rearmed )
+    {
+        // 実行中に取り消された
+        node->release();
+        return;
+    }
+    if ( earlier )
+    {
+        wake_timer_keeper();
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// 期限の来たタイマーをキューに積む. 積んだものがあれば true
+inline bool tapetums::ThreadPool::poll_timers()
+{
+    using detail::TimerNode;
+
+    const auto next = m_next_timer.load(std::memory_order_relaxed);
+    if ( next == NO_TIMER || clock::now().time_since_epoch().count() < next )
+    {
+        return false;
+    }
+
+    // タスクの実行や破棄はロックの外で行う
+    TimerNode* fired   { nullptr };
+    TimerNode* dropped { nullptr };
+    {
+        std::lock_guard<std::mutex> lock(m_timer_lock);
+
+        m_timers.advance(timer_now(), [&fired, &dropped](TimerWheelHook* hook)
+        {
+            const auto node = static_cast<TimerNode*>(hook);
+
+            auto expected = uint32_t(TimerNode::PENDING);
+            if ( node->state.compare_exchange_strong(expected, TimerNode::FIRING, std::memory_order_acq_rel) )
+            {
+                node->chain = fired;
+                fired = node;
+            }
+            else
+            {
+                node->chain = dropped;
+                dropped = node;
+            }
+        });
+        publish_next_timer();
+    }
+
+    while ( dropped )
+    {
+        const auto node = dropped;
+        dropped = node->chain;
+        node->release();
+    }
+
+    if ( fired == nullptr )
+    {
+        return false;
+    }
+    while ( fired )
+    {
+        const auto node = fired;
+        fired = node->chain;
+        submit_node(detail::new_node(Task(detail::TimerFire(node))), node->priority);
+    }
+
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::ThreadPool::clear_timers()
+{
+    detail::TimerNode* dropped { nullptr };
+    {
+        std::lock_guard<std::mutex> lock(m_timer_lock);
+
+        m_timers.clear([&dropped](TimerWheelHook* hook)
+        {
+            const auto node = static_cast<detail::TimerNode*>(hook);
+            node->state.store(detail::TimerNode::DONE, std::memory_order_release);
+            node->chain = dropped;
+            dropped = node;
+        });
+        publish_next_timer();
+    }
+
+    while ( dropped )
+    {
+        const auto node = dropped;
+        dropped = node->chain;
+        node->release();
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// ホイールの次の期限を公開する (m_timer_lock を持って呼ぶ)
+inline void tapetums::ThreadPool::publish_next_timer() noexcept
+{
+    const auto tick = m_timers.next_tick();
+    const auto next = (tick == TimerWheel::NEVER) ? NO_TIMER
+                    : (m_timer_epoch + TIMER_RESOLUTION(tick)).time_since_epoch().count();
+
+    // claim_timer_keeper() と対になる (番人が古い期限で眠るか, ここで番人が見えるかのどちらか)
+    m_next_timer.store(next, std::memory_order_seq_cst);
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::ThreadPool::wake_timer_keeper()
+{
+    if ( const auto keeper = m_timer_keeper.load(std::memory_order_seq_cst) )
+    {
+        keeper->m_parker.unpark();
+    }
+    else
+    {
+        // 番人がいなければ誰かを起こして番人になってもらう
+        notify(nullptr);
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// 眠る前に, タイマーがあれば一人だけ次の期限に起きる役を引き受ける
+inline bool tapetums::ThreadPool::claim_timer_keeper
+(
+    TaskWorker* worker, clock::time_point& wake_at
+)
+noexcept
+{
+    if ( m_next_timer.load(std::memory_order_relaxed) == NO_TIMER )
+    {
+        return false;
+    }
+
+    TaskWorker* expected { nullptr };
+    if ( ! m_timer_keeper.compare_exchange_strong(expected, worker, std::memory_order_seq_cst) )
+    {
+        return false;
+    }
+
+    const auto next = m_next_timer.load(std::memory_order_seq_cst);
+    if ( next == NO_TIMER )
+    {
+        m_timer_keeper.store(nullptr, std::memory_order_relaxed);
+        return false;
+    }
+
+    wake_at = clock::time_point(clock::duration(next));
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::ThreadPool::release_timer_keeper(TaskWorker* worker) noexcept
+{
+    auto expected = worker;
+    m_timer_keeper.compare_exchange_strong(expected, nullptr, std::memory_order_relaxed);
+}
+
+//---------------------------------------------------------------------------//
+
+// 今のティック (切り捨て)
+inline uint64_t tapetums::ThreadPool::timer_now() const noexcept
+{
+    const auto elapsed = clock::now() - m_timer_epoch;
+    return uint64_t(std::chrono::duration_cast<TIMER_RESOLUTION>(elapsed).count());
+}
+
+//---------------------------------------------------------------------------//
+
+// 時間をティック数に切り上げる
+inline uint64_t tapetums::ThreadPool::to_ticks(clock::duration d) noexcept
+{
+    if ( d <= clock::duration::zero() )
+    {
+        return 0;
+    }
+
+    const auto ticks = std::chrono::duration_cast<TIMER_RESOLUTION>(d);
+    return uint64_t(ticks.count()) + (ticks < d ? 1 : 0);
+}
+
+//---------------------------------------------------------------------------//
+
+inline bool tapetums::ThreadPool::has_task() const noexcept
+{
+    if ( m_deadline_count.load(std::memory_order_relaxed) > 0 )
+    {
+        return true;
+    }
+
+    for ( const auto& worker : m_workers )
+    {
+        if ( worker->has_task() )
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+
+// タスクを積んだ後に呼ぶ. 眠っているワーカーをひとつだけ起こす
+inline void tapetums::ThreadPool::notify(TaskWorker* preferred)
+{
+    // prepare_park() と対になるフェンス (積んだタスクか, 眠ったワーカーのどちらかが必ず見える)
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    // スピン中のワーカーがいればそちらが拾うので起こさない
+    // (拾ったワーカーはスピンをやめるときに代わりをひとり起こす. MainLoop)
+    if ( m_spinning.load(std::memory_order_relaxed) > 0 )
+    {
+        return;
+    }
+    if ( m_idle_count.load(std::memory_order_relaxed) == 0 )
+    {
+        // 全員が働いていて, 積まれたタスクが溜まってきたらワーカーを増やす
+        if ( preferred && preferred->task_count() > m_config.spawn_backlog )
+        {
+            grow(1);
+        }
+        return;
+    }
+
+    TaskWorker* worker { nullptr };
+    {
+        std::lock_guard<std::mutex> lock(m_idle_lock);
+
+        if ( m_idle.empty() )
+        {
+            return;
+        }
+
+        // タスクを積まれたワーカー自身が眠っていればそれを優先する
+        auto it = std::find(m_idle.begin(), m_idle.end(), preferred);
+        if ( it == m_idle.end() )
+        {
+            it = m_idle.end() - 1;
+        }
+        worker = *it;
+        m_idle.erase(it);
+        m_idle_count.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    worker->m_stats.wakes.fetch_add(1, std::memory_order_relaxed);
+    worker->m_parker.unpark();
+}
+
+//---------------------------------------------------------------------------//
+
+// まとめて積んだ後に呼ぶ. 眠っているワーカーを最大 count 個起こす
+inline void tapetums::ThreadPool::notify_many(size_t count)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    // スピン中のワーカーが拾う分は起こさなくてよい
+    const auto spinning = m_spinning.load(std::memory_order_relaxed);
+    if ( count <= spinning )
+    {
+        return;
+    }
+    count -= spinning;
+
+    if ( m_idle_count.load(std::memory_order_relaxed) == 0 )
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_idle_lock);
+
+    // 取り出したワーカーはロックを持ったまま起こす (Parker はこのロックを取らない)
+    count = std::min(count, m_idle.size());
+    for ( size_t i = 0; i < count; ++i )
+    {
+        m_idle.back()->m_stats.wakes.fetch_add(1, std::memory_order_relaxed);
+        m_idle.back()->m_parker.unpark();
+        m_idle.pop_back();
+    }
+    m_idle_count.fetch_sub(count, std::memory_order_relaxed);
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::ThreadPool::prepare_park(TaskWorker* worker)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_idle_lock);
+
+        m_idle.push_back(worker);
+        m_idle_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::ThreadPool::cancel_park(TaskWorker* worker)
+{
+    std::lock_guard<std::mutex> lock(m_idle_lock);
+
+    const auto it = std::find(m_idle.begin(), m_idle.end(), worker);
+    if ( it != m_idle.end() )
+    {
+        m_idle.erase(it);
+        m_idle_count.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+//---------------------------------------------------------------------------//
+// TaskWorker Methods
+//---------------------------------------------------------------------------//
+
+
+inline size_t tapetums::TaskWorker::task_count() const noexcept
+{
+    size_t count = m_inbox_count.load(std::memory_order_relaxed);
+    for ( const auto& lane : m_lanes )
+    {
+        count += lane.tasks.size();
+    }
+
+    return count;
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::TaskWorker::AddTask(Task&& task, PRIORITY priority)
+{
+    push_node(detail::new_node(std::move(task)), priority);
+}
+
+//---------------------------------------------------------------------------//
+
+inline tapetums::Task tapetums::TaskWorker::QueryTask()
+{
+    // 所有スレッド以外からは steal と同じ扱いにする
+    if ( ! is_owner() )
+    {
+        return StealTask();
+    }
+
+    for ( size_t i = 0; i < ThreadPool::PRIORITY_COUNT; ++i )
+    {
+        auto node = pop_node(static_cast<PRIORITY>(i));
+        if ( node )
+        {
+            auto task = std::move(node->task);
+            detail::delete_node(node);
+
+            return task;
+        }
+    }
+
+    return Task();
+}
+
+//---------------------------------------------------------------------------//
+
+inline tapetums::Task tapetums::TaskWorker::StealTask()
+{
+    for ( size_t i = 0; i < ThreadPool::PRIORITY_COUNT; ++i )
+    {
+        auto node = steal_node(static_cast<PRIORITY>(i));
+        if ( node )
+        {
+            auto task = std::move(node->task);
+            detail::delete_node(node);
+
+            return task;
+        }
+    }
+
+    return Task();
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::TaskWorker::Start()
+{
+    if ( is_running() )
+    {
+        if ( ! m_retired.load(std::memory_order_acquire) )
+        {
+            if ( is_paused() )
+            {
+                Resume();
+            }
+
+            return;
+        }
+
+        // 自分から退いたスレッドを回収してから起動し直す
+        m_thread.join();
+    }
+
+    m_retired.store(false, std::memory_order_relaxed);
+    m_working.store(true,  std::memory_order_relaxed);
+    m_stop.store   (false, std::memory_order_relaxed);
+    m_running.store(true,  std::memory_order_release);
+
+    m_thread = std::thread([this]()
+    {
+        if ( m_pool->config().pin_threads )
+        {
+            CpuTopology::Get().PinCurrentThread(m_cpu);
+        }
+
+        detail::current_worker() = this;
+
+        MainLoop();
+
+        detail::current_worker() = nullptr;
+    });
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::TaskWorker::Stop()
+{
+    if ( ! is_running() ) { return; }
+
+    m_stop.store(true, std::memory_order_release);
+    m_parker.unpark();
+
+    if ( m_thread.joinable() )
+    {
+        m_thread.join();
+    }
+
+    m_running.store(false, std::memory_order_release);
+
+    clear();
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::TaskWorker::Pause() noexcept
+{
+    m_working.store(false, std::memory_order_relaxed);
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::TaskWorker::Resume() noexcept
+{
+    m_working.store(true, std::memory_order_relaxed);
+
+    m_parker.unpark();
+}
+
+//---------------------------------------------------------------------------//
+// TaskWorker Inner Methods
+//---------------------------------------------------------------------------//
+
+inline bool tapetums::TaskWorker::has_task() const noexcept
+{
+    for ( const auto& lane : m_lanes )
+    {
+        if ( lane.inbox.load(std::memory_order_relaxed) != nullptr || ! lane.tasks.empty() )
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::TaskWorker::push_node(detail::TaskNode* node, PRIORITY priority)
+{
+    // Stop() 中は積まない (破棄されたタスクの継続が止めたワーカーに残らないように)
+    if ( m_pool->m_closing.load(std::memory_order_acquire) )
+    {
+        detail::delete_node(node);
+        return;
+    }
+
+    // 見つけられる前に数えておく (取り出した側が減らす)
+    if ( priority == PRIORITY::REALTIME )
+    {
+        m_pool->m_realtime_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if ( is_owner() )
+    {
+        auto& tasks = lane(priority).tasks;
+        tasks.push(node);
+
+        // 溜まり具合は所有スレッドが自分のレーンだけで測る (他のレーンや受付口は読まない)
+        detail::WorkerCounters::raise(m_stats.high_water, tasks.size());
+    }
+    else
+    {
+        push_inbox(priority, node, node, 1);
+    }
+
+    m_pool->notify(this);
+}
+
+//---------------------------------------------------------------------------//
+
+// head から tail へ next でつながったノード列を受付口に積む
+inline void tapetums::TaskWorker::push_inbox
+(
+    PRIORITY priority, detail::TaskNode* head, detail::TaskNode* tail, size_t count
+)
+{
+    m_inbox_count.fetch_add(count, std::memory_order_relaxed);
+
+    auto& inbox = lane(priority).inbox;
+    auto top = inbox.load(std::memory_order_relaxed);
+    do
+    {
+        tail->next = top;
+    }
+    while ( ! inbox.compare_exchange_weak
+    (
+        top, head, std::memory_order_release, std::memory_order_relaxed
+    ) );
+}
+
+//---------------------------------------------------------------------------//
+
+// 受付口のタスクを自分の両端キューに移す (所有スレッドのみ)
+inline bool tapetums::TaskWorker::drain_inbox(PRIORITY priority)
+{
+    auto& l = lane(priority);
+
+    auto node = l.inbox.exchange(nullptr, std::memory_order_acquire);
+    if ( node == nullptr )
+    {
+        return false;
+    }
+
+    // 受付口は新しい順に並んでいるので反転して古い順に積む
+    detail::TaskNode* prev { nullptr };
+    size_t count { 0 };
+    while ( node )
+    {
+        auto next = node->next;
+        node->next = prev;
+        prev = node;
+        node = next;
+        ++count;
+    }
+    for ( node = prev; node; )
+    {
+        auto next = node->next;
+        node->next = nullptr;
+        l.tasks.push(node);
+        node = next;
+    }
+
+    m_inbox_count.fetch_sub(count, std::memory_order_relaxed);
+
+    // 外から積まれた分は, ここで移した時に測る
+    detail::WorkerCounters::raise(m_stats.high_water, l.tasks.size());
+
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+
+inline tapetums::detail::TaskNode* tapetums::TaskWorker::pop_node(PRIORITY priority)
+{
+    auto& tasks = lane(priority).tasks;
+    detail::TaskNode* node;
+
+    // 両端キューの末尾から取得
+    if ( tasks.pop(node) || (drain_inbox(priority) && tasks.pop(node)) )
+    {
+        taken(priority);
+        return node;
+    }
+
+    return nullptr;
+}
+
+//---------------------------------------------------------------------------//
+
+inline tapetums::detail::TaskNode* tapetums::TaskWorker::steal_node(PRIORITY priority)
+{
+    auto& l = lane(priority);
+    detail::TaskNode* node;
+
+    // 両端キューの先頭から取得
+    if ( l.tasks.steal(node) )
+    {
+        taken(priority);
+        return node;
+    }
+
+    // 受付口からまとめて取り出し, 最も古いものだけを持っていく
+    auto head = l.inbox.exchange(nullptr, std::memory_order_acquire);
+    if ( head == nullptr )
+    {
+        return nullptr;
+    }
+
+    detail::TaskNode* prev { nullptr };
+    node = head;
+    size_t count { 0 };
+    while ( node->next )
+    {
+        prev = node;
+        node = node->next;
+        ++count;
+    }
+
+    m_inbox_count.fetch_sub(count + 1, std::memory_order_relaxed);
+    taken(priority);
+
+    if ( prev )
+    {
+        // 残りは受付口に戻す (その間に眠ったワーカーがいるかもしれないので起こす)
+        prev->next = nullptr;
+        push_inbox(priority, head, prev, count);
+        m_pool->notify(this);
+    }
+
+    return node;
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::TaskWorker::taken(PRIORITY priority) noexcept
+{
+    if ( priority == PRIORITY::REALTIME )
+    {
+        m_pool->m_realtime_count.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::TaskWorker::run(detail::TaskNode* node)
+{
+  #if defined(TASK_LATENCY)
+    const auto start = detail::now_ns();
+
+    node->task(*this);
+
+    const auto end = detail::now_ns();
+    m_stats.wait_latency[LatencyHistogram::bucket_of(uint64_t(start - node->enqueued))].fetch_add(1, std::memory_order_relaxed);
+    m_stats.run_latency [LatencyHistogram::bucket_of(uint64_t(end - start))].fetch_add(1, std::memory_order_relaxed);
+  #else
+    node->task(*this);
+  #endif
+
+    // 外部スレッドが代わりに実行することもあるので fetch_add で数える
+    m_stats.executed.fetch_add(1, std::memory_order_relaxed);
+
+    detail::delete_node(node);
+}
+
+//---------------------------------------------------------------------------//
+
+// タスクをひとつだけ実行する (待機中のスレッドが手伝うときに使う)
+inline bool tapetums::TaskWorker::run_one()
+{
+    TaskWorker* victim { nullptr };
+    const auto node = m_pool->find_node(this, &victim);
+    if ( node == nullptr )
+    {
+        return false;
+    }
+
+    run(node);
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+
+// 残っているタスクを破棄する (steal は任意のスレッドから呼べる)
+inline void tapetums::TaskWorker::clear()
+{
+    for ( size_t i = 0; i < ThreadPool::PRIORITY_COUNT; ++i )
+    {
+        while ( auto node = steal_node(static_cast<PRIORITY>(i)) )
+        {
+            detail::delete_node(node);
+        }
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::TaskWorker::MainLoop()
+{
+    const auto& config = m_pool->config();
+    const auto max_spin  = config.spin_count;
+    const auto max_yield = config.spin_count + config.yield_count;
+
+    uint32_t idle_rounds { 0 };
+    uint32_t run_count   { 0 };
+    while ( ! m_stop.load(std::memory_order_acquire) )
+    {
+        if ( ! m_working.load(std::memory_order_relaxed) )
+        {
+            if ( idle_rounds > 0 )
+            {
+                m_pool->m_spinning.fetch_sub(1, std::memory_order_relaxed);
+                idle_rounds = 0;
+            }
+
+            // 一時停止中は Resume() か Stop() まで眠る
+            m_parker.park();
+            continue;
+        }
+
+        // BlockingRegion が終わって余ったら, 代わりに起動されたワーカーが退く
+        if ( m_spare.load(std::memory_order_relaxed) &&
+             m_pool->m_surplus.load(std::memory_order_relaxed) > 0 && m_pool->retire(this, true) )
+        {
+            break;
+        }
+
+        // 優先度の高いレーンから, 自分のキュー → 他人のキューの順にタスクを探す
+        TaskWorker* victim { nullptr };
+        auto node = m_pool->find_node(this, &victim);
+
+        if ( node )
+        {
+            // スピンをやめて働き始めるので, 後から積まれる分のために眠っている仲間をひとり起こす
+            if ( idle_rounds > 0 )
+            {
+                m_pool->m_spinning.fetch_sub(1, std::memory_order_relaxed);
+                idle_rounds = 0;
+
+                m_pool->notify(nullptr);
+            }
+
+            run(node);
+
+            // 忙しい間も 64 個ごとにタイマーの期限を確かめる
+            if ( (++run_count & 63) == 0 )
+            {
+                m_pool->poll_timers();
+            }
+            continue;
+        }
+
+        // 期限の来たタイマーがあれば積んでから探し直す
+        if ( idle_rounds == 0 && m_pool->poll_timers() )
+        {
+            continue;
+        }
+
+        // 見つからなければ, しばらくスピン → yield してから眠る
+        if ( idle_rounds == 0 )
+        {
+            m_pool->m_spinning.fetch_add(1, std::memory_order_relaxed);
+        }
+        if ( idle_rounds < max_spin )
+        {
+            const auto pause_count = 1u << std::min(idle_rounds, 6u);
+            for ( uint32_t i = 0; i < pause_count; ++i )
+            {
+                detail::cpu_relax();
+            }
+            ++idle_rounds;
+            continue;
+        }
+        if ( idle_rounds < max_yield )
+        {
+            std::this_thread::yield();
+            ++idle_rounds;
+            continue;
+        }
+
+        m_pool->m_spinning.fetch_sub(1, std::memory_order_relaxed);
+        idle_rounds = 0;
+
+        // 眠る前に登録し, 取りこぼしたタスクがないかもう一度確かめる
+        m_pool->prepare_park(this);
+        if ( m_stop.load(std::memory_order_acquire) ||
+             ! m_working.load(std::memory_order_relaxed) ||
+             m_pool->has_task() )
+        {
+            m_pool->cancel_park(this);
+            continue;
+        }
+
+        // タイマーの番人は次の期限に, 伸縮するプールは idle_timeout で起きる
+        auto wake_at    = ThreadPool::clock::time_point::max();
+        auto idle_limit = ThreadPool::clock::time_point::max();
+        const auto keeper = m_pool->claim_timer_keeper(this, wake_at);
+        if ( m_pool->is_elastic() )
+        {
+            idle_limit = ThreadPool::clock::now() + config.idle_timeout;
+        }
+
+        const auto park_start = detail::now_ns();
+        bool timed_out { false };
+        if ( keeper || m_pool->is_elastic() )
+        {
+            const auto notified = m_parker.park_until(std::min(wake_at, idle_limit));
+            timed_out = ! notified && ThreadPool::clock::now() >= idle_limit;
+        }
+        else
+        {
+            m_parker.park();
+        }
+        detail::WorkerCounters::add(m_stats.idle_ns, uint64_t(detail::now_ns() - park_start));
+        detail::WorkerCounters::add(m_stats.parks);
+
+        if ( keeper )
+        {
+            m_pool->release_timer_keeper(this);
+        }
+        m_pool->cancel_park(this);
+
+        // 長く仕事がなければ退く
+        if ( timed_out && m_pool->retire(this, false) )
+        {
+            break;
+        }
+    }
+
+    if ( idle_rounds > 0 )
+    {
+        m_pool->m_spinning.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+//---------------------------------------------------------------------------//
+// TimerHandle Methods
+//---------------------------------------------------------------------------//
+
+// 以降は実行しない (実行中のものは止めない). 既に終わっていれば false
+inline bool tapetums::TimerHandle::Cancel()
+{
+    return m_node && m_node->pool->cancel_timer(m_node);
+}
+
+//---------------------------------------------------------------------------//
+// TimerFire Methods
+//---------------------------------------------------------------------------//
+
+inline tapetums::detail::TimerFire::~TimerFire()
+{
+    if ( m_node )
+    {
+        m_node->state.store(TimerNode::DONE, std::memory_order_release);
+        m_node->release();
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::TimerFire::operator()(TaskWorker& worker)
+{
+    // 積まれてから取り消されたものは実行しない
+    if ( m_node->state.load(std::memory_order_acquire) != TimerNode::CANCELLED )
+    {
+        m_node->task(worker);
+    }
+
+    const auto node = m_node;
+    m_node = nullptr;
+    node->pool->rearm_timer(node);
+}
+
+//---------------------------------------------------------------------------//
+// FutureStateBase
+//  future と, 値を書き込むタスクとで共有する状態
+//---------------------------------------------------------------------------//
+
+class tapetums::detail::FutureStateBase
+{
+private:
+    ThreadPool* m_pool;
+
+    std::atomic<uint32_t>  m_refs     { 1 };
+    std::atomic<uint32_t>  m_promises { 0 };
+    std::atomic<uint32_t>  m_waiters  { 0 };
+    std::atomic<TaskNode*> m_next     { nullptr }; // 継続タスク (完了後は ready_tag())
+
+protected:
+    std::exception_ptr m_error;
+    bool               m_broken { false }; // 例外は get() で作る (release_promise() で確保しないように)
+
+protected:
+    explicit FutureStateBase(ThreadPool* pool) noexcept : m_pool(pool) { }
+    virtual ~FutureStateBase() = default;
+
+    virtual void destroy() noexcept = 0;
+
+public:
+    FutureStateBase(const FutureStateBase&)             = delete;
+    FutureStateBase& operator =(const FutureStateBase&) = delete;
+
+public:
+    ThreadPool* pool() const noexcept { return m_pool; }
+
+    bool is_ready() const noexcept
+    {
+        return m_next.load(std::memory_order_acquire) == ready_tag();
+    }
+
+public:
+    void add_ref() noexcept
+    {
+        m_refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release() noexcept
+    {
+        if ( m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1 )
+        {
+            destroy();
+        }
+    }
+
+    void add_promise() noexcept
+    {
+        m_promises.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release_promise() noexcept;
+
+public:
+    void attach(TaskNode* node);
+    void wait  ();
+
+protected:
+    void complete();
+    void rethrow_if_error() const;
+
+private:
+    static TaskNode* ready_tag() noexcept
+    {
+        return reinterpret_cast<TaskNode*>(uintptr_t(1));
+    }
+};
+
+//---------------------------------------------------------------------------//
+
+// 値を書き込む側が全ていなくなったのに完了していなければ broken_promise にする
+inline void tapetums::detail::FutureStateBase::release_promise() noexcept
+{
+    if ( m_promises.fetch_sub(1, std::memory_order_acq_rel) != 1 )
+    {
+        return;
+    }
+    if ( is_ready() )
+    {
+        return;
+    }
+
+    m_broken = true;
+    complete();
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::FutureStateBase::rethrow_if_error() const
+{
+    if ( m_error )
+    {
+        std::rethrow_exception(m_error);
+    }
+    if ( m_broken )
+    {
+        throw std::future_error(std::future_errc::broken_promise);
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// 継続タスクを登録する. 既に完了していればすぐに投入する
+inline void tapetums::detail::FutureStateBase::attach(TaskNode* node)
+{
+    TaskNode* expected { nullptr };
+    if ( m_next.compare_exchange_strong
+    (
+        expected, node, std::memory_order_acq_rel, std::memory_order_acquire
+    ) )
+    {
+        return;
+    }
+
+    m_pool->submit_node(node);
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::FutureStateBase::wait()
+{
+    while ( ! is_ready() )
+    {
+        // 同じプールのワーカーなら, 待つ間も他のタスクを片付ける
+        const auto self = current_worker();
+        const auto helper = (self && self->m_pool == m_pool) ? self : nullptr;
+        if ( helper && helper->run_one() )
+        {
+            continue;
+        }
+
+        auto& bucket = wait_bucket(this);
+        std::unique_lock<std::mutex> lock(bucket.mutex);
+
+        m_waiters.fetch_add(1, std::memory_order_seq_cst);
+        if ( m_next.load(std::memory_order_seq_cst) != ready_tag() )
+        {
+            if ( helper )
+            {
+                // 新しいタスクが積まれるかもしれないので時々見に行く
+                bucket.cv.wait_for(lock, std::chrono::milliseconds(1));
+            }
+            else
+            {
+                bucket.cv.wait(lock);
+            }
+        }
+        m_waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::detail::FutureStateBase::complete()
+{
+    const auto next = m_next.exchange(ready_tag(), std::memory_order_seq_cst);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if ( m_waiters.load(std::memory_order_relaxed) > 0 )
+    {
+        auto& bucket = wait_bucket(this);
+        {
+            std::lock_guard<std::mutex> lock(bucket.mutex);
+        }
+        bucket.cv.notify_all();
+    }
+
+    // 継続は完了させたワーカー自身のキューに積む (キャッシュが温かいうちに)
+    if ( next )
+    {
+        m_pool->submit_node(next);
+    }
+}
+
+//---------------------------------------------------------------------------//
+// FutureState
+//---------------------------------------------------------------------------//
+
+template<typename R>
+class tapetums::detail::FutureState final : public FutureStateBase
+{
+    static_assert(! std::is_reference<R>::value, "R must not be a reference");
+    static_assert(alignof(R) <= alignof(std::max_align_t), "R is over-aligned");
 
 private:
-    CS::Lock m_lock;
-    std::vector<TaskWorker> m_workers;
-    size_t index { 0 };
+    typename std::aligned_storage<sizeof(R), alignof(R)>::type m_value;
+    bool m_has_value { false };
 
-public:
-    explicit ThreadPool(size_t worker_count);
+private:
+    explicit FutureState(ThreadPool* pool) noexcept : FutureStateBase(pool) { }
+
+    ~FutureState()
+    {
+        if ( m_has_value ) { value().~R(); }
+    }
 
 public:
-    ThreadPool() = delete;
+    static FutureState* create(ThreadPool* pool)
+    {
+        const auto p = pool->m_slab->allocate(sizeof(FutureState));
+        return new (p) FutureState(pool);
+    }
 
-    ThreadPool(const ThreadPool&) = delete;
-    ThreadPool& operator=(const ThreadPool&) = delete;
+public:
+    template<typename F>
+    void run(F& f)
+    {
+        try
+        {
+            new (&m_value) R(f());
+            m_has_value = true;
+        }
+        catch ( ... )
+        {
+            m_error = std::current_exception();
+        }
 
-    ThreadPool(ThreadPool&& rhs) noexcept = default;
-    ThreadPool& operator=(ThreadPool&&) noexcept = default;
+        complete();
+    }
 
-    ~ThreadPool() { Stop(); }
+    R get()
+    {
+        wait();
 
-public:
-    size_t worker_count() const noexcept { return m_workers.size(); }
+        rethrow_if_error();
 
-public:
-    void AddTask  (const Task& task);
-    void AddTask  (Task&& task);
-    Task QueryTask();
-    void Start    ();
-    void Stop     ();
-    void Pause    () noexcept;
-    void Resume   () noexcept;
+        return std::move(value());
+    }
 
 private:
-    void next_worker()
+    R& value() noexcept { return *reinterpret_cast<R*>(&m_value); }
+
+    void destroy() noexcept override
     {
-        ++index;
-        if ( index >= worker_count() )
-        {
-            index = 0;
-        }
+        this->~FutureState();
+        Slab::deallocate(this);
     }
 };
 
-//---------------------------------------------------------------------------//
-// ThreadPool ctor
 //---------------------------------------------------------------------------//
 
-inline tapetums::ThreadPool::ThreadPool(size_t worker_count)
+template<>
+class tapetums::detail::FutureState<void> final : public FutureStateBase
 {
-    SYSTEM_INFO si { };
-    ::GetNativeSystemInfo(&si);
-    const auto num_procs = si.dwNumberOfProcessors;
-    const auto max_count = num_procs * MAX_THREADS_PER_PROCESSOR;
+private:
+    explicit FutureState(ThreadPool* pool) noexcept : FutureStateBase(pool) { }
+    ~FutureState() = default;
 
-    size_t count;
-    if ( worker_count == 0 )
+public:
+    static FutureState* create(ThreadPool* pool)
     {
-        count = num_procs;
+        const auto p = pool->m_slab->allocate(sizeof(FutureState));
+        return new (p) FutureState(pool);
     }
-    else if ( worker_count > max_count )
+
+public:
+    template<typename F>
+    void run(F& f)
     {
-        count = max_count;
+        try
+        {
+            f();
+        }
+        catch ( ... )
+        {
+            m_error = std::current_exception();
+        }
+
+        complete();
     }
-    else
+
+    void get()
     {
-        count = worker_count;
+        wait();
+
+        rethrow_if_error();
     }
 
-    while ( count-- )
+private:
+    void destroy() noexcept override
     {
-        m_workers.push_back(TaskWorker(this));
+        this->~FutureState();
+        Slab::deallocate(this);
     }
-}
+};
 
 //---------------------------------------------------------------------------//
-// ThreadPool Methods
+// Promise
+//  値を書き込む側が持つ参照
 //---------------------------------------------------------------------------//
 
-inline void tapetums::ThreadPool::AddTask(const Task& task)
+template<typename R>
+class tapetums::detail::Promise final
 {
-    CS::LockGuard guard(m_lock);
+private:
+    FutureState<R>* m_state { nullptr };
 
-    m_workers[index].AddTask(task);
+public:
+    explicit Promise(FutureState<R>* state) noexcept : m_state(state)
+    {
+        m_state->add_ref();
+        m_state->add_promise();
+    }
 
-    next_worker();
-}
+    Promise(Promise&& rhs) noexcept : m_state(rhs.m_state)
+    {
+        rhs.m_state = nullptr;
+    }
+
+    Promise& operator =(const Promise&) = delete;
+    Promise& operator =(Promise&&)      = delete;
+
+    ~Promise()
+    {
+        if ( m_state )
+        {
+            m_state->release_promise();
+            m_state->release();
+        }
+    }
 
+public:
+    template<typename F>
+    void run(F& f) { m_state->run(f); }
+};
+
+//---------------------------------------------------------------------------//
+// future Class
+//  ThreadPool::Submit() の結果を受け取る
 //---------------------------------------------------------------------------//
 
-inline void tapetums::ThreadPool::AddTask(Task&& task)
+template<typename R>
+class tapetums::future final
 {
-    CS::LockGuard guard(m_lock);
+    friend class ThreadPool;
+    friend struct detail::CoroutineBridge;
+    template<typename> friend class future;
 
-    m_workers[index].AddTask(std::move(task));
+private:
+    detail::FutureState<R>* m_state { nullptr };
 
-    next_worker();
-}
+private:
+    explicit future(detail::FutureState<R>* state) noexcept : m_state(state) { }
 
-//---------------------------------------------------------------------------//
+public:
+    future() noexcept = default;
 
-inline tapetums::Task tapetums::ThreadPool::QueryTask()
-{
-    CS::LockGuard guard(m_lock);
+    future(const future&)             = delete;
+    future& operator =(const future&) = delete;
 
-    const auto count = m_workers.size();
-    for ( size_t i = 0; i < count; ++i )
+    future(future&& rhs) noexcept : m_state(rhs.m_state) { rhs.m_state = nullptr; }
+    future& operator =(future&& rhs) noexcept
     {
-        auto task = m_workers[index].StealTask();
-        if ( static_cast<bool>(task) )
+        if ( this != &rhs )
         {
-            return task;
+            reset();
+            m_state = rhs.m_state;
+            rhs.m_state = nullptr;
         }
-
-        next_worker();
+        return *this;
     }
 
-    return task_null;
-}
+    ~future() { reset(); }
 
-//---------------------------------------------------------------------------//
+public:
+    bool valid   () const noexcept { return m_state != nullptr; }
+    bool is_ready() const noexcept { return m_state && m_state->is_ready(); }
 
-inline void tapetums::ThreadPool::Start()
-{
-    for ( auto& worker : m_workers )
+public:
+    void wait() const { if ( m_state ) { m_state->wait(); } }
+    R    get ();
+
+    template<typename F>
+    auto then(F&& f) -> future<detail::result_t<F, future<R>>>;
+
+public:
+    // co_await で完了を待つ. 完了させたワーカーで再開する (Coroutine.hpp)
+    bool await_ready() const noexcept { return is_ready(); }
+
+    template<typename Handle>
+    void await_suspend(Handle handle)
     {
-        worker.Start();
+        m_state->attach(detail::new_node(detail::ResumeTask<Handle>(handle)));
     }
-}
 
-//---------------------------------------------------------------------------//
+    R await_resume() { return get(); }
 
-inline void tapetums::ThreadPool::Stop()
-{
-    for ( auto& worker : m_workers )
+private:
+    void reset() noexcept
     {
-        worker.Stop();
+        if ( m_state )
+        {
+            m_state->release();
+            m_state = nullptr;
+        }
     }
+};
+
+//---------------------------------------------------------------------------//
+// future Methods
+//---------------------------------------------------------------------------//
+
+// 値を取り出す. 完了していなければ待つ (future は無効になる)
+template<typename R>
+inline R tapetums::future<R>::get()
+{
+    future self(std::move(*this));
+
+    return self.m_state->get();
 }
 
 //---------------------------------------------------------------------------//
 
-inline void tapetums::ThreadPool::Pause() noexcept
+// 完了後に f(future<R>) を実行する (future は無効になる)
+// 継続は親を完了させたワーカーで実行される
+template<typename R>
+template<typename F>
+inline auto tapetums::future<R>::then(F&& f)
+    -> future<detail::result_t<F, future<R>>>
 {
-    for ( auto& worker : m_workers )
-    {
-        worker.Pause();
-    }
+    using R2 = detail::result_t<F, future<R>>;
+
+    const auto parent = m_state;
+    m_state = nullptr;
+
+    const auto state = detail::FutureState<R2>::create(parent->pool());
+    detail::Promise<R2> promise(state);
+
+    const auto node = detail::new_node
+    (
+        [promise = std::move(promise), self = future(parent), fn = std::forward<F>(f)]
+        (TaskWorker&) mutable
+        {
+            auto call = [&]() { return fn(std::move(self)); };
+            promise.run(call);
+        }
+    );
+    parent->attach(node);
+
+    return future<R2>(state);
 }
 
+//---------------------------------------------------------------------------//
+// Helper Functions
 //---------------------------------------------------------------------------//
 
-inline void tapetums::ThreadPool::Resume() noexcept
+// pred() が真になるまで, プールのタスクを手伝いながら待つ
+template<typename Pred>
+inline void tapetums::detail::help_until(ThreadPool& pool, Pred&& pred)
 {
-    for ( auto& worker : m_workers )
+    uint32_t idle_rounds { 0 };
+    while ( ! pred() )
     {
-        worker.Resume();
+        if ( pool.RunPendingTask() )
+        {
+            idle_rounds = 0;
+            continue;
+        }
+
+        // 手伝えるタスクがない (他のスレッドで実行中) ので少し待つ
+        if ( idle_rounds < 64 )
+        {
+            cpu_relax();
+        }
+        else
+        {
+            std::this_thread::yield();
+        }
+        ++idle_rounds;
     }
 }
 
 //---------------------------------------------------------------------------//
-// TaskWorker Class
+// TaskGroup Class
+//  まとめて投入したタスクの完了を待つ
+//  Wait() は完了を待つ間, 呼び出し元のスレッドでプールのタスクを実行する
+//  Stop() で実行されずに破棄されたタスクも終わったものとして数える
 //---------------------------------------------------------------------------//
 
-class tapetums::TaskWorker final
+class tapetums::TaskGroup final
 {
-    friend class ThreadPool; // インスタンスを生成できるのは ThreadPool だけ
+    template<typename> friend class detail::GroupTask;
 
 private:
-    ThreadPool* m_pool { nullptr };
+    // co_await で待っているコルーチンがいれば m_pending に立てる印
+    static constexpr size_t AWAITING { size_t(1) << (sizeof(size_t) * 8 - 1) };
 
-    bool  m_working   { false };
-    DWORD m_thread_id { 0 };
+    ThreadPool& m_pool;
 
-    CS::Lock m_lock;
-    std::thread m_thread;
-    std::deque<Task> m_tasks;
-
-private:
-    explicit TaskWorker(ThreadPool* pool) : m_pool(pool) { }
+    std::atomic<size_t> m_pending   { 0 };
+    std::atomic<bool>   m_has_error { false };
+    std::atomic<bool>   m_broken    { false }; // 実行されずに破棄されたタスクがある
+    std::exception_ptr  m_error;
+    Task                m_continuation;
 
 public:
-    TaskWorker() = delete;
+    explicit TaskGroup(ThreadPool& pool) noexcept : m_pool(pool) { }
 
-    TaskWorker(const TaskWorker&) = delete;
-    TaskWorker& operator=(const TaskWorker&) = delete;
+    TaskGroup() = delete;
 
-    TaskWorker(TaskWorker&& rhs) noexcept { swap(std::move(rhs)); }
-    TaskWorker& operator=(TaskWorker&& rhs) noexcept { swap(std::move(rhs)); return *this; }
+    TaskGroup(const TaskGroup&)             = delete;
+    TaskGroup& operator =(const TaskGroup&) = delete;
 
-    ~TaskWorker() { Stop(); }
+    // 実行中のタスクがグループのアドレスを参照しているためムーブできない
+    TaskGroup(TaskGroup&&)             = delete;
+    TaskGroup& operator =(TaskGroup&&) = delete;
 
-private:
-    void swap(TaskWorker&& rhs) noexcept;
+    ~TaskGroup() { wait_all(); }
 
 public:
-    bool   empty     () const noexcept { return m_tasks.empty(); }
-    bool   is_paused () const noexcept { return ! m_working; }
-    bool   is_running() const noexcept { return m_thread_id != 0; }
-    size_t task_count() const noexcept { return m_tasks.size(); }
-    DWORD  thread_id () const noexcept { return m_thread_id; }
+    ThreadPool& pool   () const noexcept { return m_pool; }
+    size_t      pending() const noexcept { return m_pending.load(std::memory_order_acquire) & ~AWAITING; }
 
 public:
-    void AddTask  (const Task& task);
-    void AddTask  (Task&& task);
-    Task QueryTask();
-    Task StealTask();
-    void Start    ();
-    void Stop     ();
-    void Pause    () noexcept;
-    void Resume   () noexcept;
+    template<typename F>
+    void AddTask(F&& f, PRIORITY priority = PRIORITY::NORMAL);
+    void Wait   ();
+
+public:
+    // co_await group; で全てのタスクの完了を待つ. 最後のタスクを終えたワーカーで再開する (Coroutine.hpp)
+    // 待っている間に同じグループへタスクを追加してはいけない
+    bool await_ready() const noexcept { return pending() == 0; }
+
+    template<typename Handle>
+    bool await_suspend(Handle handle);
+
+    void await_resume() { rethrow_error(); }
 
 private:
-    void MainLoop();
+    void wait_all() noexcept;
+    void finish  () noexcept;
+    void abandon () noexcept;
+    void rethrow_error();
 };
 
 //---------------------------------------------------------------------------//
-// TaskWorker move ctor
-//  std::deque が noexcept な move ctor を持っていないため 定義が必要
+// GroupTask
+//  TaskGroup に積むタスク
+//  実行されずに破棄されたら (Stop() など), グループに知らせて待ちを終わらせる
 //---------------------------------------------------------------------------//
 
-inline void tapetums::TaskWorker::swap(TaskWorker&& rhs) noexcept
+template<typename F>
+class tapetums::detail::GroupTask final
 {
-    if ( this == &rhs ) { return; }
+private:
+    TaskGroup* m_group;
+    F          m_fn;
 
-    std::swap(m_pool,      rhs.m_pool);
-    std::swap(m_working,   rhs.m_working);
-    std::swap(m_thread_id, rhs.m_thread_id);
-    std::swap(m_lock,      rhs.m_lock);
-    std::swap(m_thread,    rhs.m_thread);
-    std::swap(m_tasks,     rhs.m_tasks);
-}
+public:
+    template<typename G>
+    GroupTask(TaskGroup* group, G&& fn) : m_group(group), m_fn(std::forward<G>(fn)) { }
+
+    GroupTask(GroupTask&& rhs) noexcept(std::is_nothrow_move_constructible<F>::value)
+        : m_group(rhs.m_group), m_fn(std::move(rhs.m_fn)) { rhs.m_group = nullptr; }
+
+    GroupTask& operator =(GroupTask&&) = delete;
+
+    ~GroupTask() { if ( m_group ) { m_group->abandon(); } }
+
+    void operator()(TaskWorker& worker)
+    {
+        const auto group = m_group;
+        m_group = nullptr;
+
+        try
+        {
+            m_fn(worker);
+        }
+        catch ( ... )
+        {
+            // 最初の例外だけを覚えておく
+            bool expected { false };
+            if ( group->m_has_error.compare_exchange_strong(expected, true) )
+            {
+                group->m_error = std::current_exception();
+            }
+        }
+
+        group->finish();
+    }
+};
 
 //---------------------------------------------------------------------------//
-// TaskWorker Methods
+// TaskGroup Methods
 //---------------------------------------------------------------------------//
 
-inline void tapetums::TaskWorker::AddTask(const Task& task)
+// f(TaskWorker&) をグループのタスクとして投入する
+template<typename F>
+inline void tapetums::TaskGroup::AddTask(F&& f, PRIORITY priority)
 {
-    CS::LockGuard guard(m_lock);
+    m_pending.fetch_add(1, std::memory_order_relaxed);
 
-    m_tasks.push_back(task);
+    m_pool.AddTask(detail::GroupTask<typename std::decay<F>::type>(this, std::forward<F>(f)), priority);
 }
 
 //---------------------------------------------------------------------------//
 
-inline void tapetums::TaskWorker::AddTask(Task&& task)
+// 全てのタスクが終わるまで待つ. タスクが例外を投げていれば再送出する
+// 実行されずに破棄されたタスクがあれば future_error (broken_promise) を投げる
+inline void tapetums::TaskGroup::Wait()
 {
-    CS::LockGuard guard(m_lock);
-
-    m_tasks.push_back(std::move(task));
+    wait_all();
+    rethrow_error();
 }
 
 //---------------------------------------------------------------------------//
 
-inline tapetums::Task tapetums::TaskWorker::QueryTask()
+template<typename Handle>
+inline bool tapetums::TaskGroup::await_suspend(Handle handle)
 {
-    CS::LockGuard guard(m_lock);
+    m_continuation = Task(detail::ResumeTask<Handle>(handle));
 
-    if ( m_tasks.empty() )
+    // 印を付けた時点で残っていれば, 最後の finish() が再開する
+    if ( (m_pending.fetch_or(AWAITING, std::memory_order_acq_rel) & ~AWAITING) != 0 )
     {
-        return task_null;
+        return true;
     }
 
-    // キューの先頭から取得
-    auto task = m_tasks.front();
-    m_tasks.pop_front();
-
-    return task;
+    // 既に終わっていたのでそのまま続ける
+    m_pending.fetch_and(~AWAITING, std::memory_order_relaxed);
+    m_continuation = Task();
+    return false;
 }
 
+//---------------------------------------------------------------------------//
+// TaskGroup Inner Methods
 //---------------------------------------------------------------------------//
 
-inline tapetums::Task tapetums::TaskWorker::StealTask()
+inline void tapetums::TaskGroup::rethrow_error()
 {
-    CS::LockGuard guard(m_lock);
+    if ( m_has_error.load(std::memory_order_acquire) )
+    {
+        auto error = std::move(m_error);
+        m_error = nullptr;
+        m_has_error.store(false, std::memory_order_relaxed);
+
+        std::rethrow_exception(error);
+    }
 
-    if ( m_tasks.empty() )
+    if ( m_broken.load(std::memory_order_acquire) )
     {
-        return task_null;
+        m_broken.store(false, std::memory_order_relaxed);
+
+        throw std::future_error(std::future_errc::broken_promise);
     }
+}
 
-    // キューの末尾から取得
-    auto task = m_tasks.back();
-    m_tasks.pop_back();
+//---------------------------------------------------------------------------//
 
-    return task;
+inline void tapetums::TaskGroup::wait_all() noexcept
+{
+    detail::help_until(m_pool, [this]() { return pending() == 0; });
 }
 
 //---------------------------------------------------------------------------//
 
-inline void tapetums::TaskWorker::Start()
+inline void tapetums::TaskGroup::finish() noexcept
 {
-    if ( is_running() )
+    // 待っているコルーチンがいなければ, 減らした後はグループに触れない (Wait() を抜けて破棄されうる)
+    if ( m_pending.fetch_sub(1, std::memory_order_acq_rel) != (AWAITING | 1) )
     {
-        if ( is_paused() )
-        {
-            Resume();
-        }
-
         return;
     }
 
-    m_working = true;
-
-    m_thread = std::thread([this]()
-    {
-        m_thread_id = ::GetCurrentThreadId();
-
-        MainLoop();
+    // 待っているコルーチンは再開するまでグループを破棄しない
+    auto continuation = std::move(m_continuation);
+    m_pending.fetch_and(~AWAITING, std::memory_order_relaxed);
+    m_pool.AddTask(std::move(continuation));
+}
 
-        m_thread_id = 0;
-    });
+//---------------------------------------------------------------------------//
 
-    while ( ! is_running() ) { ::Sleep(0); }
+// 実行されずに破棄されたタスクの分 (GroupTask)
+inline void tapetums::TaskGroup::abandon() noexcept
+{
+    m_broken.store(true, std::memory_order_release);
+    finish();
 }
 
+//---------------------------------------------------------------------------//
+// ThreadPool Template Methods
 //---------------------------------------------------------------------------//
 
-inline void tapetums::TaskWorker::Stop()
+// [first, last) のタスクをまとめて投入する (要素はムーブされる)
+// ワーカーごとに連続したひと塊を作り, 受付口への 1 回の CAS で渡す
+template<typename It>
+inline void tapetums::ThreadPool::AddTasks(It first, It last, PRIORITY priority)
 {
-    if ( ! is_running() ) { return; }
+    const auto total = static_cast<size_t>(std::distance(first, last));
+    if ( total == 0 )
+    {
+        return;
+    }
 
-    ::PostThreadMessage(m_thread_id, WM_QUIT, 0, 0);
+    const auto count  = is_elastic() ? std::max(active_count(), size_t(1)) : worker_count();
+    const auto chunks = std::min(count, total);
 
-    if ( m_thread.joinable() )
+    size_t rest = total;
+    for ( size_t i = 0; i < chunks; ++i )
     {
-        m_thread.join();
+        const auto size = rest / (chunks - i);
+        rest -= size;
+
+        // 受付口は新しい順に並ぶので, 後ろのタスクが先頭に来るようにつなぐ
+        detail::TaskNode* head { nullptr };
+        detail::TaskNode* tail { nullptr };
+        for ( size_t n = 0; n < size; ++n, ++first )
+        {
+            const auto node = detail::new_node(std::move(*first));
+            node->next = head;
+            head = node;
+            if ( tail == nullptr ) { tail = node; }
+        }
+
+        // Stop() 中は積まない (push_node と同じ)
+        if ( m_closing.load(std::memory_order_acquire) )
+        {
+            while ( head )
+            {
+                const auto next = head->next;
+                detail::delete_node(head);
+                head = next;
+            }
+            continue;
+        }
+
+        // 見つけられる前に数えておく (取り出した側が減らす)
+        if ( priority == PRIORITY::REALTIME )
+        {
+            m_realtime_count.fetch_add(size, std::memory_order_relaxed);
+        }
+
+        const auto worker = pick_worker();
+        worker->push_inbox(priority, head, tail, size);
     }
 
-    m_tasks.clear();
-}
+    if ( m_closing.load(std::memory_order_acquire) )
+    {
+        return;
+    }
 
-//---------------------------------------------------------------------------//
+    notify_many(chunks);
 
-inline void tapetums::TaskWorker::Pause() noexcept
-{
-    m_working = false;
+    // ワーカーひとつあたり spawn_backlog 個を超えるようなら増やす
+    const auto wanted = total / std::max(m_config.spawn_backlog, 1u);
+    if ( wanted > count )
+    {
+        grow(wanted - count);
+    }
 }
 
 //---------------------------------------------------------------------------//
 
-inline void tapetums::TaskWorker::Resume() noexcept
+template<typename Range>
+inline void tapetums::ThreadPool::AddTasks(Range&& tasks, PRIORITY priority)
 {
-    m_working = true;
+    using std::begin;
+    using std::end;
 
-    ::PostThreadMessage(m_thread_id, WM_NULL, 0, 0);
+    AddTasks(begin(tasks), end(tasks), priority);
 }
 
-//---------------------------------------------------------------------------//
-// TaskWorker Inner Methods
 //---------------------------------------------------------------------------//
 
-inline void tapetums::TaskWorker::MainLoop()
+// f() をタスクとして投入し, その戻り値を future で受け取る
+template<typename F>
+inline auto tapetums::ThreadPool::Submit(F&& f, PRIORITY priority)
+    -> future<detail::result_t<F>>
 {
-    MSG msg;
-    for ( ; ; )
+    using R = detail::result_t<F>;
+
+    const auto state = detail::FutureState<R>::create(this);
+    detail::Promise<R> promise(state);
+
+    AddTask([promise = std::move(promise), fn = std::forward<F>(f)](TaskWorker&) mutable
     {
-        if ( ::PeekMessage(&msg, nullptr, 0, 0, PM_NOREMOVE) )
-        {
-            if ( ::GetMessage(&msg, nullptr, 0, 0) <= 0 )
-            {
-                break;
-            }
-            ::TranslateMessage(&msg);
-            ::DispatchMessage (&msg);
-        }
-        else if ( m_working )
-        {
-            // 自分のキューからタスクを取得
-            auto task = QueryTask();
-            if ( static_cast<bool>(task) )
-            {
-                task(*this);
-                continue;
-            }
+        promise.run(fn);
+    }, priority);
 
-            // 他人のキューからタスクを取得
-            auto others_task = m_pool->QueryTask();
-            if ( static_cast<bool>(others_task) )
-            {
-                others_task(*this);
-                continue;
-            }
-        }
-        else
-        {
-            ::MsgWaitForMultipleObjects
-            (
-                0, nullptr, FALSE, INFINITE, QS_ALLINPUT
-            );
-        }
-    }
+    return future<R>(state);
 }
 
 //---------------------------------------------------------------------------//
@@ -0,0 +1,842 @@
+﻿#pragma once
+
+//---------------------------------------------------------------------------//
+//
+// TaskBench.hpp
+//  ThreadPool のベンチマーク
+//   Copyright (C) 2017 tapetums
+//
+//  どこか一つの .cpp で TASKBENCH_MAIN を定義してからインクルードすると main() が入る
+//   > taskbench [--threads N] [--quick] [--csv] [--filter 名前の一部]
+//
+//  結果は 1 行に 1 項目で, ops/s と 1 回 (一巡) あたりの時間の分布 (ns) を出す
+//  --csv の出力を変更前後で比べれば退行が分かる
+//
+//  キューの方式を比べるため, 単純な作業の計測はプールの型をテンプレート引数で受ける
+//  新しいキューを試すときは ThreadPoolAdapter と同じ形のアダプタを書いて run_queue_suite() に渡す
+//
+//---------------------------------------------------------------------------//
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Parallel.hpp"
+#include "Task.hpp"
+#include "Topology.hpp"
+
+//---------------------------------------------------------------------------//
+// Forward Declarations
+//---------------------------------------------------------------------------//
+
+namespace tapetums
+{
+    namespace bench
+    {
+        struct Options;
+        struct Result;
+        class  Samples;
+        class  Reporter;
+        class  Latch;
+        class  ThreadPoolAdapter;
+        class  MutexQueuePool;
+
+        template<typename Pool>
+        void run_queue_suite(Reporter& reporter, const char* pool_name, size_t threads);
+
+        inline void run_pool_suite    (Reporter& reporter, size_t threads);
+        inline void run_scaling_suite (Reporter& reporter, size_t max_threads);
+        inline void run_task_suite    (Reporter& reporter);
+        inline void run_topology_suite(Reporter& reporter, size_t threads);
+
+        inline int Main(int argc, char* argv[]);
+    }
+}
+
+//---------------------------------------------------------------------------//
+// Options
+//---------------------------------------------------------------------------//
+
+struct tapetums::bench::Options
+{
+    size_t      threads { 0 };   // 0 なら論理プロセッサ数
+    double      scale   { 1.0 }; // 繰り返し回数の倍率 (--quick で小さくする)
+    bool        csv     { false };
+    std::string filter;
+};
+
+//---------------------------------------------------------------------------//
+// Result
+//  ops_per_sec は全体の処理数 / 全体の時間
+//  p50 / p90 / p99 は一巡ごとに測った 1 回あたりの時間 (ns)
+//---------------------------------------------------------------------------//
+
+struct tapetums::bench::Result
+{
+    std::string name;
+    std::string pool;
+    size_t      threads     { 0 };
+    double      ops_per_sec { 0 };
+    double      p50         { 0 };
+    double      p90         { 0 };
+    double      p99         { 0 };
+};
+
+//---------------------------------------------------------------------------//
+// Samples
+//---------------------------------------------------------------------------//
+
+class tapetums::bench::Samples final
+{
+private:
+    std::vector<double> m_values;
+    double   m_total_ns  { 0 };
+    uint64_t m_total_ops { 0 };
+
+public:
+    // 一巡にかかった時間と, その間の処理数を記録する
+    void add(double round_ns, uint64_t ops)
+    {
+        m_values.push_back(round_ns / std::max<uint64_t>(ops, 1));
+        m_total_ns  += round_ns;
+        m_total_ops += ops;
+    }
+
+    double ops_per_sec() const noexcept
+    {
+        return m_total_ns > 0 ? m_total_ops * 1e9 / m_total_ns : 0;
+    }
+
+    double percentile(double p) const
+    {
+        if ( m_values.empty() ) { return 0; }
+
+        auto values = m_values;
+        const auto index = std::min(values.size() - 1, static_cast<size_t>(p / 100 * values.size()));
+        std::nth_element(values.begin(), values.begin() + index, values.end());
+        return values[index];
+    }
+
+    Result result(const char* name, const char* pool, size_t threads) const
+    {
+        return Result{ name, pool, threads, ops_per_sec(), percentile(50), percentile(90), percentile(99) };
+    }
+};
+
+//---------------------------------------------------------------------------//
+// Reporter
+//---------------------------------------------------------------------------//
+
+class tapetums::bench::Reporter final
+{
+private:
+    Options m_options;
+    bool    m_header { false };
+
+public:
+    explicit Reporter(const Options& options) : m_options(options) { }
+
+public:
+    const Options& options() const noexcept { return m_options; }
+
+    // 回数に倍率をかける (最低 1 回)
+    size_t scaled(size_t n) const noexcept
+    {
+        return std::max<size_t>(1, static_cast<size_t>(n * m_options.scale));
+    }
+
+    bool enabled(const std::string& name) const
+    {
+        return m_options.filter.empty() || name.find(m_options.filter) != std::string::npos;
+    }
+
+    void note(const char* text)
+    {
+        if ( ! m_options.csv ) { std::printf("# %s\n", text); }
+    }
+
+    void report(const Result& r)
+    {
+        if ( ! m_header )
+        {
+            if ( m_options.csv ) { std::printf("name,pool,threads,ops_per_sec,p50_ns,p90_ns,p99_ns\n"); }
+            else                 { std::printf("%-28s %-12s %7s %14s %12s %12s %12s\n", "name", "pool", "threads", "ops/s", "p50(ns)", "p90(ns)", "p99(ns)"); }
+            m_header = true;
+        }
+
+        if ( m_options.csv )
+        {
+            std::printf("%s,%s,%zu,%.0f,%.1f,%.1f,%.1f\n", r.name.c_str(), r.pool.c_str(), r.threads, r.ops_per_sec, r.p50, r.p90, r.p99);
+        }
+        else
+        {
+            std::printf("%-28s %-12s %7zu %14.0f %12.1f %12.1f %12.1f\n", r.name.c_str(), r.pool.c_str(), r.threads, r.ops_per_sec, r.p50, r.p90, r.p99);
+        }
+        std::fflush(stdout);
+    }
+};
+
+//---------------------------------------------------------------------------//
+// Latch
+//  外部スレッドで完了を待つ (手伝わないので, どのプールでも同じ条件になる)
+//---------------------------------------------------------------------------//
+
+class tapetums::bench::Latch final
+{
+private:
+    std::atomic<size_t> m_count;
+
+public:
+    explicit Latch(size_t count) noexcept : m_count(count) { }
+
+public:
+    void reset(size_t count) noexcept { m_count.store(count, std::memory_order_relaxed); }
+
+    void count_down() noexcept { m_count.fetch_sub(1, std::memory_order_release); }
+
+    void wait() const noexcept
+    {
+        uint32_t rounds { 0 };
+        while ( m_count.load(std::memory_order_acquire) != 0 )
+        {
+            if ( ++rounds < 64 ) { tapetums::detail::cpu_relax(); }
+            else                 { std::this_thread::yield(); }
+        }
+    }
+};
+
+//---------------------------------------------------------------------------//
+// ThreadPoolAdapter
+//  ベンチマークから見たプールの形 (post() で f() を積む)
+//---------------------------------------------------------------------------//
+
+class tapetums::bench::ThreadPoolAdapter final
+{
+private:
+    ThreadPool m_pool;
+
+public:
+    explicit ThreadPoolAdapter(size_t threads) : m_pool(threads) { m_pool.Start(); }
+    ~ThreadPoolAdapter() { m_pool.Stop(); }
+
+public:
+    size_t threads() const noexcept { return m_pool.worker_count(); }
+
+    template<typename F>
+    void post(F&& f)
+    {
+        m_pool.AddTask([fn = std::forward<F>(f)](TaskWorker&) mutable { fn(); });
+    }
+};
+
+//---------------------------------------------------------------------------//
+// MutexQueuePool
+//  比較用: ひとつのキューをひとつのロックで守るだけのプール
+//---------------------------------------------------------------------------//
+
+class tapetums::bench::MutexQueuePool final
+{
+private:
+    std::mutex                           m_lock;
+    std::condition_variable              m_cv;
+    std::deque<unique_task<void ()>>     m_queue;
+    std::vector<std::thread>             m_threads;
+    bool                                 m_stop { false };
+
+public:
+    explicit MutexQueuePool(size_t threads)
+    {
+        for ( size_t i = 0; i < threads; ++i )
+        {
+            m_threads.emplace_back([this]() { loop(); });
+        }
+    }
+
+    ~MutexQueuePool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_stop = true;
+        }
+        m_cv.notify_all();
+
+        for ( auto& t : m_threads ) { t.join(); }
+    }
+
+public:
+    size_t threads() const noexcept { return m_threads.size(); }
+
+    template<typename F>
+    void post(F&& f)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_queue.emplace_back(std::forward<F>(f));
+        }
+        m_cv.notify_one();
+    }
+
+private:
+    void loop()
+    {
+        for ( ;; )
+        {
+            unique_task<void ()> task;
+            {
+                std::unique_lock<std::mutex> lock(m_lock);
+                m_cv.wait(lock, [this]() { return m_stop || ! m_queue.empty(); });
+
+                if ( m_queue.empty() ) { return; }
+
+                task = std::move(m_queue.front());
+                m_queue.pop_front();
+            }
+            task();
+        }
+    }
+};
+
+//---------------------------------------------------------------------------//
+// Helper Functions
+//---------------------------------------------------------------------------//
+
+namespace tapetums { namespace bench { namespace detail {
+
+using clock = std::chrono::steady_clock;
+
+inline double elapsed_ns(clock::time_point start) noexcept
+{
+    return std::chrono::duration<double, std::nano>(clock::now() - start).count();
+}
+
+// 最適化で消されないようにする
+template<typename T>
+inline void keep(T&& value) noexcept
+{
+    static std::atomic<size_t> sink { 0 };
+    sink.fetch_add(static_cast<size_t>(value), std::memory_order_relaxed);
+}
+
+// p の指す先が外から書き換わりうると思わせ, 呼び出しを展開させない
+inline void escape(void* p) noexcept
+{
+    static std::atomic<void*> sink { nullptr };
+    sink.store(p, std::memory_order_relaxed);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+}
+
+inline void spin_work(uint32_t n) noexcept
+{
+    for ( uint32_t i = 0; i < n; ++i ) { tapetums::detail::cpu_relax(); }
+}
+
+inline uint64_t fib_serial(uint32_t n) noexcept
+{
+    return n < 2 ? n : fib_serial(n - 1) + fib_serial(n - 2);
+}
+
+inline uint64_t fib(ThreadPool& pool, uint32_t n)
+{
+    if ( n < 20 ) { return fib_serial(n); }
+
+    uint64_t x { 0 }, y { 0 };
+    tapetums::detail::fork_join
+    (
+        pool,
+        [&]() { x = fib(pool, n - 1); },
+        [&]() { y = fib(pool, n - 2); }
+    );
+    return x + y;
+}
+
+}}} // namespace tapetums::bench::detail
+
+//---------------------------------------------------------------------------//
+// Queue Suite
+//  外部スレッドから積むだけの計測 (プールの型を問わない)
+//---------------------------------------------------------------------------//
+
+template<typename Pool>
+inline void tapetums::bench::run_queue_suite
+(
+    Reporter& reporter, const char* pool_name, size_t threads
+)
+{
+    Pool pool(threads);
+
+    // 空のタスクを一つの外部スレッドから積む
+    if ( reporter.enabled("empty_tasks") )
+    {
+        const size_t count = reporter.scaled(100000);
+        Samples samples;
+        Latch latch(0);
+        for ( size_t round = 0; round < 10; ++round )
+        {
+            latch.reset(count);
+            const auto start = detail::clock::now();
+            for ( size_t i = 0; i < count; ++i )
+            {
+                pool.post([&latch]() { latch.count_down(); });
+            }
+            latch.wait();
+            samples.add(detail::elapsed_ns(start), count);
+        }
+        reporter.report(samples.result("empty_tasks", pool_name, threads));
+    }
+
+    // 積む側が多い (ワーカーと同じ数の外部スレッドから積む)
+    if ( reporter.enabled("producer_heavy") )
+    {
+        const size_t producers = std::max<size_t>(threads, 2);
+        const size_t count     = reporter.scaled(20000);
+        Samples samples;
+        Latch latch(0);
+        for ( size_t round = 0; round < 10; ++round )
+        {
+            latch.reset(count * producers);
+            const auto start = detail::clock::now();
+
+            std::vector<std::thread> senders;
+            for ( size_t p = 0; p < producers; ++p )
+            {
+                senders.emplace_back([&]()
+                {
+                    for ( size_t i = 0; i < count; ++i )
+                    {
+                        pool.post([&latch]() { detail::spin_work(16); latch.count_down(); });
+                    }
+                });
+            }
+            for ( auto& t : senders ) { t.join(); }
+            latch.wait();
+
+            samples.add(detail::elapsed_ns(start), count * producers);
+        }
+        reporter.report(samples.result("producer_heavy", pool_name, threads));
+    }
+
+    // fork-join の往復: ワーカー数だけ積んで全ての完了を待つまでの時間
+    if ( reporter.enabled("fork_join") )
+    {
+        const size_t rounds = reporter.scaled(20000);
+        Samples samples;
+        Latch latch(0);
+        for ( size_t round = 0; round < rounds; ++round )
+        {
+            latch.reset(threads);
+            const auto start = detail::clock::now();
+            for ( size_t i = 0; i < threads; ++i )
+            {
+                pool.post([&latch]() { latch.count_down(); });
+            }
+            latch.wait();
+            samples.add(detail::elapsed_ns(start), 1);
+        }
+        reporter.report(samples.result("fork_join", pool_name, threads));
+    }
+
+    // 重さの偏ったタスク (大半は軽く, 一部だけ重い)
+    if ( reporter.enabled("unbalanced") )
+    {
+        const size_t count = reporter.scaled(20000);
+        std::mt19937 rng(1);
+        std::vector<uint32_t> weights(count);
+        for ( auto& w : weights ) { w = (rng() % 64 == 0) ? 4096 : 16; }
+
+        Samples samples;
+        Latch latch(0);
+        for ( size_t round = 0; round < 10; ++round )
+        {
+            latch.reset(count);
+            const auto start = detail::clock::now();
+            for ( size_t i = 0; i < count; ++i )
+            {
+                const auto w = weights[i];
+                pool.post([&latch, w]() { detail::spin_work(w); latch.count_down(); });
+            }
+            latch.wait();
+            samples.add(detail::elapsed_ns(start), count);
+        }
+        reporter.report(samples.result("unbalanced", pool_name, threads));
+    }
+}
+
+//---------------------------------------------------------------------------//
+// Pool Suite
+//  ThreadPool に固有の機能 (ワーカー内からの投入, 盗み, まとめての投入, 再帰) の計測
+//---------------------------------------------------------------------------//
+
+inline void tapetums::bench::run_pool_suite(Reporter& reporter, size_t threads)
+{
+    ThreadPool pool(threads);
+    pool.Start();
+
+    // ひとつのワーカーが全てを積み, 他のワーカーは盗むしかない
+    if ( reporter.enabled("steal_heavy") )
+    {
+        const size_t count = reporter.scaled(100000);
+        Samples samples;
+        Latch latch(0);
+        for ( size_t round = 0; round < 10; ++round )
+        {
+            latch.reset(count + 1);
+            const auto start = detail::clock::now();
+            pool.AddTask([&](TaskWorker& worker)
+            {
+                for ( size_t i = 0; i < count; ++i )
+                {
+                    worker.AddTask([&latch](TaskWorker&) { detail::spin_work(16); latch.count_down(); });
+                }
+                latch.count_down();
+            });
+            latch.wait();
+            samples.add(detail::elapsed_ns(start), count);
+        }
+        reporter.report(samples.result("steal_heavy", "ThreadPool", threads));
+    }
+
+    // AddTask を繰り返すのと AddTasks でまとめて積むのとの比較
+    if ( reporter.enabled("batch") )
+    {
+        const size_t count = reporter.scaled(100000);
+        Samples single;
+        Samples batch;
+        Latch latch(0);
+        std::vector<Task> tasks;
+        tasks.reserve(count);
+        for ( size_t round = 0; round < 10; ++round )
+        {
+            latch.reset(count);
+            auto start = detail::clock::now();
+            for ( size_t i = 0; i < count; ++i )
+            {
+                pool.AddTask([&latch](TaskWorker&) { latch.count_down(); });
+            }
+            latch.wait();
+            single.add(detail::elapsed_ns(start), count);
+
+            tasks.clear();
+            for ( size_t i = 0; i < count; ++i )
+            {
+                tasks.emplace_back([&latch](TaskWorker&) { latch.count_down(); });
+            }
+            latch.reset(count);
+            start = detail::clock::now();
+            pool.AddTasks(tasks);
+            latch.wait();
+            batch.add(detail::elapsed_ns(start), count);
+        }
+        reporter.report(single.result("batch/AddTask",  "ThreadPool", threads));
+        reporter.report(batch .result("batch/AddTasks", "ThreadPool", threads));
+    }
+
+    // 再帰的な分割 (fib): 木の形が偏っているので盗みで均す
+    if ( reporter.enabled("fib") )
+    {
+        const uint32_t n = reporter.options().scale < 1 ? 27 : 32;
+        Samples samples;
+        for ( size_t round = 0; round < 5; ++round )
+        {
+            const auto start = detail::clock::now();
+            detail::keep(detail::fib(pool, n));
+            samples.add(detail::elapsed_ns(start), 1);
+        }
+        reporter.report(samples.result("fib", "ThreadPool", threads));
+    }
+
+    // 再帰的な分割 (quicksort): parallel_sort
+    if ( reporter.enabled("quicksort") )
+    {
+        const size_t count = reporter.scaled(2000000);
+        std::mt19937 rng(1);
+        std::vector<uint32_t> source(count);
+        for ( auto& v : source ) { v = rng(); }
+
+        Samples samples;
+        std::vector<uint32_t> data;
+        for ( size_t round = 0; round < 5; ++round )
+        {
+            data = source;
+            const auto start = detail::clock::now();
+            parallel_sort(pool, data.begin(), data.end());
+            samples.add(detail::elapsed_ns(start), count);
+        }
+        reporter.report(samples.result("quicksort", "ThreadPool", threads));
+    }
+
+    pool.Stop();
+}
+
+//---------------------------------------------------------------------------//
+// Scaling Suite
+//  1 .. N ワーカーでの伸び
+//---------------------------------------------------------------------------//
+
+inline void tapetums::bench::run_scaling_suite(Reporter& reporter, size_t max_threads)
+{
+    if ( ! reporter.enabled("scaling") )
+    {
+        return;
+    }
+
+    std::vector<size_t> counts;
+    for ( size_t n = 1; n < max_threads; n *= 2 ) { counts.push_back(n); }
+    counts.push_back(max_threads);
+
+    const uint32_t n = reporter.options().scale < 1 ? 25 : 30;
+    const size_t   count = reporter.scaled(50000);
+    for ( auto threads : counts )
+    {
+        ThreadPool pool(threads);
+        pool.Start();
+
+        Samples fib;
+        for ( size_t round = 0; round < 5; ++round )
+        {
+            const auto start = detail::clock::now();
+            detail::keep(detail::fib(pool, n));
+            fib.add(detail::elapsed_ns(start), 1);
+        }
+        reporter.report(fib.result("scaling/fib", "ThreadPool", threads));
+
+        Samples work;
+        Latch latch(0);
+        for ( size_t round = 0; round < 5; ++round )
+        {
+            latch.reset(count);
+            const auto start = detail::clock::now();
+            for ( size_t i = 0; i < count; ++i )
+            {
+                pool.AddTask([&latch](TaskWorker&) { detail::spin_work(256); latch.count_down(); });
+            }
+            latch.wait();
+            work.add(detail::elapsed_ns(start), count);
+        }
+        reporter.report(work.result("scaling/work", "ThreadPool", threads));
+
+        pool.Stop();
+    }
+}
+
+//---------------------------------------------------------------------------//
+// Task Suite
+//  unique_task と std::function の比較 (生成 → ムーブ → 呼び出し → 破棄)
+//---------------------------------------------------------------------------//
+
+inline void tapetums::bench::run_task_suite(Reporter& reporter)
+{
+    if ( ! reporter.enabled("callable") )
+    {
+        return;
+    }
+
+    const size_t count = reporter.scaled(1000000);
+
+    struct Large { uint64_t values[16]; };
+    Large large { };
+    uint64_t small { 1 };
+
+    auto measure = [&](const char* name, auto make)
+    {
+        Samples samples;
+        for ( size_t round = 0; round < 10; ++round )
+        {
+            uint64_t sum { 0 };
+            const auto start = detail::clock::now();
+            for ( size_t i = 0; i < count; ++i )
+            {
+                auto f = make(i);
+                auto g = std::move(f);
+                detail::escape(&g);
+                sum += g();
+            }
+            samples.add(detail::elapsed_ns(start), count);
+            detail::keep(sum);
+        }
+        reporter.report(samples.result(name, "-", 1));
+    };
+
+    // 小さなもの (ポインタひとつ) は unique_task も std::function もヒープを使わない
+    measure("callable/unique_task/small", [&](size_t i) { return unique_task<uint64_t ()>([&small, i]() { return small + i; }); });
+    measure("callable/function/small",    [&](size_t i) { return std::function<uint64_t ()>([&small, i]() { return small + i; }); });
+
+    // 大きなもの (128 bytes) はどちらもヒープに置く
+    measure("callable/unique_task/large", [&](size_t i) { return unique_task<uint64_t ()>([large, i]() { return large.values[0] + i; }); });
+    measure("callable/function/large",    [&](size_t i) { return std::function<uint64_t ()>([large, i]() { return large.values[0] + i; }); });
+
+    // ムーブしかできないもの (std::function には入らない)
+    measure("callable/unique_task/move_only", [&](size_t i)
+    {
+        return unique_task<uint64_t ()>([p = std::unique_ptr<uint64_t>(), i]() { return i; });
+    });
+}
+
+//---------------------------------------------------------------------------//
+// Topology Suite
+//  盗みの局所性: ワーカーを固定したときとしないとき,
+//  NUMA ノードが複数あれば一つのノードに収めたときと跨いだときを比べる
+//---------------------------------------------------------------------------//
+
+inline void tapetums::bench::run_topology_suite(Reporter& reporter, size_t threads)
+{
+    if ( ! reporter.enabled("topology") )
+    {
+        return;
+    }
+
+    const auto& topology = CpuTopology::Get();
+    {
+        char text[128];
+        std::snprintf
+        (
+            text, sizeof(text), "topology: %zu cpus, %u cores, %u packages, %u nodes, %u LLCs",
+            topology.cpu_count(), topology.core_count(), topology.package_count(),
+            topology.node_count(), topology.llc_count()
+        );
+        reporter.note(text);
+    }
+
+    const size_t count = reporter.scaled(100000);
+
+    // ワーカーから積んで, 他のワーカーに盗ませる (盗みの内訳も出す)
+    auto steal = [&](const char* name, size_t workers, bool pin)
+    {
+        ThreadPoolConfig config;
+        config.pin_threads = pin;
+
+        ThreadPool pool(workers, config);
+        pool.Start();
+
+        Samples samples;
+        Latch latch(0);
+        for ( size_t round = 0; round < 10; ++round )
+        {
+            latch.reset(count + 1);
+            const auto start = detail::clock::now();
+            pool.AddTask([&](TaskWorker& worker)
+            {
+                for ( size_t i = 0; i < count; ++i )
+                {
+                    worker.AddTask([&latch](TaskWorker&) { detail::spin_work(64); latch.count_down(); });
+                }
+                latch.count_down();
+            });
+            latch.wait();
+            samples.add(detail::elapsed_ns(start), count);
+        }
+
+        const auto stats = pool.Snapshot();
+        pool.Stop();
+
+        reporter.report(samples.result(name, "ThreadPool", workers));
+
+        char text[128];
+        std::snprintf
+        (
+            text, sizeof(text), "%s: stolen %llu, failed steals %llu", name,
+            static_cast<unsigned long long>(stats.total.stolen),
+            static_cast<unsigned long long>(stats.total.failed_steals)
+        );
+        reporter.note(text);
+    };
+
+    steal("topology/unpinned", threads, false);
+    steal("topology/pinned",   threads, true);
+
+    // 固定したワーカーは PlacementOrder() の順に並ぶので,
+    // 先頭のノードの論理プロセッサ数までなら一つのノードに収まる
+    if ( topology.node_count() > 1 || topology.package_count() > 1 )
+    {
+        size_t local { 0 };
+        for ( const auto& cpu : topology )
+        {
+            if ( cpu.node == topology[0].node && cpu.package == topology[0].package ) { ++local; }
+        }
+        steal("topology/one_node",   std::min(local, threads), true);
+        steal("topology/cross_node", std::min(local * 2, topology.cpu_count()), true);
+    }
+    else
+    {
+        reporter.note("topology/cross_node: skipped (single NUMA node)");
+    }
+}
+
+//---------------------------------------------------------------------------//
+// Main
+//---------------------------------------------------------------------------//
+
+inline int tapetums::bench::Main(int argc, char* argv[])
+{
+    Options options;
+    for ( int i = 1; i < argc; ++i )
+    {
+        const auto arg = argv[i];
+        if ( std::strcmp(arg, "--threads") == 0 && i + 1 < argc )
+        {
+            options.threads = static_cast<size_t>(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if ( std::strcmp(arg, "--filter") == 0 && i + 1 < argc )
+        {
+            options.filter = argv[++i];
+        }
+        else if ( std::strcmp(arg, "--quick") == 0 )
+        {
+            options.scale = 0.1;
+        }
+        else if ( std::strcmp(arg, "--csv") == 0 )
+        {
+            options.csv = true;
+        }
+        else
+        {
+            std::fprintf(stderr, "usage: %s [--threads N] [--quick] [--csv] [--filter NAME]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    const auto threads = options.threads ? options.threads
+                       : std::max<size_t>(CpuTopology::Get().cpu_count(), 1);
+
+    Reporter reporter(options);
+
+    run_queue_suite<ThreadPoolAdapter>(reporter, "ThreadPool", threads);
+    run_queue_suite<MutexQueuePool>   (reporter, "MutexQueue", threads);
+    run_pool_suite    (reporter, threads);
+    run_scaling_suite (reporter, threads);
+    run_task_suite    (reporter);
+    run_topology_suite(reporter, threads);
+
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+
+#if defined(TASKBENCH_MAIN)
+
+int main(int argc, char* argv[])
+{
+    return tapetums::bench::Main(argc, argv);
+}
+
+#endif
+
+//---------------------------------------------------------------------------//
+
+// TaskBench.hpp
\ No newline at end of file
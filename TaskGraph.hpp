@@ -0,0 +1,472 @@
+﻿#pragma once
+
+//---------------------------------------------------------------------------//
+//
+// TaskGraph.hpp
+//  依存関係のあるタスクを ThreadPool で実行する
+//   Copyright (C) 2017 tapetums
+//
+//  各ノードは先行するノードが全て終わった時点で投入される (残りの入次数をアトミックに数える)
+//  一度組み立てたグラフは, 構造を変えない限りメモリを確保し直さずに何度でも Run() できる
+//  ノードは Run() に渡した優先度のレーンに積み, 後続の長いノード (クリティカルパス上のもの) ほど先に実行する
+//
+//---------------------------------------------------------------------------//
+
+#include <cstddef>
+#include <cstdint>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <future>
+#include <initializer_list>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "Task.hpp"
+
+//---------------------------------------------------------------------------//
+// Forward Declarations
+//---------------------------------------------------------------------------//
+
+namespace tapetums
+{
+    class TaskGraph;
+}
+
+//---------------------------------------------------------------------------//
+// TaskGraph Class
+//  ノードは AddNode() の戻り値 (0 から順の番号) で指す
+//  cost はクリティカルパスを求めるための見積もり (単位は任意)
+//  同じグラフを同時に Run() してはいけない
+//---------------------------------------------------------------------------//
+
+class tapetums::TaskGraph final
+{
+private:
+    struct Node
+    {
+        Task                fn;
+        uint64_t            cost;
+        std::vector<size_t> predecessors;
+    };
+
+    class NodeTask;
+
+private:
+    ThreadPool& m_pool;
+
+    std::vector<Node> m_nodes;
+    bool              m_dirty { true };
+
+    // build() で作る実行用のデータ (後続ノードは隣接配列を一本にまとめて持つ)
+    std::vector<uint32_t> m_in_degree;
+    std::vector<size_t>   m_succ_begin;
+    std::vector<size_t>   m_succ;
+    std::vector<size_t>   m_roots;
+    std::vector<uint64_t> m_rank;     // そのノードから終わりまでの最長の cost
+    std::vector<bool>     m_critical;
+    uint64_t              m_critical_path { 0 };
+
+    std::unique_ptr<std::atomic<uint32_t>[]> m_pending;
+    size_t                                   m_pending_size { 0 };
+
+    // 実行中の状態
+    PRIORITY            m_priority { PRIORITY::NORMAL };
+    std::atomic<size_t> m_remaining { 0 };
+    std::atomic<bool>   m_has_error { false };
+    std::atomic<bool>   m_broken    { false }; // 実行されずに破棄されたノードがある
+    std::exception_ptr  m_error;
+
+public:
+    explicit TaskGraph(ThreadPool& pool) noexcept : m_pool(pool) { }
+
+    TaskGraph() = delete;
+
+    TaskGraph(const TaskGraph&)             = delete;
+    TaskGraph& operator =(const TaskGraph&) = delete;
+
+    // 実行中のタスクがグラフのアドレスを参照しているためムーブできない
+    TaskGraph(TaskGraph&&)             = delete;
+    TaskGraph& operator =(TaskGraph&&) = delete;
+
+    ~TaskGraph() = default;
+
+public:
+    ThreadPool& pool() const noexcept { return m_pool; }
+    size_t      size() const noexcept { return m_nodes.size(); }
+
+    uint64_t critical_path();
+    bool     is_critical  (size_t node);
+
+public:
+    template<typename F>
+    size_t AddNode(F&& f, uint64_t cost = 1);
+    template<typename F>
+    size_t AddNode(F&& f, std::initializer_list<size_t> predecessors, uint64_t cost = 1);
+
+    void DependsOn(size_t node, size_t predecessor);
+    void SetCost  (size_t node, uint64_t cost);
+    void Clear    ();
+
+    void Run(PRIORITY priority = PRIORITY::NORMAL);
+
+private:
+    void build ();
+    void submit(size_t node);
+    void run_node (TaskWorker& worker, size_t node);
+    void skip_node(size_t node) noexcept;
+    void check (size_t node) const;
+};
+
+//---------------------------------------------------------------------------//
+// TaskGraph::NodeTask
+//  ノードをプールで実行するタスク
+//  実行されずに破棄されたら (Stop() など), そのノードと後続ノードを終わったことにする
+//---------------------------------------------------------------------------//
+
+class tapetums::TaskGraph::NodeTask final
+{
+private:
+    TaskGraph* m_graph;
+    size_t     m_node;
+
+public:
+    NodeTask(TaskGraph* graph, size_t node) noexcept : m_graph(graph), m_node(node) { }
+    NodeTask(NodeTask&& rhs) noexcept : m_graph(rhs.m_graph), m_node(rhs.m_node) { rhs.m_graph = nullptr; }
+    ~NodeTask() { if ( m_graph ) { m_graph->skip_node(m_node); } }
+
+    void operator()(TaskWorker& worker)
+    {
+        const auto graph = m_graph;
+        m_graph = nullptr;
+        graph->run_node(worker, m_node);
+    }
+};
+
+//---------------------------------------------------------------------------//
+// TaskGraph Methods
+//---------------------------------------------------------------------------//
+
+// クリティカルパスの長さ (cost の和)
+inline uint64_t tapetums::TaskGraph::critical_path()
+{
+    build();
+
+    return m_critical_path;
+}
+
+//---------------------------------------------------------------------------//
+
+inline bool tapetums::TaskGraph::is_critical(size_t node)
+{
+    check(node);
+    build();
+
+    return m_critical[node];
+}
+
+//---------------------------------------------------------------------------//
+
+// f(TaskWorker&) をノードとして加える. f は Run() のたびに呼ばれる
+template<typename F>
+inline size_t tapetums::TaskGraph::AddNode(F&& f, uint64_t cost)
+{
+    m_nodes.push_back(Node{ Task(std::forward<F>(f)), cost, { } });
+    m_dirty = true;
+
+    return m_nodes.size() - 1;
+}
+
+//---------------------------------------------------------------------------//
+
+template<typename F>
+inline size_t tapetums::TaskGraph::AddNode
+(
+    F&& f, std::initializer_list<size_t> predecessors, uint64_t cost
+)
+{
+    for ( auto predecessor : predecessors )
+    {
+        check(predecessor);
+    }
+
+    const auto node = AddNode(std::forward<F>(f), cost);
+    m_nodes[node].predecessors.assign(predecessors.begin(), predecessors.end());
+
+    return node;
+}
+
+//---------------------------------------------------------------------------//
+
+// predecessor が終わってから node を実行する
+inline void tapetums::TaskGraph::DependsOn(size_t node, size_t predecessor)
+{
+    check(node);
+    check(predecessor);
+
+    m_nodes[node].predecessors.push_back(predecessor);
+    m_dirty = true;
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::TaskGraph::SetCost(size_t node, uint64_t cost)
+{
+    check(node);
+
+    m_nodes[node].cost = cost;
+    m_dirty = true;
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::TaskGraph::Clear()
+{
+    m_nodes.clear();
+    m_dirty = true;
+}
+
+//---------------------------------------------------------------------------//
+
+// 全てのノードを実行し終えるまで待つ. 待つ間は呼び出し元のスレッドでもプールのタスクを実行する
+// ノードが例外を投げたら, まだ始まっていないノードは実行せずに終わり, 最初の例外を再送出する
+// Stop() で実行されずに破棄されたノードがあれば future_error (broken_promise) を投げる
+inline void tapetums::TaskGraph::Run(PRIORITY priority)
+{
+    build();
+
+    const auto count = m_nodes.size();
+    if ( count == 0 )
+    {
+        return;
+    }
+
+    for ( size_t i = 0; i < count; ++i )
+    {
+        m_pending[i].store(m_in_degree[i], std::memory_order_relaxed);
+    }
+    m_priority = priority;
+    m_remaining.store(count, std::memory_order_relaxed);
+    m_has_error.store(false, std::memory_order_relaxed);
+    m_broken   .store(false, std::memory_order_relaxed);
+
+    for ( auto root : m_roots )
+    {
+        submit(root);
+    }
+
+    detail::help_until(m_pool, [this]() { return m_remaining.load(std::memory_order_acquire) == 0; });
+
+    if ( m_has_error.load(std::memory_order_acquire) )
+    {
+        auto error = std::move(m_error);
+        m_error = nullptr;
+
+        std::rethrow_exception(error);
+    }
+    if ( m_broken.load(std::memory_order_acquire) )
+    {
+        throw std::future_error(std::future_errc::broken_promise);
+    }
+}
+
+//---------------------------------------------------------------------------//
+// TaskGraph Inner Methods
+//---------------------------------------------------------------------------//
+
+// 構造が変わっていれば, 入次数・後続ノード・クリティカルパスを求め直す
+inline void tapetums::TaskGraph::build()
+{
+    if ( ! m_dirty )
+    {
+        return;
+    }
+
+    const auto count = m_nodes.size();
+
+    m_in_degree.assign(count, 0);
+    m_succ_begin.assign(count + 1, 0);
+    for ( size_t i = 0; i < count; ++i )
+    {
+        m_in_degree[i] = static_cast<uint32_t>(m_nodes[i].predecessors.size());
+        for ( auto p : m_nodes[i].predecessors )
+        {
+            ++m_succ_begin[p + 1];
+        }
+    }
+    for ( size_t i = 0; i < count; ++i )
+    {
+        m_succ_begin[i + 1] += m_succ_begin[i];
+    }
+
+    m_succ.resize(m_succ_begin[count]);
+    {
+        std::vector<size_t> fill(m_succ_begin.begin(), m_succ_begin.end() - 1);
+        for ( size_t i = 0; i < count; ++i )
+        {
+            for ( auto p : m_nodes[i].predecessors )
+            {
+                m_succ[fill[p]++] = i;
+            }
+        }
+    }
+
+    // トポロジカル順に並べる (並べきれなければ循環している)
+    std::vector<size_t>   order;
+    std::vector<uint32_t> degree(m_in_degree);
+    order.reserve(count);
+    for ( size_t i = 0; i < count; ++i )
+    {
+        if ( degree[i] == 0 ) { order.push_back(i); }
+    }
+    for ( size_t head = 0; head < order.size(); ++head )
+    {
+        const auto node = order[head];
+        for ( auto s = m_succ_begin[node]; s < m_succ_begin[node + 1]; ++s )
+        {
+            if ( --degree[m_succ[s]] == 0 ) { order.push_back(m_succ[s]); }
+        }
+    }
+    if ( order.size() != count )
+    {
+        throw std::logic_error("TaskGraph has a cycle");
+    }
+
+    // 後ろから: そのノードから終わりまでの最長の cost
+    m_rank.assign(count, 0);
+    for ( auto it = order.rbegin(); it != order.rend(); ++it )
+    {
+        uint64_t longest { 0 };
+        for ( auto s = m_succ_begin[*it]; s < m_succ_begin[*it + 1]; ++s )
+        {
+            longest = std::max(longest, m_rank[m_succ[s]]);
+        }
+        m_rank[*it] = m_nodes[*it].cost + longest;
+    }
+
+    // 前から: 始まりからそのノードの手前までの最長の cost
+    std::vector<uint64_t> top(count, 0);
+    for ( auto node : order )
+    {
+        for ( auto s = m_succ_begin[node]; s < m_succ_begin[node + 1]; ++s )
+        {
+            auto& t = top[m_succ[s]];
+            t = std::max(t, top[node] + m_nodes[node].cost);
+        }
+    }
+
+    m_critical_path = 0;
+    for ( size_t i = 0; i < count; ++i )
+    {
+        m_critical_path = std::max(m_critical_path, m_rank[i]);
+    }
+
+    // 余裕のないノードがクリティカルパス上にある
+    m_critical.assign(count, false);
+    for ( size_t i = 0; i < count; ++i )
+    {
+        m_critical[i] = (top[i] + m_rank[i] == m_critical_path);
+    }
+
+    // 後続ノードと始まりのノードは rank の小さい順に並べておく
+    // (最後に積んだものが自分のキューの先頭に来るので, rank の大きいものから実行される)
+    const auto by_rank = [this](size_t a, size_t b) { return m_rank[a] < m_rank[b]; };
+    for ( size_t i = 0; i < count; ++i )
+    {
+        std::sort(m_succ.begin() + m_succ_begin[i], m_succ.begin() + m_succ_begin[i + 1], by_rank);
+    }
+
+    m_roots.clear();
+    for ( size_t i = 0; i < count; ++i )
+    {
+        if ( m_in_degree[i] == 0 ) { m_roots.push_back(i); }
+    }
+    std::sort(m_roots.begin(), m_roots.end(), by_rank);
+
+    if ( m_pending_size < count )
+    {
+        m_pending.reset(new std::atomic<uint32_t>[count]);
+        m_pending_size = count;
+    }
+
+    m_dirty = false;
+}
+
+//---------------------------------------------------------------------------//
+
+// 呼び出し元のレーンに積む (クリティカルパスが先になるのは build() で並べた順による)
+inline void tapetums::TaskGraph::submit(size_t node)
+{
+    m_pool.AddTask(NodeTask(this, node), m_priority);
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::TaskGraph::run_node(TaskWorker& worker, size_t node)
+{
+    // 先に失敗したノードがあれば実行しない (後続ノードへの連絡だけはする)
+    if ( ! m_has_error.load(std::memory_order_relaxed) )
+    {
+        try
+        {
+            m_nodes[node].fn(worker);
+        }
+        catch ( ... )
+        {
+            // 最初の例外だけを覚えておく
+            bool expected { false };
+            if ( m_has_error.compare_exchange_strong(expected, true) )
+            {
+                m_error = std::current_exception();
+            }
+        }
+    }
+
+    for ( auto s = m_succ_begin[node]; s < m_succ_begin[node + 1]; ++s )
+    {
+        const auto next = m_succ[s];
+        if ( m_pending[next].fetch_sub(1, std::memory_order_acq_rel) == 1 )
+        {
+            submit(next);
+        }
+    }
+
+    // 減らした後はグラフに触れない (Run() を抜けて破棄されうる)
+    m_remaining.fetch_sub(1, std::memory_order_release);
+}
+
+//---------------------------------------------------------------------------//
+
+// 実行されずに破棄されたノード (NodeTask). 後続ノードも積まずに終わったことにする
+inline void tapetums::TaskGraph::skip_node(size_t node) noexcept
+{
+    m_broken.store(true, std::memory_order_relaxed);
+
+    for ( auto s = m_succ_begin[node]; s < m_succ_begin[node + 1]; ++s )
+    {
+        const auto next = m_succ[s];
+        if ( m_pending[next].fetch_sub(1, std::memory_order_acq_rel) == 1 )
+        {
+            skip_node(next);
+        }
+    }
+
+    m_remaining.fetch_sub(1, std::memory_order_release);
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::TaskGraph::check(size_t node) const
+{
+    if ( node >= m_nodes.size() )
+    {
+        throw std::out_of_range("TaskGraph node is out of range");
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// TaskGraph.hpp
\ No newline at end of file
@@ -0,0 +1,378 @@
+﻿#pragma once
+
+//---------------------------------------------------------------------------//
+//
+// TimerWheel.hpp
+//  階層型タイミングホイール (登録 / 取り消しが O(1) のタイマー管理)
+//   Copyright (C) 2017 tapetums
+//
+//  See Also:
+//   G. Varghese, T. Lauck, "Hashed and Hierarchical Timing Wheels: Data
+//    Structures for the Efficient Implementation of a Timer Facility" (SOSP 1987)
+//
+//---------------------------------------------------------------------------//
+
+#include <cstddef>
+#include <cstdint>
+
+#include <limits>
+
+#if defined(_MSC_VER)
+  #include <intrin.h>
+#endif
+
+//---------------------------------------------------------------------------//
+// Forward Declarations
+//---------------------------------------------------------------------------//
+
+namespace tapetums
+{
+    struct TimerWheelHook;
+    class  TimerWheel;
+}
+
+//---------------------------------------------------------------------------//
+// TimerWheelHook
+//  ホイールに登録する要素の基底 (要素のメモリはホイールの外で管理する)
+//---------------------------------------------------------------------------//
+
+struct tapetums::TimerWheelHook
+{
+    uint64_t        expiry { 0 };       // 期限 (ティック)
+    TimerWheelHook* prev   { nullptr };
+    TimerWheelHook* next   { nullptr };
+    uint32_t        level  { 0 };
+    uint32_t        slot   { 0 };
+    bool            linked { false };
+};
+
+//---------------------------------------------------------------------------//
+// TimerWheel Class
+//  SLOT_COUNT 個のスロットを持つ輪を LEVEL_COUNT 段重ねる
+//  段 l には期限まで 2^(SLOT_BITS * l) ティック以上あるものを置き,
+//  その段の一周の始まりで一つ下の段へ移し直す
+//  スレッドセーフではない (呼び出し側で排他する)
+//---------------------------------------------------------------------------//
+
+class tapetums::TimerWheel final
+{
+public:
+    static constexpr uint32_t SLOT_BITS   { 8 };
+    static constexpr uint32_t SLOT_COUNT  { 1u << SLOT_BITS };
+    static constexpr uint32_t LEVEL_COUNT { 4 };
+
+    static constexpr uint64_t NEVER { std::numeric_limits<uint64_t>::max() };
+
+private:
+    static constexpr uint32_t SLOT_MASK  { SLOT_COUNT - 1 };
+    static constexpr uint32_t WORD_COUNT { SLOT_COUNT / 64 };
+
+    TimerWheelHook* m_slots [LEVEL_COUNT][SLOT_COUNT] { };
+    uint64_t        m_bitmap[LEVEL_COUNT][WORD_COUNT] { }; // 空でないスロット
+
+    uint64_t m_now   { 0 };
+    size_t   m_count { 0 };
+
+public:
+    TimerWheel() = default;
+    ~TimerWheel() = default;
+
+    TimerWheel(const TimerWheel&)             = delete;
+    TimerWheel& operator =(const TimerWheel&) = delete;
+
+    TimerWheel(TimerWheel&&)             = delete;
+    TimerWheel& operator =(TimerWheel&&) = delete;
+
+public:
+    uint64_t now  () const noexcept { return m_now; }
+    size_t   size () const noexcept { return m_count; }
+    bool     empty() const noexcept { return m_count == 0; }
+
+public:
+    void insert(TimerWheelHook* hook) noexcept;
+    void remove(TimerWheelHook* hook) noexcept;
+
+    uint64_t next_tick() const noexcept;
+
+    template<typename F>
+    void advance(uint64_t tick, F&& expire);
+
+    template<typename F>
+    void clear(F&& f);
+
+private:
+    void link  (TimerWheelHook* hook, uint64_t now) noexcept;
+    void unlink(TimerWheelHook* hook) noexcept;
+
+    TimerWheelHook* take(uint32_t level, uint32_t slot) noexcept;
+
+    static uint32_t find_first(const uint64_t (&bitmap)[WORD_COUNT], uint32_t from) noexcept;
+    static uint32_t count_trailing_zeros(uint64_t x) noexcept;
+};
+
+//---------------------------------------------------------------------------//
+// TimerWheel Methods
+//---------------------------------------------------------------------------//
+
+// hook->expiry に登録する. 既に過ぎていれば次のティックで期限切れになる
+inline void tapetums::TimerWheel::insert(TimerWheelHook* hook) noexcept
+{
+    if ( hook->expiry <= m_now )
+    {
+        hook->expiry = m_now + 1;
+    }
+
+    link(hook, m_now);
+    ++m_count;
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::TimerWheel::remove(TimerWheelHook* hook) noexcept
+{
+    if ( ! hook->linked )
+    {
+        return;
+    }
+
+    unlink(hook);
+    --m_count;
+}
+
+//---------------------------------------------------------------------------//
+
+// 次に何かが起きるティック (期限切れか, 上の段からの移し直し). なければ NEVER
+// 上の段は一周の始まりにしか見ないので, 実際の期限より早く返すことがある
+inline uint64_t tapetums::TimerWheel::next_tick() const noexcept
+{
+    if ( m_count == 0 )
+    {
+        return NEVER;
+    }
+
+    const auto base    = m_now & ~uint64_t(SLOT_MASK);
+    const auto current = static_cast<uint32_t>(m_now & SLOT_MASK);
+
+    // 最下段の今の周回の残り
+    auto next = NEVER;
+    const auto ahead = find_first(m_bitmap[0], current + 1);
+    if ( ahead < SLOT_COUNT )
+    {
+        return base + ahead;
+    }
+
+    // 最下段の次の周回
+    const auto wrapped = find_first(m_bitmap[0], 0);
+    if ( wrapped < SLOT_COUNT )
+    {
+        next = base + SLOT_COUNT + wrapped;
+    }
+
+    // 上の段があれば次の周回の始まりで移し直す
+    for ( uint32_t level = 1; level < LEVEL_COUNT; ++level )
+    {
+        if ( find_first(m_bitmap[level], 0) < SLOT_COUNT )
+        {
+            return base + SLOT_COUNT < next ? base + SLOT_COUNT : next;
+        }
+    }
+
+    return next;
+}
+
+//---------------------------------------------------------------------------//
+
+// tick まで時間を進め, 期限切れの要素ごとに expire(hook) を呼ぶ
+// expire に渡した要素は既にホイールから外れている
+template<typename F>
+inline void tapetums::TimerWheel::advance(uint64_t tick, F&& expire)
+{
+    while ( m_now < tick )
+    {
+        // 何も起きないティックは飛ばす
+        const auto next = next_tick();
+        if ( next > tick )
+        {
+            m_now = tick;
+            break;
+        }
+        m_now = next;
+
+        // 上の段の一周の始まりなら, 該当スロットを下の段へ移し直す
+        for ( uint32_t level = 1; level < LEVEL_COUNT; ++level )
+        {
+            const auto shift = SLOT_BITS * level;
+            if ( m_now & ((uint64_t(1) << shift) - 1) )
+            {
+                break;
+            }
+
+            auto hook = take(level, static_cast<uint32_t>((m_now >> shift) & SLOT_MASK));
+            while ( hook )
+            {
+                const auto next_hook = hook->next;
+                link(hook, m_now);
+                hook = next_hook;
+            }
+        }
+
+        auto hook = take(0, static_cast<uint32_t>(m_now & SLOT_MASK));
+        while ( hook )
+        {
+            const auto next_hook = hook->next;
+            hook->prev = hook->next = nullptr;
+            --m_count;
+            expire(hook);
+            hook = next_hook;
+        }
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// 全ての要素を外し, それぞれに f(hook) を呼ぶ
+template<typename F>
+inline void tapetums::TimerWheel::clear(F&& f)
+{
+    for ( uint32_t level = 0; level < LEVEL_COUNT; ++level )
+    {
+        for ( uint32_t slot = 0; slot < SLOT_COUNT; ++slot )
+        {
+            auto hook = take(level, slot);
+            while ( hook )
+            {
+                const auto next_hook = hook->next;
+                hook->prev = hook->next = nullptr;
+                f(hook);
+                hook = next_hook;
+            }
+        }
+    }
+
+    m_count = 0;
+}
+
+//---------------------------------------------------------------------------//
+// TimerWheel Inner Methods
+//---------------------------------------------------------------------------//
+
+// 期限までの距離から段とスロットを決めて先頭に繋ぐ
+// 移し直しの途中では期限が now と同じものがあり, その場合は今処理するスロットに入る
+inline void tapetums::TimerWheel::link(TimerWheelHook* hook, uint64_t now) noexcept
+{
+    const auto max_delta = (uint64_t(1) << (SLOT_BITS * LEVEL_COUNT)) - 1;
+    const auto delta     = hook->expiry > now ? hook->expiry - now : 0;
+
+    // 最上段にも収まらない遠い期限は, 最上段の端に置いておき移し直しのたびに近づける
+    const auto expiry = delta > max_delta ? now + max_delta : hook->expiry;
+
+    uint32_t level { 0 };
+    while ( level + 1 < LEVEL_COUNT && delta >= (uint64_t(1) << (SLOT_BITS * (level + 1))) )
+    {
+        ++level;
+    }
+
+    const auto slot = static_cast<uint32_t>((expiry >> (SLOT_BITS * level)) & SLOT_MASK);
+
+    auto& head = m_slots[level][slot];
+    hook->prev   = nullptr;
+    hook->next   = head;
+    hook->level  = level;
+    hook->slot   = slot;
+    hook->linked = true;
+    if ( head ) { head->prev = hook; }
+    head = hook;
+
+    m_bitmap[level][slot / 64] |= uint64_t(1) << (slot % 64);
+}
+
+//---------------------------------------------------------------------------//
+
+inline void tapetums::TimerWheel::unlink(TimerWheelHook* hook) noexcept
+{
+    auto& head = m_slots[hook->level][hook->slot];
+
+    if ( hook->prev ) { hook->prev->next = hook->next; }
+    else              { head = hook->next; }
+    if ( hook->next ) { hook->next->prev = hook->prev; }
+
+    if ( head == nullptr )
+    {
+        m_bitmap[hook->level][hook->slot / 64] &= ~(uint64_t(1) << (hook->slot % 64));
+    }
+
+    hook->prev = hook->next = nullptr;
+    hook->linked = false;
+}
+
+//---------------------------------------------------------------------------//
+
+// スロットの要素をまとめて外す (next で繋がったまま返す)
+inline tapetums::TimerWheelHook* tapetums::TimerWheel::take
+(
+    uint32_t level, uint32_t slot
+)
+noexcept
+{
+    auto head = m_slots[level][slot];
+    if ( head == nullptr )
+    {
+        return nullptr;
+    }
+
+    m_slots[level][slot] = nullptr;
+    m_bitmap[level][slot / 64] &= ~(uint64_t(1) << (slot % 64));
+
+    for ( auto hook = head; hook; hook = hook->next )
+    {
+        hook->linked = false;
+    }
+
+    return head;
+}
+
+//---------------------------------------------------------------------------//
+
+// from 以降で最初に立っているビットの位置. なければ SLOT_COUNT
+inline uint32_t tapetums::TimerWheel::find_first
+(
+    const uint64_t (&bitmap)[WORD_COUNT], uint32_t from
+)
+noexcept
+{
+    for ( auto word = from / 64; word < WORD_COUNT; ++word )
+    {
+        auto bits = bitmap[word];
+        if ( word == from / 64 )
+        {
+            bits &= ~uint64_t(0) << (from % 64);
+        }
+        if ( bits )
+        {
+            return word * 64 + count_trailing_zeros(bits);
+        }
+    }
+
+    return SLOT_COUNT;
+}
+
+//---------------------------------------------------------------------------//
+
+inline uint32_t tapetums::TimerWheel::count_trailing_zeros(uint64_t x) noexcept
+{
+  #if defined(_MSC_VER)
+    unsigned long index;
+    if ( _BitScanForward(&index, static_cast<unsigned long>(x)) )
+    {
+        return index;
+    }
+    _BitScanForward(&index, static_cast<unsigned long>(x >> 32));
+    return index + 32;
+  #else
+    return static_cast<uint32_t>(__builtin_ctzll(x));
+  #endif
+}
+
+//---------------------------------------------------------------------------//
+
+// TimerWheel.hpp
\ No newline at end of file
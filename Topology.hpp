@@ -0,0 +1,517 @@
+﻿#pragma once
+
+//---------------------------------------------------------------------------//
+//
+// Topology.hpp
+//  CPU トポロジの取得とスレッドの固定
+//   Copyright (C) 2017 tapetums
+//
+//---------------------------------------------------------------------------//
+
+#include <cstdint>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+  #include <windows.h>
+#else
+  #include <dirent.h>
+  #include <sched.h>
+  #include <fstream>
+#endif
+
+//---------------------------------------------------------------------------//
+// Forward Declarations
+//---------------------------------------------------------------------------//
+
+namespace tapetums
+{
+    struct CpuInfo;
+    class  CpuTopology;
+}
+
+//---------------------------------------------------------------------------//
+// CpuInfo
+//  論理プロセッサひとつ分の情報
+//  core / package / node / llc は 0 から振り直した通し番号
+//---------------------------------------------------------------------------//
+
+struct tapetums::CpuInfo
+{
+    uint32_t id;      // OS 上の番号 (Windows ではグループ内の番号)
+    uint32_t group;   // プロセッサグループ (Windows のみ. それ以外は 0)
+    uint32_t core;    // 物理コア
+    uint32_t package; // ソケット
+    uint32_t node;    // NUMA ノード
+    uint32_t llc;     // 最終段キャッシュ (L3) を共有する組
+};
+
+//---------------------------------------------------------------------------//
+// CpuTopology
+//  このプロセスが使える論理プロセッサの一覧
+//---------------------------------------------------------------------------//
+
+class tapetums::CpuTopology final
+{
+public:
+    // ふたつの論理プロセッサの間の遠さ
+    enum DISTANCE : uint32_t
+    {
+        SAME_CORE    = 0,
+        SAME_LLC     = 1,
+        SAME_NODE    = 2,
+        REMOTE       = 3,
+        DISTANCE_MAX = 4,
+    };
+
+private:
+    std::vector<CpuInfo> m_cpus;
+
+    uint32_t m_core_count    { 0 };
+    uint32_t m_package_count { 0 };
+    uint32_t m_node_count    { 0 };
+    uint32_t m_llc_count     { 0 };
+
+public:
+    CpuTopology();
+    ~CpuTopology() = default;
+
+    CpuTopology(const CpuTopology&)             = default;
+    CpuTopology& operator =(const CpuTopology&) = default;
+
+    CpuTopology(CpuTopology&&)             noexcept = default;
+    CpuTopology& operator =(CpuTopology&&) noexcept = default;
+
+public:
+    static const CpuTopology& Get();
+
+public:
+    size_t   cpu_count    () const noexcept { return m_cpus.size(); }
+    uint32_t core_count   () const noexcept { return m_core_count; }
+    uint32_t package_count() const noexcept { return m_package_count; }
+    uint32_t node_count   () const noexcept { return m_node_count; }
+    uint32_t llc_count    () const noexcept { return m_llc_count; }
+
+    const CpuInfo& operator [](size_t index) const noexcept { return m_cpus[index]; }
+
+    auto begin() const noexcept { return m_cpus.begin(); }
+    auto end  () const noexcept { return m_cpus.end(); }
+
+public:
+    DISTANCE distance(size_t a, size_t b) const noexcept;
+
+    std::vector<size_t> PlacementOrder() const;
+
+    bool PinCurrentThread(size_t index) const noexcept;
+
+private:
+    void discover();
+    void fallback(uint32_t count);
+    void renumber();
+
+  #if ! defined(_WIN32)
+    static std::vector<uint32_t> parse_cpu_list(const std::string& text);
+    static bool read_text(const std::string& path, std::string& text);
+  #endif
+};
+
+//---------------------------------------------------------------------------//
+// CpuTopology ctor
+//---------------------------------------------------------------------------//
+
+inline tapetums::CpuTopology::CpuTopology()
+{
+    discover();
+
+    if ( m_cpus.empty() )
+    {
+        fallback(1);
+    }
+
+    renumber();
+}
+
+//---------------------------------------------------------------------------//
+// CpuTopology Methods
+//---------------------------------------------------------------------------//
+
+// 起動時に一度だけ調べた結果を返す
+inline const tapetums::CpuTopology& tapetums::CpuTopology::Get()
+{
+    static const CpuTopology topology;
+
+    return topology;
+}
+
+//---------------------------------------------------------------------------//
+
+inline tapetums::CpuTopology::DISTANCE tapetums::CpuTopology::distance
+(
+    size_t a, size_t b
+)
+const noexcept
+{
+    const auto& lhs = m_cpus[a];
+    const auto& rhs = m_cpus[b];
+
+    if ( lhs.core == rhs.core ) { return SAME_CORE; }
+    if ( lhs.llc  == rhs.llc  ) { return SAME_LLC;  }
+    if ( lhs.node == rhs.node ) { return SAME_NODE; }
+
+    return REMOTE;
+}
+
+//---------------------------------------------------------------------------//
+
+// ワーカーを割り当てる順番 (インデックスの並び)
+// まず物理コアごとにひとつずつ, 埋まったら SMT の兄弟スレッドを使う
+// 同じ順位の中ではノード → L3 の順にまとめ, 近いワーカー同士が近いコアに乗るようにする
+inline std::vector<size_t> tapetums::CpuTopology::PlacementOrder() const
+{
+    std::vector<uint32_t> rank(m_cpus.size());
+    {
+        std::vector<uint32_t> used(m_core_count, 0);
+        for ( size_t i = 0; i < m_cpus.size(); ++i )
+        {
+            rank[i] = used[m_cpus[i].core]++;
+        }
+    }
+
+    std::vector<size_t> order(m_cpus.size());
+    for ( size_t i = 0; i < order.size(); ++i )
+    {
+        order[i] = i;
+    }
+
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+    {
+        const auto& lhs = m_cpus[a];
+        const auto& rhs = m_cpus[b];
+
+        return std::make_tuple(rank[a], lhs.node, lhs.llc, lhs.core)
+             < std::make_tuple(rank[b], rhs.node, rhs.llc, rhs.core);
+    });
+
+    return order;
+}
+
+//---------------------------------------------------------------------------//
+
+// 呼び出し元のスレッドを index 番目の論理プロセッサに固定する
+inline bool tapetums::CpuTopology::PinCurrentThread(size_t index) const noexcept
+{
+    if ( index >= m_cpus.size() )
+    {
+        return false;
+    }
+
+    const auto& cpu = m_cpus[index];
+
+  #if defined(_WIN32)
+    GROUP_AFFINITY affinity { };
+    affinity.Mask  = KAFFINITY(1) << cpu.id;
+    affinity.Group = static_cast<WORD>(cpu.group);
+
+    return ::SetThreadGroupAffinity(::GetCurrentThread(), &affinity, nullptr) != FALSE;
+  #else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu.id, &set);
+
+    return ::sched_setaffinity(0, sizeof(set), &set) == 0;
+  #endif
+}
+
+//---------------------------------------------------------------------------//
+// CpuTopology Inner Methods
+//---------------------------------------------------------------------------//
+
+#if defined(_WIN32)
+
+// GetLogicalProcessorInformationEx() の結果から組み立てる
+inline void tapetums::CpuTopology::discover()
+{
+    DWORD size { 0 };
+    ::GetLogicalProcessorInformationEx(RelationAll, nullptr, &size);
+    if ( size == 0 )
+    {
+        fallback(::GetActiveProcessorCount(ALL_PROCESSOR_GROUPS));
+        return;
+    }
+
+    std::vector<BYTE> buffer(size);
+    const auto info = reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(buffer.data());
+    if ( ! ::GetLogicalProcessorInformationEx(RelationAll, info, &size) )
+    {
+        fallback(::GetActiveProcessorCount(ALL_PROCESSOR_GROUPS));
+        return;
+    }
+
+    // (グループ, 番号) → m_cpus のインデックス
+    std::map<std::pair<uint32_t, uint32_t>, size_t> index;
+
+    const auto for_each_cpu = [](const GROUP_AFFINITY& mask, auto&& f)
+    {
+        for ( uint32_t bit = 0; bit < sizeof(KAFFINITY) * 8; ++bit )
+        {
+            if ( mask.Mask & (KAFFINITY(1) << bit) )
+            {
+                f(uint32_t(mask.Group), bit);
+            }
+        }
+    };
+
+    // 1 周目でコアとパッケージ, 2 周目で NUMA ノードとキャッシュを埋める
+    uint32_t core_id { 0 }, package_id { 0 };
+    for ( DWORD offset = 0; offset < size; )
+    {
+        const auto p = reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(buffer.data() + offset);
+
+        if ( p->Relationship == RelationProcessorCore )
+        {
+            for ( WORD i = 0; i < p->Processor.GroupCount; ++i )
+            {
+                for_each_cpu(p->Processor.GroupMask[i], [&](uint32_t group, uint32_t id)
+                {
+                    index[{ group, id }] = m_cpus.size();
+                    m_cpus.push_back(CpuInfo{ id, group, core_id, 0, 0, core_id });
+                });
+            }
+            ++core_id;
+        }
+
+        offset += p->Size;
+    }
+    for ( DWORD offset = 0; offset < size; )
+    {
+        const auto p = reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(buffer.data() + offset);
+
+        const auto apply = [&](const GROUP_AFFINITY& mask, uint32_t CpuInfo::* field, uint32_t value)
+        {
+            for_each_cpu(mask, [&](uint32_t group, uint32_t id)
+            {
+                const auto it = index.find({ group, id });
+                if ( it != index.end() )
+                {
+                    m_cpus[it->second].*field = value;
+                }
+            });
+        };
+
+        if ( p->Relationship == RelationProcessorPackage )
+        {
+            for ( WORD i = 0; i < p->Processor.GroupCount; ++i )
+            {
+                apply(p->Processor.GroupMask[i], &CpuInfo::package, package_id);
+            }
+            ++package_id;
+        }
+        else if ( p->Relationship == RelationNumaNode )
+        {
+            apply(p->NumaNode.GroupMask, &CpuInfo::node, p->NumaNode.NodeNumber);
+        }
+        else if ( p->Relationship == RelationCache && p->Cache.Level == 3 )
+        {
+            // L3 を共有する組はマスクの最初のプロセッサで識別する
+            const auto& mask = p->Cache.GroupMask;
+            uint32_t first { 0 };
+            while ( first < sizeof(KAFFINITY) * 8 && ! (mask.Mask & (KAFFINITY(1) << first)) )
+            {
+                ++first;
+            }
+            apply(mask, &CpuInfo::llc, 0x10000 + mask.Group * 64 + first);
+        }
+
+        offset += p->Size;
+    }
+}
+
+#else
+
+// /sys/devices/system/cpu と /sys/devices/system/node から組み立てる
+// sched_getaffinity() で許可されたプロセッサだけを対象にする
+inline void tapetums::CpuTopology::discover()
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if ( ::sched_getaffinity(0, sizeof(set), &set) != 0 )
+    {
+        return;
+    }
+
+    const std::string root { "/sys/devices/system/cpu/cpu" };
+
+    for ( uint32_t id = 0; id < CPU_SETSIZE; ++id )
+    {
+        if ( ! CPU_ISSET(id, &set) )
+        {
+            continue;
+        }
+
+        const auto dir = root + std::to_string(id);
+
+        CpuInfo cpu { id, 0, id, 0, 0, id };
+        std::string text;
+
+        if ( read_text(dir + "/topology/physical_package_id", text) )
+        {
+            cpu.package = static_cast<uint32_t>(std::stoul(text));
+        }
+        if ( read_text(dir + "/topology/core_id", text) )
+        {
+            // core_id はパッケージの中での番号なので, パッケージと組にする
+            cpu.core = (cpu.package << 16) | static_cast<uint32_t>(std::stoul(text));
+        }
+
+        // 最も深いキャッシュを共有するプロセッサの組 (先頭の番号で識別する)
+        uint32_t deepest { 0 };
+        for ( uint32_t index = 0; ; ++index )
+        {
+            const auto cache = dir + "/cache/index" + std::to_string(index);
+            if ( ! read_text(cache + "/level", text) )
+            {
+                break;
+            }
+
+            const auto level = static_cast<uint32_t>(std::stoul(text));
+            if ( level < deepest || ! read_text(cache + "/shared_cpu_list", text) )
+            {
+                continue;
+            }
+
+            const auto list = parse_cpu_list(text);
+            if ( ! list.empty() )
+            {
+                deepest = level;
+                cpu.llc = list.front();
+            }
+        }
+
+        m_cpus.push_back(cpu);
+    }
+
+    // NUMA ノード (node0, node1, ...) ごとの cpulist を当てはめる
+    const auto nodes = ::opendir("/sys/devices/system/node");
+    if ( nodes == nullptr )
+    {
+        return;
+    }
+    while ( const auto entry = ::readdir(nodes) )
+    {
+        const std::string name { entry->d_name };
+        if ( name.size() <= 4 || name.compare(0, 4, "node") != 0 ||
+             name.find_first_not_of("0123456789", 4) != std::string::npos )
+        {
+            continue;
+        }
+
+        std::string text;
+        if ( ! read_text("/sys/devices/system/node/" + name + "/cpulist", text) )
+        {
+            continue;
+        }
+
+        const auto node = static_cast<uint32_t>(std::stoul(name.substr(4)));
+        for ( const auto id : parse_cpu_list(text) )
+        {
+            for ( auto& cpu : m_cpus )
+            {
+                if ( cpu.id == id ) { cpu.node = node; }
+            }
+        }
+    }
+    ::closedir(nodes);
+}
+
+//---------------------------------------------------------------------------//
+
+// "0-3,8,10-11" のような一覧を展開する
+inline std::vector<uint32_t> tapetums::CpuTopology::parse_cpu_list
+(
+    const std::string& text
+)
+{
+    std::vector<uint32_t> list;
+
+    size_t pos { 0 };
+    while ( pos < text.size() )
+    {
+        auto end = text.find(',', pos);
+        if ( end == std::string::npos ) { end = text.size(); }
+
+        const auto item = text.substr(pos, end - pos);
+        const auto dash = item.find('-');
+        if ( ! item.empty() && item.find_first_of("0123456789") != std::string::npos )
+        {
+            const auto first = static_cast<uint32_t>(std::stoul(item));
+            const auto last  = dash == std::string::npos ? first
+                             : static_cast<uint32_t>(std::stoul(item.substr(dash + 1)));
+            for ( auto id = first; id <= last; ++id )
+            {
+                list.push_back(id);
+            }
+        }
+
+        pos = end + 1;
+    }
+
+    return list;
+}
+
+//---------------------------------------------------------------------------//
+
+inline bool tapetums::CpuTopology::read_text(const std::string& path, std::string& text)
+{
+    std::ifstream file(path);
+    if ( ! file || ! std::getline(file, text) )
+    {
+        return false;
+    }
+
+    return ! text.empty();
+}
+
+#endif
+
+//---------------------------------------------------------------------------//
+
+// トポロジが取れなかったときは, 全てのプロセッサが別々のコアで L3 を共有しているとみなす
+inline void tapetums::CpuTopology::fallback(uint32_t count)
+{
+    m_cpus.clear();
+    for ( uint32_t id = 0; id < std::max(count, 1u); ++id )
+    {
+        m_cpus.push_back(CpuInfo{ id, 0, id, 0, 0, 0 });
+    }
+}
+
+//---------------------------------------------------------------------------//
+
+// OS 上の識別子を 0 から始まる通し番号に振り直す
+inline void tapetums::CpuTopology::renumber()
+{
+    const auto compact = [this](uint32_t CpuInfo::* field) -> uint32_t
+    {
+        std::map<uint32_t, uint32_t> ids;
+        for ( auto& cpu : m_cpus )
+        {
+            const auto it = ids.emplace(cpu.*field, static_cast<uint32_t>(ids.size())).first;
+            cpu.*field = it->second;
+        }
+        return static_cast<uint32_t>(ids.size());
+    };
+
+    m_core_count    = compact(&CpuInfo::core);
+    m_package_count = compact(&CpuInfo::package);
+    m_node_count    = compact(&CpuInfo::node);
+    m_llc_count     = compact(&CpuInfo::llc);
+}
+
+//---------------------------------------------------------------------------//
+
+// Topology.hpp
\ No newline at end of file
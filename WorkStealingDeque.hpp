@@ -0,0 +1,218 @@
+﻿#pragma once
+
+//---------------------------------------------------------------------------//
+//
+// WorkStealingDeque.hpp
+//  ワークスティーリング用のロックフリー両端キュー (Chase-Lev)
+//   Copyright (C) 2017 tapetums
+//
+//  See Also:
+//   D. Chase, Y. Lev, "Dynamic Circular Work-Stealing Deque" (SPAA 2005)
+//   N. M. Le et al., "Correct and Efficient Work-Stealing for Weak
+//    Memory Models" (PPoPP 2013)
+//
+//---------------------------------------------------------------------------//
+
+#include <cstdint>
+
+#include <atomic>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+//---------------------------------------------------------------------------//
+// Forward Declarations
+//---------------------------------------------------------------------------//
+
+namespace tapetums
+{
+    template<typename T> class WorkStealingDeque;
+}
+
+//---------------------------------------------------------------------------//
+// WorkStealingDeque Class
+//  所有スレッドは末尾 (bottom) に push / pop する (LIFO)
+//  他のスレッドは先頭 (top) から steal する (FIFO)
+//---------------------------------------------------------------------------//
+
+template<typename T>
+class tapetums::WorkStealingDeque final
+{
+    static_assert
+    (
+        std::is_trivially_copyable<T>::value, "T must be trivially copyable"
+    );
+
+private:
+    static constexpr size_t CACHE_LINE { 64 };
+
+    struct Buffer
+    {
+        int64_t capacity;
+        int64_t mask;
+        std::unique_ptr<std::atomic<T>[]> slots;
+
+        explicit Buffer(int64_t cap)
+            : capacity(cap), mask(cap - 1), slots(new std::atomic<T>[cap]) { }
+
+        T get(int64_t i) const noexcept
+        {
+            return slots[i & mask].load(std::memory_order_relaxed);
+        }
+
+        void put(int64_t i, T x) noexcept
+        {
+            slots[i & mask].store(x, std::memory_order_relaxed);
+        }
+    };
+
+private:
+    // top と bottom は別々のキャッシュラインに置く
+    // (C++14 の new は過剰アラインメントを保証しないので alignas ではなく詰め物で分ける)
+    std::atomic<int64_t> m_top    { 0 };
+    char m_pad0 [CACHE_LINE - sizeof(std::atomic<int64_t>)];
+    std::atomic<int64_t> m_bottom { 0 };
+    char m_pad1 [CACHE_LINE - sizeof(std::atomic<int64_t>)];
+    std::atomic<Buffer*> m_buffer { nullptr };
+
+    // 拡張前のバッファ (steal 中のスレッドが参照している可能性があるため破棄しない)
+    std::vector<std::unique_ptr<Buffer>> m_buffers;
+
+public:
+    explicit WorkStealingDeque(int64_t capacity = 256);
+
+    WorkStealingDeque(const WorkStealingDeque&)             = delete;
+    WorkStealingDeque& operator =(const WorkStealingDeque&) = delete;
+
+    WorkStealingDeque(WorkStealingDeque&&)             = delete;
+    WorkStealingDeque& operator =(WorkStealingDeque&&) = delete;
+
+    ~WorkStealingDeque() = default;
+
+public:
+    bool   empty() const noexcept { return size() == 0; }
+    size_t size () const noexcept;
+
+public:
+    void push (T x);      // 所有スレッドのみ
+    bool pop  (T& x);     // 所有スレッドのみ
+    bool steal(T& x);     // 任意のスレッド
+};
+
+//---------------------------------------------------------------------------//
+// WorkStealingDeque ctor
+//---------------------------------------------------------------------------//
+
+template<typename T>
+inline tapetums::WorkStealingDeque<T>::WorkStealingDeque(int64_t capacity)
+{
+    // 容量は 2 のべき乗に切り上げる
+    int64_t cap { 2 };
+    while ( cap < capacity ) { cap <<= 1; }
+
+    m_buffers.emplace_back(new Buffer(cap));
+    m_buffer.store(m_buffers.back().get(), std::memory_order_relaxed);
+}
+
+//---------------------------------------------------------------------------//
+// WorkStealingDeque Methods
+//---------------------------------------------------------------------------//
+
+template<typename T>
+inline size_t tapetums::WorkStealingDeque<T>::size() const noexcept
+{
+    const auto b = m_bottom.load(std::memory_order_relaxed);
+    const auto t = m_top.load   (std::memory_order_relaxed);
+
+    return (b > t) ? static_cast<size_t>(b - t) : 0;
+}
+
+//---------------------------------------------------------------------------//
+
+template<typename T>
+inline void tapetums::WorkStealingDeque<T>::push(T x)
+{
+    const auto b = m_bottom.load(std::memory_order_relaxed);
+    const auto t = m_top.load   (std::memory_order_acquire);
+    auto a = m_buffer.load(std::memory_order_relaxed);
+
+    if ( b - t > a->capacity - 1 )
+    {
+        // 満杯なので倍の容量のバッファに移し替える
+        auto p = new Buffer(a->capacity * 2);
+        for ( auto i = t; i < b; ++i )
+        {
+            p->put(i, a->get(i));
+        }
+        m_buffers.emplace_back(p);
+
+        a = p;
+        m_buffer.store(a, std::memory_order_release);
+    }
+
+    a->put(b, x);
+    std::atomic_thread_fence(std::memory_order_release);
+    m_bottom.store(b + 1, std::memory_order_relaxed);
+}
+
+//---------------------------------------------------------------------------//
+
+template<typename T>
+inline bool tapetums::WorkStealingDeque<T>::pop(T& x)
+{
+    const auto b = m_bottom.load(std::memory_order_relaxed) - 1;
+    const auto a = m_buffer.load(std::memory_order_relaxed);
+    m_bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto t = m_top.load(std::memory_order_relaxed);
+
+    if ( t > b )
+    {
+        // 空だった
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return false;
+    }
+
+    x = a->get(b);
+    if ( t < b )
+    {
+        // 残り 2 つ以上なので steal と競合しない
+        return true;
+    }
+
+    // 最後の 1 つは steal と奪い合う
+    const auto won = m_top.compare_exchange_strong
+    (
+        t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed
+    );
+    m_bottom.store(b + 1, std::memory_order_relaxed);
+
+    return won;
+}
+
+//---------------------------------------------------------------------------//
+
+template<typename T>
+inline bool tapetums::WorkStealingDeque<T>::steal(T& x)
+{
+    auto t = m_top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const auto b = m_bottom.load(std::memory_order_acquire);
+
+    if ( t >= b )
+    {
+        return false;
+    }
+
+    const auto a = m_buffer.load(std::memory_order_acquire);
+    x = a->get(t);
+
+    return m_top.compare_exchange_strong
+    (
+        t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed
+    );
+}
+
+//---------------------------------------------------------------------------//
+
+// WorkStealingDeque.hpp
\ No newline at end of file